@@ -2,19 +2,57 @@
 
 #include <CL/opencl.hpp>
 
-struct cl_Ray {
-  cl_float3 origin;
-  cl_float3 direction;
+// packed origin and an octahedral unit direction, see kernels/path.cl
+struct cl_PathState {
+  cl_float origin[3];
+  cl_uint direction;
+};
+
+struct cl_Camera {
+  cl_float3 pos;
+  cl_float2 rot;
+  cl_float focal;
 };
 
 struct cl_Material {
   cl_float3 colour;
   cl_float spec;
   cl_float diff;
+  cl_int texture;
+  cl_float texture_scale;
 };
 
-struct cl_Obj {
-  cl_float3 pos;
-  int type;
-  cl_float3 params;
+struct cl_PathHit {
+  cl_float t;
+  cl_int obj;
+};
+
+// see Light in kernels/path.cl, pos.w is the radius and emission.w the shape
+struct cl_Light {
+  cl_float4 pos;
+  cl_float4 emission;
+  cl_float4 edge_u;
+  cl_float4 edge_v;
+};
+
+struct cl_LightNode {
+  cl_float lo[3];
+  cl_float power;
+  cl_float hi[3];
+  cl_int child;
+};
+
+// one bin of an environment alias table
+struct cl_AliasEntry {
+  cl_float threshold;
+  cl_int alias;
+};
+
+// one texture's tiles in the atlas, levels below first_level were left out
+struct cl_TextureInfo {
+  cl_int width;
+  cl_int height;
+  cl_int levels;
+  cl_int first_level;
+  cl_int level_tile[16];
 };
@@ -1,5 +1,26 @@
 #include "objects.hpp"
 #include <cmath>
+#include <algorithm>
+
+namespace {
+
+constexpr pos_type PI = 3.14159265358979323;
+
+}
+
+auto tangents(point n, point& t1, point& t2) -> void {
+  const pos_type sign = std::copysign(1.0, n.z);
+  const pos_type a = -1 / (sign + n.z);
+  const pos_type b = n.x*n.y*a;
+  t1 = point(1 + sign*n.x*n.x*a, sign*b, -sign*n.x);
+  t2 = point(b, sign + n.y*n.y*a, -n.y);
+}
+
+void object::occludedPacket(const ray* rays, const pos_type* tmax, int count, bool* blocked) const {
+  for (int i = 0; i<count; i++) {
+    blocked[i] = blocked[i] || this->occluded(rays[i], tmax[i]);
+  }
+}
 
 [[nodiscard]]
 pos_type sphere::f(point p) {
@@ -7,40 +28,99 @@ pos_type sphere::f(point p) {
 }
 
 [[nodiscard]]
-hit sphere::intersect(ray r) const {
+pos_type sphere::distance(const ray& r) const {
   const point oc = r.e - this->centre;
   const pos_type a = dot(r.d, r.d);
-  const pos_type b = 2.0 * dot(oc, r.d);
+  const pos_type half_b = dot(oc, r.d);
   const pos_type c = dot(oc, oc) - (this->radius*this->radius);
-  const pos_type d = b*b - 4*a*c;
+
+  // outside and pointing away
+  if (c > 0 && half_b > 0) {
+    return NO_HIT;
+  }
+
+  const pos_type d = half_b*half_b - a*c;
 
   if (d < 0) {
-    return hit{.intersect=false};
+    return NO_HIT;
   }
 
-  const pos_type t = (-b - sqrt(d)) / (2.0*a);
+  const pos_type t = (-half_b - sqrt(d)) / a;
+
+  return t>0 ? t : NO_HIT;
+}
+
+[[nodiscard]]
+bool sphere::occluded(const ray& r, pos_type tmax) const {
+  return this->distance(r) < tmax;
+}
+
+[[nodiscard]]
+hit sphere::surface(const ray& r, pos_type t) const {
+  const point pos = r.e + (r.d * t);
+  const point normal = (pos - this->centre) / this->radius;
 
-  point pos = r.p(t);
+  if (this->texture < 0) {
+    return hit{.depth = t, .pos = pos, .normal = normal};
+  }
 
+  // longitude and latitude, u spans the equator
   return hit{
-    .intersect = t>0,
     .depth = t,
     .pos = pos,
-    .normal = (pos - this->centre).norm()
+    .normal = normal,
+    .u = 0.5 + std::atan2(normal.y, normal.x) / (2*PI),
+    .v = std::acos(std::clamp(normal.z, -1.0, 1.0)) / PI,
+    .uv_size = 2*PI*this->radius
   };
 }
 
+void sphere::translate(point offset) {
+  this->centre += offset;
+}
+
+[[nodiscard]]
+pos_type plane::distance(const ray& r) const {
+  const pos_type denom = dot(r.d, this->normal);
+
+  // parallel rays never hit
+  if (denom == 0) {
+    return NO_HIT;
+  }
+
+  const pos_type t = dot(this->vertex - r.e, this->normal) / denom;
+
+  return t>0 ? t : NO_HIT;
+}
+
 [[nodiscard]]
-hit plane::intersect(ray r) const {
-  const pos_type t = dot(this->vertex - r.e, this->normal) / dot(r.d, this->normal);
+bool plane::occluded(const ray& r, pos_type tmax) const {
+  return this->distance(r) < tmax;
+}
 
-  // return t;
-  auto pos = r.p(t);
+[[nodiscard]]
+hit plane::surface(const ray& r, pos_type t) const {
+  const point pos = r.e + (r.d * t);
+  const point normal = this->normal.norm();
+
+  if (this->texture < 0) {
+    return hit{.depth = t, .pos = pos, .normal = normal};
+  }
+
+  // projected onto the plane's tangents, so the mapping ignores the vertex
+  point t1, t2;
+  tangents(normal, t1, t2);
 
   return hit{
-    .intersect = t>0,
     .depth = t,
     .pos = pos,
-    .normal = this->normal.norm()
+    .normal = normal,
+    .u = dot(pos, t1) / this->texture_scale,
+    .v = dot(pos, t2) / this->texture_scale,
+    .uv_size = this->texture_scale
   };
 }
+
+void plane::translate(point offset) {
+  this->vertex += offset;
+}
@@ -1,25 +1,51 @@
 #pragma once
+#include <limits>
 #include "point.hpp"
 #include "ray.hpp"
 
+// returned by distance() when the ray misses
+constexpr pos_type NO_HIT = std::numeric_limits<pos_type>::infinity();
+
+// surface data, only built for the final closest hit. Textured objects also
+// get texture coordinates, and uv_size is the world length of one unit of them
 struct hit {
-  bool intersect;
   pos_type depth;
   point pos;
   point normal;
+  pos_type u = 0;
+  pos_type v = 0;
+  pos_type uv_size = 1;
 };
 
+// tangents of a unit normal (Duff et al. 2017), also used by path.cl
+auto tangents(point n, point& t1, point& t2) -> void;
+
 class object {
 public:
   point colour;
   pos_type specular = 0.5;
   pos_type diffuse = 1.0;
+  // index into the texture cache replacing colour, -1 for none. Planes repeat
+  // it every texture_scale units
+  int texture = -1;
+  pos_type texture_scale = 1.0;
   // object();
   constexpr virtual ~object() {};
   constexpr object(point c) : colour(c) {};
   constexpr object(point c, pos_type spec, pos_type dif)
     : colour(c), specular(spec), diffuse(dif) {};
-  virtual hit intersect(ray r) const = 0;
+
+  // closest-hit query, distance along r or NO_HIT
+  virtual pos_type distance(const ray& r) const = 0;
+  // any-hit query, true if something is hit before tmax
+  virtual bool occluded(const ray& r, pos_type tmax) const = 0;
+  // occluded() for count rays, sets blocked[i] if rays[i] is hit before
+  // tmax[i]. Rays already blocked are skipped
+  virtual void occludedPacket(const ray* rays, const pos_type* tmax, int count, bool* blocked) const;
+  // surface interaction at a distance returned by distance()
+  virtual hit surface(const ray& r, pos_type t) const = 0;
+  // rigid move, used between animation frames
+  virtual void translate(point offset) = 0;
 };
 
 // x, y, z, corresponds to centre
@@ -33,7 +59,10 @@ public:
     : object(colour, spec, dif), centre(c), radius(r) {};
   constexpr ~sphere() {};
 
-  hit intersect(ray r) const;
+  pos_type distance(const ray& r) const;
+  bool occluded(const ray& r, pos_type tmax) const;
+  hit surface(const ray& r, pos_type t) const;
+  void translate(point offset);
   pos_type f(point p);
 };
 
@@ -48,5 +77,8 @@ public:
     : object(colour, spec, dif), vertex(v), normal(n) {};
   constexpr ~plane() {};
 
-  hit intersect(ray r) const;
+  pos_type distance(const ray& r) const;
+  bool occluded(const ray& r, pos_type tmax) const;
+  hit surface(const ray& r, pos_type t) const;
+  void translate(point offset);
 };
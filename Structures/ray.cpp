@@ -21,3 +21,14 @@ auto rayDir(pos_type fov, pos_type x, pos_type y) -> ray {
     point(x-(WIDTH/2.0), ypart, -(y-HEIGHT/2.0))
   );
 }
+
+auto rayDir(const camera& cam, pos_type fov, pos_type x, pos_type y) -> ray {
+  const ray r = rayDir(fov, x, y);
+  const pos_type c = cos(cam.yaw);
+  const pos_type s = sin(cam.yaw);
+
+  return ray(
+    cam.pos,
+    point(c*r.d.x - s*r.d.y, s*r.d.x + c*r.d.y, r.d.z)
+  );
+}
@@ -8,8 +8,17 @@ struct ray {
   point e;
   point d;
 
+  ray() = default;
   ray(point start, point dir) : e(start), d(dir) {};
   point p(pos_type t);
 };
 
+// eye position and rotation about z (up), the default looks down +y from
+// the origin
+struct camera {
+  point pos;
+  pos_type yaw = 0;
+};
+
 auto rayDir(pos_type fov, pos_type x, pos_type y) -> ray;
+auto rayDir(const camera& cam, pos_type fov, pos_type x, pos_type y) -> ray;
@@ -0,0 +1,370 @@
+#include "sdf.hpp"
+#include "../common.hpp"
+#include <cmath>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+
+// rays from a hit start on the surface, they are marched from this far along
+// so they can't hit it again straight away
+constexpr pos_type START_OFFSET = 0.01;
+
+auto lowest(point a, point b) -> point {
+  return point(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z));
+}
+
+auto highest(point a, point b) -> point {
+  return point(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z));
+}
+
+// range of t where r is inside [lo, hi], false if it never is
+auto slabs(const ray& r, point lo, point hi, pos_type& t0, pos_type& t1) -> bool {
+  const point inv = point(1/r.d.x, 1/r.d.y, 1/r.d.z);
+  const point a = (lo - r.e) * inv;
+  const point b = (hi - r.e) * inv;
+
+  t0 = std::max({std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z), 0.0});
+  t1 = std::min({std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z)});
+
+  return t0 <= t1;
+}
+
+auto smoothMin(pos_type a, pos_type b, pos_type k) -> pos_type {
+  const pos_type h = std::clamp(0.5 + 0.5*(b - a)/k, 0.0, 1.0);
+  return b + (a - b)*h - k*h*(1 - h);
+}
+
+}
+
+sdf::sdf(std::vector<sdf_node> program, point colour, pos_type spec, pos_type dif)
+  : object(colour, spec, dif), program(std::move(program)), bound(1) {
+  // bounds of every value on the stack, built the way evaluate() builds them
+  std::vector<std::pair<point, point>> boxes;
+
+  for (const sdf_node& n : this->program) {
+    switch (n.op) {
+      case sdf_sphere:
+        boxes.emplace_back(n.centre - n.size.x, n.centre + n.size.x);
+        break;
+      case sdf_box:
+        boxes.emplace_back(n.centre - n.size, n.centre + n.size);
+        break;
+      case sdf_torus: {
+        const point extent = point(n.size.x + n.size.y, n.size.x + n.size.y, n.size.y);
+        boxes.emplace_back(n.centre - extent, n.centre + extent);
+        break;
+      }
+      case sdf_union:
+      case sdf_smooth_union: {
+        if (boxes.size() < 2 || (n.op == sdf_smooth_union && n.k <= 0)) {
+          throw std::runtime_error("sdf: bad union in program");
+        }
+
+        const auto [b_lo, b_hi] = boxes.back();
+        boxes.pop_back();
+
+        // the smooth minimum is at most k/4 below the plain one
+        const pos_type grow = n.op == sdf_smooth_union ? n.k/4 : 0;
+        boxes.back().first = lowest(boxes.back().first, b_lo) - grow;
+        boxes.back().second = highest(boxes.back().second, b_hi) + grow;
+        break;
+      }
+      case sdf_displace:
+        if (boxes.empty()) {
+          throw std::runtime_error("sdf: displacement of nothing in program");
+        }
+
+        boxes.back().first = boxes.back().first - std::abs(n.size.x);
+        boxes.back().second = boxes.back().second + std::abs(n.size.x);
+
+        // every partial derivative of the displacement is at most size.x*k
+        bound += std::abs(n.size.x*n.k) * std::sqrt(3.0);
+        break;
+    }
+
+    if (boxes.size() > MAX_STACK) {
+      throw std::runtime_error("sdf: program needs too deep a stack");
+    }
+  }
+
+  if (boxes.size() != 1) {
+    throw std::runtime_error("sdf: program must leave one distance");
+  }
+
+  lo = boxes[0].first;
+  hi = boxes[0].second;
+}
+
+[[nodiscard]]
+auto sdf::evaluate(point p) const -> pos_type {
+  pos_type stack[MAX_STACK];
+  int top = 0;
+
+  for (const sdf_node& n : this->program) {
+    const point q = p - n.centre;
+
+    switch (n.op) {
+      case sdf_sphere:
+        stack[top++] = q.length() - n.size.x;
+        break;
+      case sdf_box: {
+        const point e = point(std::abs(q.x), std::abs(q.y), std::abs(q.z)) - n.size;
+        const point outside = highest(e, point(0,0,0));
+        stack[top++] = outside.length() + std::min(std::max({e.x, e.y, e.z}), 0.0);
+        break;
+      }
+      case sdf_torus: {
+        const pos_type ring = std::sqrt(q.x*q.x + q.y*q.y) - n.size.x;
+        stack[top++] = std::sqrt(ring*ring + q.z*q.z) - n.size.y;
+        break;
+      }
+      case sdf_union:
+        top--;
+        stack[top-1] = std::min(stack[top-1], stack[top]);
+        break;
+      case sdf_smooth_union:
+        top--;
+        stack[top-1] = smoothMin(stack[top-1], stack[top], n.k);
+        break;
+      case sdf_displace:
+        stack[top-1] += n.size.x * wave(n.k*q.x)*wave(n.k*q.y)*wave(n.k*q.z);
+        break;
+    }
+  }
+
+  return stack[0];
+}
+
+// the same program for LANES points at once, a node at a time so the lanes
+// vectorise and the program is walked once per packet. Plain comparisons
+// instead of std::min and std::max, which keep these loops from vectorising
+auto sdf::evaluate(const pos_type* x, const pos_type* y, const pos_type* z, pos_type* out) const -> void {
+  alignas(64) pos_type stack[MAX_STACK][LANES];
+  int top = 0;
+
+  for (const sdf_node& n : this->program) {
+    const pos_type cx = n.centre.x, cy = n.centre.y, cz = n.centre.z;
+    const pos_type sx = n.size.x, sy = n.size.y, sz = n.size.z;
+    const pos_type k = n.k;
+
+    switch (n.op) {
+      case sdf_sphere: {
+        pos_type* d = stack[top++];
+        #pragma omp simd
+        for (int l = 0; l<LANES; l++) {
+          const pos_type qx = x[l]-cx, qy = y[l]-cy, qz = z[l]-cz;
+          d[l] = std::sqrt(qx*qx + qy*qy + qz*qz) - sx;
+        }
+        break;
+      }
+      case sdf_box: {
+        pos_type* d = stack[top++];
+        #pragma omp simd
+        for (int l = 0; l<LANES; l++) {
+          const pos_type ex = std::abs(x[l]-cx) - sx;
+          const pos_type ey = std::abs(y[l]-cy) - sy;
+          const pos_type ez = std::abs(z[l]-cz) - sz;
+          const pos_type ox = ex > 0 ? ex : 0, oy = ey > 0 ? ey : 0, oz = ez > 0 ? ez : 0;
+          pos_type inside = ex;
+          inside = ey > inside ? ey : inside;
+          inside = ez > inside ? ez : inside;
+          d[l] = std::sqrt(ox*ox + oy*oy + oz*oz) + (inside < 0 ? inside : 0);
+        }
+        break;
+      }
+      case sdf_torus: {
+        pos_type* d = stack[top++];
+        #pragma omp simd
+        for (int l = 0; l<LANES; l++) {
+          const pos_type qx = x[l]-cx, qy = y[l]-cy, qz = z[l]-cz;
+          const pos_type ring = std::sqrt(qx*qx + qy*qy) - sx;
+          d[l] = std::sqrt(ring*ring + qz*qz) - sy;
+        }
+        break;
+      }
+      case sdf_union: {
+        top--;
+        pos_type* a = stack[top-1];
+        const pos_type* b = stack[top];
+        #pragma omp simd
+        for (int l = 0; l<LANES; l++) {
+          a[l] = b[l] < a[l] ? b[l] : a[l];
+        }
+        break;
+      }
+      case sdf_smooth_union: {
+        top--;
+        pos_type* a = stack[top-1];
+        const pos_type* b = stack[top];
+        #pragma omp simd
+        for (int l = 0; l<LANES; l++) {
+          const pos_type blend = 0.5 + 0.5*(b[l] - a[l])/k;
+          const pos_type h = blend < 0 ? 0 : (blend > 1 ? 1 : blend);
+          a[l] = b[l] + (a[l] - b[l])*h - k*h*(1 - h);
+        }
+        break;
+      }
+      case sdf_displace: {
+        pos_type* d = stack[top-1];
+        #pragma omp simd
+        for (int l = 0; l<LANES; l++) {
+          d[l] += sx * wave(k*(x[l]-cx))*wave(k*(y[l]-cy))*wave(k*(z[l]-cz));
+        }
+        break;
+      }
+    }
+  }
+
+  std::copy_n(stack[0], LANES, out);
+}
+
+// first t before tmax within SDF_HIT_DISTANCE of the surface, stepping by the
+// distance over the Lipschitz bound so no surface is stepped over
+auto sdf::march(const ray& r, pos_type tmax) const -> pos_type {
+  pos_type t, end;
+  if (!slabs(r, this->lo, this->hi, t, end)) {
+    return NO_HIT;
+  }
+
+  const pos_type len = r.d.length();
+  const pos_type scale = 1 / (this->bound*len);
+  t = std::max(t, START_OFFSET/len);
+  end = std::min(end, tmax);
+
+  for (int i = 0; i<SDF_MAX_STEPS && t < end; i++) {
+    const pos_type d = this->evaluate(r.e + r.d*t);
+
+    if (d < SDF_HIT_DISTANCE) {
+      return t;
+    }
+
+    t += d*scale;
+  }
+
+  return NO_HIT;
+}
+
+[[nodiscard]]
+pos_type sdf::distance(const ray& r) const {
+  return this->march(r, NO_HIT);
+}
+
+[[nodiscard]]
+bool sdf::occluded(const ray& r, pos_type tmax) const {
+  return this->march(r, tmax) < tmax;
+}
+
+// march() for LANES rays at a time. A lane that hits, leaves or runs out of
+// steps takes the next ray still to test, so lanes rarely idle while the
+// others finish
+void sdf::occludedPacket(const ray* rays, const pos_type* tmax, int count, bool* blocked) const {
+  alignas(64) pos_type ox[LANES], oy[LANES], oz[LANES], dx[LANES], dy[LANES], dz[LANES];
+  alignas(64) pos_type t[LANES], end[LANES], scale[LANES];
+  alignas(64) pos_type x[LANES], y[LANES], z[LANES], d[LANES];
+  int index[LANES];
+  int steps[LANES];
+  int next = 0;
+  int live = 0;
+
+  // loads the next ray through the bounds into lane l, or idles it
+  const auto load = [&](int l) {
+    while (next < count) {
+      const int i = next++;
+      if (blocked[i] || !slabs(rays[i], this->lo, this->hi, t[l], end[l])) {
+        continue;
+      }
+
+      const pos_type len = rays[i].d.length();
+      t[l] = std::max(t[l], START_OFFSET/len);
+      end[l] = std::min(end[l], tmax[i]);
+      if (t[l] >= end[l]) {
+        continue;
+      }
+
+      ox[l] = rays[i].e.x; oy[l] = rays[i].e.y; oz[l] = rays[i].e.z;
+      dx[l] = rays[i].d.x; dy[l] = rays[i].d.y; dz[l] = rays[i].d.z;
+      scale[l] = 1 / (this->bound*len);
+      index[l] = i;
+      steps[l] = 0;
+      live++;
+      return;
+    }
+
+    // idle lanes sit at the origin and never step
+    ox[l] = oy[l] = oz[l] = dx[l] = dy[l] = dz[l] = scale[l] = 0;
+    t[l] = end[l] = 0;
+    index[l] = -1;
+  };
+
+  for (int l = 0; l<LANES; l++) {
+    load(l);
+  }
+
+  while (live > 0) {
+    #pragma omp simd
+    for (int l = 0; l<LANES; l++) {
+      x[l] = ox[l] + dx[l]*t[l];
+      y[l] = oy[l] + dy[l]*t[l];
+      z[l] = oz[l] + dz[l]*t[l];
+    }
+
+    this->evaluate(x, y, z, d);
+
+    #pragma omp simd
+    for (int l = 0; l<LANES; l++) {
+      t[l] = d[l] < SDF_HIT_DISTANCE ? t[l] : t[l] + d[l]*scale[l];
+    }
+
+    for (int l = 0; l<LANES; l++) {
+      if (index[l] < 0) {
+        continue;
+      }
+
+      const bool hit = d[l] < SDF_HIT_DISTANCE;
+      if (hit || t[l] >= end[l] || ++steps[l] >= SDF_MAX_STEPS) {
+        blocked[index[l]] = hit;
+        live--;
+        load(l);
+      }
+    }
+  }
+}
+
+[[nodiscard]]
+hit sdf::surface(const ray& r, pos_type t) const {
+  const point pos = r.e + (r.d * t);
+
+  // central differences over a tetrahedron, four evaluations
+  const pos_type h = SDF_HIT_DISTANCE;
+  const point k0 = point(1,-1,-1), k1 = point(-1,-1,1), k2 = point(-1,1,-1), k3 = point(1,1,1);
+  const point normal = (k0*this->evaluate(pos + k0*h) + k1*this->evaluate(pos + k1*h)
+                      + k2*this->evaluate(pos + k2*h) + k3*this->evaluate(pos + k3*h)).norm();
+
+  if (this->texture < 0) {
+    return hit{.depth = t, .pos = pos, .normal = normal};
+  }
+
+  // mapped like a plane, onto the tangents at the hit
+  point t1, t2;
+  tangents(normal, t1, t2);
+
+  return hit{
+    .depth = t,
+    .pos = pos,
+    .normal = normal,
+    .u = dot(pos, t1) / this->texture_scale,
+    .v = dot(pos, t2) / this->texture_scale,
+    .uv_size = this->texture_scale
+  };
+}
+
+void sdf::translate(point offset) {
+  for (sdf_node& n : this->program) {
+    n.centre += offset;
+  }
+
+  this->lo += offset;
+  this->hi += offset;
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <cmath>
+#include <vector>
+#include "objects.hpp"
+
+enum sdf_op {
+  sdf_sphere,       // size.x is the radius
+  sdf_box,          // size is the half extent
+  sdf_torus,        // around z, size.x is the ring radius and size.y the tube's
+  sdf_union,
+  sdf_smooth_union, // k is the blend distance
+  sdf_displace      // adds size.x * sin(k*x)sin(k*y)sin(k*z), x from centre
+};
+
+// sin() that vectorises, to about 1e-9, for displacement. Rounds to the
+// nearest multiple of pi by adding and removing 1.5*2^52, then a Taylor
+// series on what is left
+inline auto wave(pos_type x) -> pos_type {
+  constexpr pos_type PI = 3.14159265358979323;
+  constexpr pos_type ROUND = 6755399441055744.0;
+
+  const pos_type n = (x*(1/PI) + ROUND) - ROUND;
+  const pos_type r = x - n*PI;
+  const pos_type r2 = r*r;
+
+  // odd multiples flip the sign
+  const pos_type half = (n*0.5 + ROUND) - ROUND;
+  const pos_type sign = 1 - 2*std::abs(n - 2*half);
+
+  const pos_type s = r*(1 + r2*(-1.0/6 + r2*(1.0/120 + r2*(-1.0/5040 + r2*(1.0/362880
+                   + r2*(-1.0/39916800 + r2*(1.0/6227020800)))))));
+  return sign*s;
+}
+
+// one step of a postfix program: shapes push a distance, unions pop two and
+// push one, displacement changes the top
+struct sdf_node {
+  sdf_op op;
+  point centre;
+  point size;
+  pos_type k = 0;
+};
+
+// Implicit surface given by a signed distance program, intersected by sphere
+// tracing. Displacement breaks the distance bound, so steps are scaled by the
+// program's Lipschitz bound, and only rays through the program's bounding box
+// are marched at all.
+class sdf : public object {
+public:
+  // values held by one program at once
+  static constexpr int MAX_STACK = 8;
+  // rays marched together by occludedPacket()
+  static constexpr int LANES = 8;
+
+  std::vector<sdf_node> program;
+
+  sdf(std::vector<sdf_node> program, point colour, pos_type spec, pos_type dif);
+
+  pos_type distance(const ray& r) const;
+  bool occluded(const ray& r, pos_type tmax) const;
+  void occludedPacket(const ray* rays, const pos_type* tmax, int count, bool* blocked) const;
+  hit surface(const ray& r, pos_type t) const;
+  void translate(point offset);
+
+  // signed distance at p, at most lipschitz() times too large
+  auto evaluate(point p) const -> pos_type;
+  auto lipschitz() const -> pos_type { return bound; }
+  auto lower() const -> point { return lo; }
+  auto upper() const -> point { return hi; }
+
+private:
+  auto march(const ray& r, pos_type tmax) const -> pos_type;
+  auto evaluate(const pos_type* x, const pos_type* y, const pos_type* z, pos_type* out) const -> void;
+
+  point lo, hi;
+  pos_type bound;
+};
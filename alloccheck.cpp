@@ -0,0 +1,115 @@
+// Checks that tracing through a scene_t makes no heap allocations. Every
+// operator new is counted; a warm-up pass over the samples fills whatever
+// caches the tracer keeps, then the same samples are traced again and any
+// allocation in that pass fails the check.
+//
+//   make alloccheck && ./alloccheck
+
+#include <new>
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+#include <iostream>
+
+#include "common.hpp"
+#include "trace.hpp"
+#include "scene.hpp"
+#include "image.hpp"
+#include "sampler.hpp"
+#include "Structures/ray.hpp"
+#include "Structures/objects.hpp"
+
+namespace {
+
+std::atomic<long long> allocations = 0;
+std::atomic<bool> counting = false;
+
+// pixels along the diagonal and samples per pixel, every sample a full path
+constexpr int PIXELS = 64;
+constexpr int SAMPLES = 16;
+
+auto count() -> void {
+  if (counting.load(std::memory_order_relaxed)) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+// a floor and a few spheres, lit by the fixed light
+auto createScene() -> std::vector<std::shared_ptr<object>> {
+  std::vector<std::shared_ptr<object>> objects;
+  objects.push_back(std::make_shared<plane>(point(0,0,-3), point(0,0,1), point(0.5, 0.5, 0.5), 0.0, 1.0));
+  objects.push_back(std::make_shared<sphere>(point(0,20,2), 5, point(0.9, 0.1, 0.1), 0.2, 0.8));
+  objects.push_back(std::make_shared<sphere>(point(-8,18,0), 3, point(0.1, 0.1, 0.9), 0.6, 0.4));
+  objects.push_back(std::make_shared<sphere>(point(6,12,-1), 2, point(0.1, 0.9, 0.1), 0.0, 1.0));
+  return objects;
+}
+
+auto trace(const scene_t& scene, const camera& cam) -> point {
+  point sum = point(0, 0, 0);
+
+  for (int i = 0; i<PIXELS; i++) {
+    const int x = i*WIDTH / PIXELS;
+    const int y = i*HEIGHT / PIXELS;
+
+    for (int sample = 0; sample<SAMPLES; sample++) {
+      auto s = sampler(x, y, sample);
+      const ray r = rayDir(cam, 90.0, x, y);
+      features first_hit;
+      sum += rayCast(r, scene, MAX_RAY_DEPTH_PER_PIXEL, s, &first_hit);
+    }
+  }
+
+  return sum;
+}
+
+}
+
+auto operator new(std::size_t size) -> void* {
+  count();
+  if (void* p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+auto operator new(std::size_t size, std::align_val_t align) -> void* {
+  count();
+  if (void* p = std::aligned_alloc(static_cast<size_t>(align), (size + static_cast<size_t>(align) - 1)
+                                   / static_cast<size_t>(align) * static_cast<size_t>(align))) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+auto operator delete(void* p) noexcept -> void {
+  std::free(p);
+}
+
+auto operator delete(void* p, std::size_t) noexcept -> void {
+  std::free(p);
+}
+
+auto operator delete(void* p, std::align_val_t) noexcept -> void {
+  std::free(p);
+}
+
+auto operator delete(void* p, std::size_t, std::align_val_t) noexcept -> void {
+  std::free(p);
+}
+
+auto main() -> int {
+  const scene_t scene(createScene());
+  const camera cam{};
+
+  trace(scene, cam);
+
+  counting = true;
+  const point sum = trace(scene, cam);
+  counting = false;
+
+  std::cout << "Traced " << PIXELS*SAMPLES << " samples (mean " << sum / (PIXELS*SAMPLES) << "), "
+            << allocations << " heap allocations" << std::endl;
+
+  return allocations == 0 ? 0 : 1;
+}
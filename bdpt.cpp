@@ -0,0 +1,592 @@
+#include "bdpt.hpp"
+
+#include "common.hpp"
+#include "scene.hpp"
+#include "sampler.hpp"
+#include "trace.hpp"
+#include "environment.hpp"
+#include "Structures/objects.hpp"
+
+#include <cmath>
+#include <atomic>
+#include <algorithm>
+
+namespace {
+
+constexpr pos_type PI = 3.14159265358979323;
+// what rays leaving the scene see, as in rayCast
+constexpr point SKY = point(0.1, 0.1, 0.2);
+// rays leave surfaces this far along the normal
+constexpr pos_type OFFSET = 0.001;
+// camera subpaths also hold the eye, light subpaths the point on the light
+constexpr int MAX_VERTICES = MAX_RAY_DEPTH_PER_PIXEL + 2;
+
+static_assert(std::atomic_ref<pos_type>::is_always_lock_free);
+
+// a zero density means the strategy can't make the path at all
+auto remap0(pos_type pdf) -> pos_type {
+  return pdf != 0 ? pdf : 1;
+}
+
+auto reflect(point wo, point n) -> point {
+  return n*(2*dot(wo, n)) - wo;
+}
+
+// about axis n, from local (x, y, z) with z along n
+auto around(point n, pos_type x, pos_type y, pos_type z) -> point {
+  point t1, t2;
+  tangents(n, t1, t2);
+  return t1*x + t2*y + n*z;
+}
+
+// cross() works on unit vectors, so it gives the normal but not the area
+auto rectArea(const light& l) -> pos_type {
+  return l.edge_u.length() * l.edge_v.length() * cross(l.edge_u, l.edge_v).length();
+}
+
+// where a rect light is hit along r, or NO_HIT
+auto hitRect(const light& l, const ray& r) -> pos_type {
+  const point n = cross(l.edge_u, l.edge_v);
+  const pos_type denom = dot(r.d, n);
+  if (denom >= 0) {
+    return NO_HIT;
+  }
+
+  const pos_type t = dot(l.pos - r.e, n) / denom;
+  if (t <= 0) {
+    return NO_HIT;
+  }
+
+  const point local = r.e + r.d*t - l.pos;
+  const pos_type u = dot(local, l.edge_u) / l.edge_u.length_squared();
+  const pos_type v = dot(local, l.edge_v) / l.edge_v.length_squared();
+
+  return (u >= 0 && u <= 1 && v >= 0 && v <= 1) ? t : NO_HIT;
+}
+
+}
+
+struct bidirectional_tracer::vertex {
+  enum kind { eye, emitter, surface } type;
+  point pos;
+  // surfaces: facing wo. Lights: the side they emit on
+  point normal;
+  // towards the vertex before, on surfaces
+  point wo;
+  point albedo;
+  pos_type diffuse = 1;
+  int light = -1;
+  // path throughput up to and including this vertex
+  point beta;
+  // area densities of reaching this vertex from either direction
+  pos_type pdf_fwd = 0;
+  pos_type pdf_rev = 0;
+};
+
+namespace {
+
+// solid angle density converted to area density at to
+template<typename V>
+auto toArea(pos_type pdf, const V& from, const V& to) -> pos_type {
+  const point w = to.pos - from.pos;
+  const pos_type dist2 = w.length_squared();
+  if (dist2 == 0) {
+    return 0;
+  }
+
+  if (to.type != V::eye) {
+    pdf *= std::abs(dot(to.normal, w)) / std::sqrt(dist2);
+  }
+  return pdf / dist2;
+}
+
+// Lambert in proportion to diffuse plus normalised Phong, for unit wo and wi
+// on the side of n
+template<typename V>
+auto bsdf(const V& v, point wo, point wi) -> point {
+  const pos_type cos_i = dot(wi, v.normal);
+  if (cos_i <= 0 || dot(wo, v.normal) <= 0) {
+    return point(0,0,0);
+  }
+
+  const pos_type cos_r = std::max(dot(reflect(wo, v.normal), wi), 0.0);
+  const pos_type glossy = (BDPT_GLOSSY_EXPONENT+2) / (2*PI) * std::pow(cos_r, BDPT_GLOSSY_EXPONENT);
+
+  return v.albedo * (v.diffuse/PI + (1-v.diffuse)*glossy);
+}
+
+// solid angle density of bsdfSample() picking wi
+template<typename V>
+auto bsdfPdf(const V& v, point wo, point wi) -> pos_type {
+  const pos_type cos_i = std::max(dot(wi, v.normal), 0.0);
+  const pos_type cos_r = std::max(dot(reflect(wo, v.normal), wi), 0.0);
+
+  return v.diffuse*cos_i/PI + (1-v.diffuse)*(BDPT_GLOSSY_EXPONENT+1) / (2*PI) * std::pow(cos_r, BDPT_GLOSSY_EXPONENT);
+}
+
+// picks the lobe by diffuse, then cosine or Phong distributed about it
+template<typename V>
+auto bsdfSample(const V& v, sampler& s) -> point {
+  const pos_type lobe = s.get1D();
+  const auto [u, w] = s.get2D();
+  const pos_type phi = 2*PI*w;
+
+  if (lobe < v.diffuse) {
+    const pos_type r = std::sqrt(u);
+    return around(v.normal, r*std::cos(phi), r*std::sin(phi), std::sqrt(std::max(0.0, 1-u)));
+  }
+
+  const pos_type cos_t = std::pow(u, 1 / (BDPT_GLOSSY_EXPONENT+1));
+  const pos_type sin_t = std::sqrt(std::max(0.0, 1 - cos_t*cos_t));
+  return around(reflect(v.wo, v.normal), sin_t*std::cos(phi), sin_t*std::sin(phi), cos_t);
+}
+
+}
+
+splat_film::splat_film() : pixels(std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>()) {}
+
+auto splat_film::add(pos_type x, pos_type y, point value) -> void {
+  const int px = static_cast<int>(std::floor(x + 0.5));
+  const int py = static_cast<int>(std::floor(y + 0.5));
+  if (px < 0 || px >= WIDTH || py < 0 || py >= HEIGHT) {
+    return;
+  }
+
+  point& p = (*pixels)[px][py];
+  std::atomic_ref<pos_type>(p.x).fetch_add(value.x, std::memory_order_relaxed);
+  std::atomic_ref<pos_type>(p.y).fetch_add(value.y, std::memory_order_relaxed);
+  std::atomic_ref<pos_type>(p.z).fetch_add(value.z, std::memory_order_relaxed);
+}
+
+bidirectional_tracer::bidirectional_tracer(const scene_t& scene, const camera& cam)
+  : scene(scene), cam(cam), focal(rayDir(90.0, 0, 0).d.y) {
+  area = WIDTH*HEIGHT / (focal*focal);
+
+  for (const light& l : scene.lights()) {
+    if (l.shape == rect_light && lightPower(l) > 0) {
+      emitters.push_back(l);
+    }
+  }
+
+  // the fixed light lightRay samples, facing down
+  if (emitters.empty()) {
+    emitters.push_back(light{rect_light, point(-7.5, 0, 40), point(1,1,1)*BDPT_LIGHT_RADIANCE, 0,
+                             point(0,15,0), point(15,0,0)});
+  }
+
+  pos_type total = 0;
+  for (const light& l : emitters) {
+    total += lightPower(l);
+  }
+  for (const light& l : emitters) {
+    pick.push_back(lightPower(l) / total);
+  }
+}
+
+// a light by power and a uniform point on it, returns the probability of the
+// light; the point's density is that over the light's area
+auto bidirectional_tracer::sampleEmitter(pos_type u, pos_type v, pos_type w, int& index, point& pos) const -> pos_type {
+  index = 0;
+  for (pos_type acc = pick[0]; u >= acc && index+1 < static_cast<int>(pick.size()); acc += pick[index]) {
+    index++;
+  }
+
+  const light& l = emitters[index];
+  pos = l.pos + l.edge_u*v + l.edge_v*w;
+  return pick[index];
+}
+
+auto bidirectional_tracer::lightOriginPdf(const vertex& v) const -> pos_type {
+  const light& l = emitters[v.light];
+  return pick[v.light] / rectArea(l);
+}
+
+// area density at next of the light at v sending its cosine lobe there
+auto bidirectional_tracer::lightPdf(const vertex& v, const vertex& next) const -> pos_type {
+  const point w = next.pos - v.pos;
+  const pos_type dist = w.length();
+  const pos_type cos_l = std::max(dot(v.normal, w) / dist, 0.0);
+  pos_type pdf = cos_l / PI / (dist*dist);
+
+  if (next.type != vertex::eye) {
+    pdf *= std::abs(dot(next.normal, w)) / dist;
+  }
+  return pdf;
+}
+
+// Pinhole importance and direction density over the whole image, with the
+// image taking area on the plane one unit in front. Zero outside the image
+auto bidirectional_tracer::cameraImportance(point dir, pos_type& raster_x, pos_type& raster_y) const -> pos_type {
+  const pos_type c = std::cos(cam.yaw);
+  const pos_type s = std::sin(cam.yaw);
+  const pos_type forward = -s*dir.x + c*dir.y;
+  if (forward <= 0) {
+    return 0;
+  }
+
+  // inverse of rayDir
+  raster_x = (c*dir.x + s*dir.y) / forward * focal + WIDTH/2.0;
+  raster_y = HEIGHT/2.0 - dir.z / forward * focal;
+  if (raster_x < -0.5 || raster_x >= WIDTH-0.5 || raster_y < -0.5 || raster_y >= HEIGHT-0.5) {
+    return 0;
+  }
+
+  const pos_type cos_t = forward / dir.length();
+  return 1 / (area * cos_t*cos_t*cos_t*cos_t);
+}
+
+auto bidirectional_tracer::cameraPdf(point dir) const -> pos_type {
+  pos_type x, y;
+  const pos_type importance = cameraImportance(dir, x, y);
+  const pos_type forward = -std::sin(cam.yaw)*dir.x + std::cos(cam.yaw)*dir.y;
+  return importance * forward / dir.length();
+}
+
+auto bidirectional_tracer::f(const vertex& v, const vertex& next) const -> point {
+  const point wi = (next.pos - v.pos).norm();
+  return bsdf(v, v.wo, wi);
+}
+
+// area density at next of v sampling towards it, arriving from prev
+auto bidirectional_tracer::pdf(const vertex& v, const vertex* prev, const vertex& next) const -> pos_type {
+  if (v.type == vertex::emitter) {
+    return lightPdf(v, next);
+  }
+
+  const point wn = (next.pos - v.pos).norm();
+  const pos_type dir_pdf = v.type == vertex::eye
+    ? cameraPdf(wn)
+    : bsdfPdf(v, prev ? (prev->pos - v.pos).norm() : v.wo, wn);
+
+  return toArea(dir_pdf, v, next);
+}
+
+auto bidirectional_tracer::visible(const vertex& a, const vertex& b) const -> bool {
+  point start = a.pos;
+  point to = b.pos - a.pos;
+
+  if (a.type == vertex::surface) {
+    start = a.pos + a.normal*(dot(a.normal, to) > 0 ? OFFSET : -OFFSET);
+    to = b.pos - start;
+  }
+
+  const pos_type dist = to.length();
+  const ray r(start, to/dist);
+  const pos_type tmax = b.type == vertex::surface ? dist - 2*OFFSET : dist;
+
+  for (const object* obj : scene) {
+    if (obj->occluded(r, tmax)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Follows r from path[count-1], adding a vertex per hit until max. beta is
+// the throughput carried by r and pdf the solid angle density it was picked
+// with. Camera subpaths end on a light, and add what they see of the sky to
+// sky when they leave the scene; light subpaths pass through lights.
+auto bidirectional_tracer::walk(ray r, point beta, pos_type pdf, vertex* path, int count, int max, bool from_camera,
+                                sampler& s, point& sky) const -> int {
+  while (count < max) {
+    vertex& prev = path[count-1];
+    vertex& v = path[count];
+
+    const object* nearest = nullptr;
+    pos_type depth = NO_HIT;
+    for (const object* obj : scene) {
+      const pos_type t = obj->distance(r);
+      if (t < depth) {
+        depth = t;
+        nearest = obj;
+      }
+    }
+
+    int lit = -1;
+    if (from_camera) {
+      for (size_t i = 0; i<emitters.size(); i++) {
+        const pos_type t = hitRect(emitters[i], r);
+        if (t < depth) {
+          depth = t;
+          lit = i;
+        }
+      }
+    }
+
+    if (lit < 0 && !nearest) {
+      if (from_camera) {
+        sky += beta * (environmentMap().empty() ? SKY : environmentMap().radiance(r.d));
+      }
+      break;
+    }
+
+    v = vertex{};
+    v.pos = r.e + r.d*depth;
+    v.beta = beta;
+
+    if (lit >= 0) {
+      v.type = vertex::emitter;
+      v.normal = cross(emitters[lit].edge_u, emitters[lit].edge_v).norm();
+      v.light = lit;
+      v.pdf_fwd = toArea(pdf, prev, v);
+      return count+1;
+    }
+
+    const hit h = nearest->surface(r, depth);
+    v.type = vertex::surface;
+    v.wo = r.d * -1;
+    v.normal = dot(h.normal, v.wo) < 0 ? h.normal * -1 : h.normal;
+    v.albedo = surfaceColour(*nearest, h, r, from_camera && count == 1);
+    v.diffuse = nearest->diffuse;
+    v.pdf_fwd = toArea(pdf, prev, v);
+    count++;
+
+    if (count == max) {
+      break;
+    }
+
+    const point wi = bsdfSample(v, s);
+    const pos_type pdf_fwd = bsdfPdf(v, v.wo, wi);
+    const point value = bsdf(v, v.wo, wi);
+    if (pdf_fwd <= 0 || (value.x <= 0 && value.y <= 0 && value.z <= 0)) {
+      break;
+    }
+
+    beta = beta * value * (dot(wi, v.normal) / pdf_fwd);
+    prev.pdf_rev = toArea(bsdfPdf(v, wi, v.wo), v, prev);
+    pdf = pdf_fwd;
+    r = ray(v.pos + v.normal*OFFSET, wi);
+  }
+
+  return count;
+}
+
+// Balance heuristic weight of the path made by joining light_path[s-1] to
+// camera_path[t-1], against every other split of the same vertices. The join
+// changes the reverse densities around it, which are set here for the ratio
+// walk and put back after.
+auto bidirectional_tracer::misWeight(vertex* light_path, vertex* camera_path, int s, int t) const -> pos_type {
+  if (s + t == 2) {
+    return 1;
+  }
+
+  vertex* qs = s > 0 ? &light_path[s-1] : nullptr;
+  vertex* pt = &camera_path[t-1];
+  vertex* qs_minus = s > 1 ? &light_path[s-2] : nullptr;
+  vertex* pt_minus = t > 1 ? &camera_path[t-2] : nullptr;
+
+  const pos_type saved[4] = {
+    pt->pdf_rev, pt_minus ? pt_minus->pdf_rev : 0, qs ? qs->pdf_rev : 0, qs_minus ? qs_minus->pdf_rev : 0
+  };
+
+  pt->pdf_rev = s > 0 ? pdf(*qs, qs_minus, *pt) : lightOriginPdf(*pt);
+  if (pt_minus) {
+    pt_minus->pdf_rev = s > 0 ? pdf(*pt, qs, *pt_minus) : lightPdf(*pt, *pt_minus);
+  }
+  if (qs) {
+    qs->pdf_rev = pdf(*pt, pt_minus, *qs);
+  }
+  if (qs_minus) {
+    qs_minus->pdf_rev = pdf(*qs, pt, *qs_minus);
+  }
+
+  // nothing here is a delta distribution, so every split counts
+  pos_type sum = 0;
+  pos_type ratio = 1;
+  for (int i = t-1; i > 0; i--) {
+    ratio *= remap0(camera_path[i].pdf_rev) / remap0(camera_path[i].pdf_fwd);
+    sum += ratio;
+  }
+
+  ratio = 1;
+  for (int i = s-1; i >= 0; i--) {
+    ratio *= remap0(light_path[i].pdf_rev) / remap0(light_path[i].pdf_fwd);
+    sum += ratio;
+  }
+
+  pt->pdf_rev = saved[0];
+  if (pt_minus) {
+    pt_minus->pdf_rev = saved[1];
+  }
+  if (qs) {
+    qs->pdf_rev = saved[2];
+  }
+  if (qs_minus) {
+    qs_minus->pdf_rev = saved[3];
+  }
+
+  return 1 / (1 + sum);
+}
+
+// unweighted contribution of joining s light and t camera vertices. t == 1
+// splats into film itself and returns nothing
+auto bidirectional_tracer::connect(vertex* light_path, vertex* camera_path, int s, int t, sampler& smp,
+                                   splat_film& film) const -> point {
+  vertex& pt = camera_path[t-1];
+
+  if (s == 0) {
+    // the camera subpath found a light by itself
+    if (pt.type != vertex::emitter || dot(pt.normal, camera_path[t-2].pos - pt.pos) <= 0) {
+      return point(0,0,0);
+    }
+    return pt.beta * emitters[pt.light].emission * misWeight(light_path, camera_path, s, t);
+  }
+
+  if (t == 1) {
+    vertex& qs = light_path[s-1];
+    if (qs.type != vertex::surface) {
+      return point(0,0,0);
+    }
+
+    const point to_eye = cam.pos - qs.pos;
+    const pos_type dist2 = to_eye.length_squared();
+    pos_type x, y;
+    const pos_type importance = cameraImportance(to_eye * -1, x, y);
+    if (importance <= 0) {
+      return point(0,0,0);
+    }
+
+    const pos_type cos_eye = (-std::sin(cam.yaw)*-to_eye.x + std::cos(cam.yaw)*-to_eye.y) / std::sqrt(dist2);
+    vertex sampled{};
+    sampled.type = vertex::eye;
+    sampled.pos = cam.pos;
+    sampled.beta = point(1,1,1) * (importance * cos_eye / dist2);
+
+    const point value = qs.beta * f(qs, sampled) * sampled.beta * (std::abs(dot(to_eye, qs.normal)) / std::sqrt(dist2));
+    if ((value.x <= 0 && value.y <= 0 && value.z <= 0) || !visible(qs, sampled)) {
+      return point(0,0,0);
+    }
+
+    const vertex saved = pt;
+    pt = sampled;
+    film.add(x, y, value * misWeight(light_path, camera_path, s, t));
+    pt = saved;
+
+    return point(0,0,0);
+  }
+
+  if (pt.type != vertex::surface) {
+    return point(0,0,0);
+  }
+
+  if (s == 1) {
+    // a new point on a light for this camera vertex
+    const pos_type u = smp.get1D();
+    const auto [v, w] = smp.get2D();
+    int index;
+    point pos;
+    const pos_type prob = sampleEmitter(u, v, w, index, pos);
+    const light& l = emitters[index];
+
+    vertex sampled{};
+    sampled.type = vertex::emitter;
+    sampled.pos = pos;
+    sampled.normal = cross(l.edge_u, l.edge_v).norm();
+    sampled.light = index;
+
+    const point wi = pos - pt.pos;
+    const pos_type dist2 = wi.length_squared();
+    const pos_type cos_l = -dot(sampled.normal, wi) / std::sqrt(dist2);
+    if (cos_l <= 0) {
+      return point(0,0,0);
+    }
+
+    // radiance over the solid angle density of that point
+    const pos_type area_l = rectArea(l);
+    sampled.beta = l.emission * (cos_l * area_l / dist2 / prob);
+    sampled.pdf_fwd = lightOriginPdf(sampled);
+
+    const point value = pt.beta * f(pt, sampled) * sampled.beta * (std::abs(dot(wi, pt.normal)) / std::sqrt(dist2));
+    if ((value.x <= 0 && value.y <= 0 && value.z <= 0) || !visible(pt, sampled)) {
+      return point(0,0,0);
+    }
+
+    const vertex saved = light_path[0];
+    light_path[0] = sampled;
+    const pos_type weight = misWeight(light_path, camera_path, s, t);
+    light_path[0] = saved;
+
+    return value * weight;
+  }
+
+  vertex& qs = light_path[s-1];
+  if (qs.type != vertex::surface) {
+    return point(0,0,0);
+  }
+
+  const point w = pt.pos - qs.pos;
+  const pos_type dist2 = w.length_squared();
+  const pos_type g = std::abs(dot(qs.normal, w)) * std::abs(dot(pt.normal, w)) / (dist2*dist2);
+
+  const point value = qs.beta * f(qs, pt) * f(pt, qs) * pt.beta * g;
+  if ((value.x <= 0 && value.y <= 0 && value.z <= 0) || !visible(qs, pt)) {
+    return point(0,0,0);
+  }
+
+  return value * misWeight(light_path, camera_path, s, t);
+}
+
+auto bidirectional_tracer::sample(pos_type x, pos_type y, sampler& s, splat_film& film, features* first_hit) const -> point {
+  vertex camera_path[MAX_VERTICES];
+  vertex light_path[MAX_VERTICES - 1];
+  point colour = point(0,0,0);
+
+  // the eye, then every hit of the primary ray's path
+  const point dir = rayDir(cam, 90.0, x, y).d.norm();
+  camera_path[0] = vertex{};
+  camera_path[0].type = vertex::eye;
+  camera_path[0].pos = cam.pos;
+  camera_path[0].beta = point(1,1,1);
+  const int camera_count = walk(ray(cam.pos, dir), point(1,1,1), cameraPdf(dir), camera_path, 1, MAX_VERTICES,
+                                true, s, colour);
+
+  if (first_hit) {
+    *first_hit = features{SKY, point(0,0,0), 0};
+    if (camera_count > 1 && camera_path[1].type == vertex::surface) {
+      *first_hit = features{camera_path[1].albedo, camera_path[1].normal, (camera_path[1].pos - cam.pos).length()};
+    }
+  }
+
+  // a point on a light and a cosine distributed direction from it
+  const pos_type u = s.get1D();
+  const auto [v, w] = s.get2D();
+  const auto [a, b] = s.get2D();
+  int index;
+  point pos;
+  const pos_type prob = sampleEmitter(u, v, w, index, pos);
+  const light& l = emitters[index];
+  const point normal = cross(l.edge_u, l.edge_v).norm();
+  const pos_type area_l = rectArea(l);
+
+  const pos_type r = std::sqrt(a);
+  const pos_type cos_l = std::sqrt(std::max(0.0, 1-a));
+  const point out = around(normal, r*std::cos(2*PI*b), r*std::sin(2*PI*b), cos_l);
+
+  light_path[0] = vertex{};
+  light_path[0].type = vertex::emitter;
+  light_path[0].pos = pos;
+  light_path[0].normal = normal;
+  light_path[0].light = index;
+  light_path[0].beta = l.emission;
+  light_path[0].pdf_fwd = prob / area_l;
+
+  // emission times cosine over the densities of the point and the direction
+  point unused;
+  const int light_count = cos_l > 0
+    ? walk(ray(pos, out), l.emission * (PI * area_l / prob), cos_l/PI, light_path, 1, MAX_VERTICES-1, false, s, unused)
+    : 1;
+
+  // every split, up to MAX_RAY_DEPTH_PER_PIXEL bounces
+  for (int t = 1; t <= camera_count; t++) {
+    for (int sl = 0; sl <= light_count; sl++) {
+      const int depth = t + sl - 2;
+      if ((sl == 1 && t == 1) || depth < 0 || depth > MAX_RAY_DEPTH_PER_PIXEL) {
+        continue;
+      }
+
+      colour = colour + connect(light_path, camera_path, sl, t, s, film);
+    }
+  }
+
+  return colour;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vector>
+
+#include "image.hpp"
+#include "lights.hpp"
+#include "Structures/point.hpp"
+#include "Structures/ray.hpp"
+
+class scene_t;
+class sampler;
+
+// Light tracing contributions, which land on whatever pixel the light path
+// reaches the camera through. Every thread adds to it at once; each add is
+// three atomic adds, so no thread ever waits on a lock.
+class splat_film {
+public:
+  splat_film();
+
+  // at raster position (x, y), pixel centres at integers as in rayDir.
+  // Positions off the image are dropped
+  auto add(pos_type x, pos_type y, point value) -> void;
+  auto at(int x, int y) const -> point { return (*pixels)[x][y]; }
+
+private:
+  array_t pixels;
+};
+
+// Bidirectional path tracing (Veach 1997, laid out as in pbrt). Every sample
+// traces a camera subpath and a light subpath, then joins every prefix of
+// one to every prefix of the other. Each join is weighted by the balance
+// heuristic over all the ways that path could have been sampled. Light
+// subpath vertices joined straight to the camera are splatted.
+//
+// Unlike rayCast's shading this is physically based: a surface is Lambertian
+// with its colour as albedo in proportion to its diffuse, and glossy
+// (normalised Phong, BDPT_GLOSSY_EXPONENT) otherwise. Light comes from the
+// scene's rect lights, or the fixed area light at BDPT_LIGHT_RADIANCE when
+// there are none. Other light shapes are not sampled. Rays leaving the scene
+// see rayCast's sky or environment, which is only ever hit, never sampled.
+class bidirectional_tracer {
+public:
+  bidirectional_tracer(const scene_t& scene, const camera& cam);
+
+  // one sample through raster position (x, y). Returns what the sample adds
+  // to its own pixel; light paths reaching the camera go to film instead.
+  // first_hit as in rayCast
+  auto sample(pos_type x, pos_type y, sampler& s, splat_film& film, features* first_hit = nullptr) const -> point;
+
+private:
+  struct vertex;
+
+  auto walk(ray r, point beta, pos_type pdf, vertex* path, int count, int max, bool from_camera, sampler& s,
+            point& sky) const -> int;
+  auto sampleEmitter(pos_type u, pos_type v, pos_type w, int& index, point& pos) const -> pos_type;
+  auto connect(vertex* light_path, vertex* camera_path, int s, int t, sampler& smp, splat_film& film) const -> point;
+  auto misWeight(vertex* light_path, vertex* camera_path, int s, int t) const -> pos_type;
+
+  auto f(const vertex& v, const vertex& next) const -> point;
+  auto pdf(const vertex& v, const vertex* prev, const vertex& next) const -> pos_type;
+  auto lightPdf(const vertex& v, const vertex& next) const -> pos_type;
+  auto lightOriginPdf(const vertex& v) const -> pos_type;
+  auto cameraPdf(point dir) const -> pos_type;
+  auto cameraImportance(point dir, pos_type& raster_x, pos_type& raster_y) const -> pos_type;
+  auto visible(const vertex& a, const vertex& b) const -> bool;
+
+  const scene_t& scene;
+  camera cam;
+  // primary directions are one unit per pixel at this distance, and the
+  // image covers area on the plane one unit away
+  pos_type focal;
+  pos_type area;
+
+  std::vector<light> emitters;
+  std::vector<pos_type> pick;
+};
@@ -0,0 +1,356 @@
+// Micro-benchmarks for the functions every ray goes through: point
+// arithmetic, primitive intersection, camera rays and sample generation. Each
+// case runs over a fixed set of precomputed inputs, so only the function under
+// test is timed. Results go to stdout and, as JSON, to the file named on the
+// command line (bench.json by default), so a change to one of them can be
+// judged on its own.
+//
+//   make bench && ./bench [file.json]
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <sched.h>
+
+#include "common.hpp"
+#include "numa.hpp"
+#include "sampler.hpp"
+#include "Structures/ray.hpp"
+#include "Structures/objects.hpp"
+#include "Structures/sdf.hpp"
+
+namespace {
+
+// inputs per case, small enough to stay in cache
+constexpr int INPUTS = 4096;
+// timed samples per case, each at least SAMPLE_SECONDS long
+constexpr int SAMPLES = 21;
+constexpr double SAMPLE_SECONDS = 0.02;
+
+struct result {
+  std::string name;
+  std::string variant;
+  // per op, over the samples
+  double median_ns;
+  double min_ns;
+  double max_ns;
+  double mean_ns;
+  double stddev_ns;
+  double mad_ns;
+  long long ops_per_sample;
+};
+
+// makes the compiler produce value without letting it see what happens next
+template<typename T>
+auto keep(const T& value) -> void {
+  asm volatile("" : : "m"(value) : "memory");
+}
+
+// times op(i) for every input index, repeated until a sample is long enough
+template<typename F>
+auto measure(const std::string& name, const std::string& variant, F op) -> result {
+  using clock = std::chrono::steady_clock;
+
+  const auto run = [&](long long reps) {
+    const auto start = clock::now();
+    for (long long r = 0; r<reps; r++) {
+      for (int i = 0; i<INPUTS; i++) {
+        op(i);
+      }
+    }
+    return std::chrono::duration<double>(clock::now() - start).count();
+  };
+
+  // warms caches and branch predictors, then sizes the samples
+  long long reps = 1;
+  while (run(reps) < SAMPLE_SECONDS) {
+    reps *= 2;
+  }
+
+  std::vector<double> ns(SAMPLES);
+  for (double& sample : ns) {
+    sample = run(reps) * 1e9 / (reps*INPUTS);
+  }
+
+  std::sort(ns.begin(), ns.end());
+  const double median = ns[SAMPLES/2];
+
+  double mean = 0;
+  for (double sample : ns) {
+    mean += sample / SAMPLES;
+  }
+
+  double variance = 0;
+  std::vector<double> deviation(SAMPLES);
+  for (int i = 0; i<SAMPLES; i++) {
+    variance += (ns[i] - mean)*(ns[i] - mean) / (SAMPLES-1);
+    deviation[i] = std::abs(ns[i] - median);
+  }
+  std::sort(deviation.begin(), deviation.end());
+
+  return result{name, variant, median, ns.front(), ns.back(), mean, std::sqrt(variance),
+                deviation[SAMPLES/2], reps*INPUTS};
+}
+
+auto randomPoint(std::mt19937& gen, pos_type lo, pos_type hi) -> point {
+  std::uniform_real_distribution<pos_type> d(lo, hi);
+  const pos_type x = d(gen);
+  const pos_type y = d(gen);
+  return point(x, y, d(gen));
+}
+
+// rays from around the origin towards target(), with a shadow ray's tmax
+struct ray_set {
+  std::vector<ray> rays;
+  std::vector<pos_type> tmax;
+};
+
+// rays failing accept are drawn again
+template<typename F, typename A>
+auto raysTowards(std::mt19937& gen, F target, A accept) -> ray_set {
+  ray_set set;
+  while (static_cast<int>(set.rays.size()) < INPUTS) {
+    const point e = randomPoint(gen, -0.5, 0.5);
+    const point to = target();
+    const ray r(e, (to - e).norm());
+    if (accept(r)) {
+      set.rays.push_back(r);
+      set.tmax.push_back((to - e).length() * 2);
+    }
+  }
+  return set;
+}
+
+template<typename F>
+auto raysTowards(std::mt19937& gen, F target) -> ray_set {
+  return raysTowards(gen, target, [](const ray&) { return true; });
+}
+
+// whether r's line passes further than radius from centre
+auto pastSphere(const ray& r, point centre, pos_type radius) -> bool {
+  const point v = centre - r.e;
+  const pos_type along = dot(v, r.d);
+  return v.length_squared() - along*along > radius*radius;
+}
+
+// whether r's line misses the box from lo to hi, by the slab test
+auto pastBox(const ray& r, point lo, point hi) -> bool {
+  const pos_type o[3] = {r.e.x, r.e.y, r.e.z};
+  const pos_type d[3] = {r.d.x, r.d.y, r.d.z};
+  const pos_type l[3] = {lo.x, lo.y, lo.z};
+  const pos_type h[3] = {hi.x, hi.y, hi.z};
+
+  pos_type near = -NO_HIT;
+  pos_type far = NO_HIT;
+  for (int a = 0; a<3; a++) {
+    const pos_type t0 = (l[a] - o[a]) / d[a];
+    const pos_type t1 = (h[a] - o[a]) / d[a];
+    near = std::max(near, std::min(t0, t1));
+    far = std::min(far, std::max(t0, t1));
+  }
+  return near > far;
+}
+
+// a case's inputs must all take the path its name says, or it times
+// something else
+auto expect(const std::string& name, const object& obj, const ray_set& set, bool hit) -> void {
+  for (int i = 0; i<INPUTS; i++) {
+    if ((obj.distance(set.rays[i]) != NO_HIT) != hit || obj.occluded(set.rays[i], set.tmax[i]) != hit) {
+      throw std::runtime_error(name + ": input " + std::to_string(i) + (hit ? " misses" : " hits"));
+    }
+  }
+}
+
+// a point at distance lo to hi from centre, in a random direction
+auto shell(std::mt19937& gen, point centre, pos_type lo, pos_type hi) -> point {
+  std::uniform_real_distribution<pos_type> r(lo, hi);
+  const pos_type dist = r(gen);
+  return centre + randomPoint(gen, -1, 1).norm()*dist;
+}
+
+auto benchPoint(std::vector<result>& results) -> void {
+  std::mt19937 gen(1);
+  std::vector<point> a(INPUTS), b(INPUTS);
+  std::vector<pos_type> s(INPUTS);
+  for (int i = 0; i<INPUTS; i++) {
+    a[i] = randomPoint(gen, -10, 10);
+    b[i] = randomPoint(gen, 0.5, 10);
+    s[i] = b[i].x;
+  }
+
+  results.push_back(measure("point+point", "scalar/double", [&](int i) { keep(a[i] + b[i]); }));
+  results.push_back(measure("point-point", "scalar/double", [&](int i) { keep(a[i] - b[i]); }));
+  results.push_back(measure("point*point", "scalar/double", [&](int i) { keep(a[i] * b[i]); }));
+  results.push_back(measure("point*scalar", "scalar/double", [&](int i) { keep(a[i] * s[i]); }));
+  results.push_back(measure("point/point", "scalar/double", [&](int i) { keep(a[i] / b[i]); }));
+  results.push_back(measure("point/scalar", "scalar/double", [&](int i) { keep(a[i] / s[i]); }));
+  results.push_back(measure("point+=point", "scalar/double", [&](int i) { point p = a[i]; p += b[i]; keep(p); }));
+  results.push_back(measure("dot", "scalar/double", [&](int i) { keep(dot(a[i], b[i])); }));
+  results.push_back(measure("cross", "scalar/double", [&](int i) { keep(cross(a[i], b[i])); }));
+  results.push_back(measure("point::length_squared", "scalar/double", [&](int i) { keep(a[i].length_squared()); }));
+  results.push_back(measure("point::length", "scalar/double", [&](int i) { keep(a[i].length()); }));
+  results.push_back(measure("point::norm", "scalar/double", [&](int i) { keep(a[i].norm()); }));
+  // the only float form, what OpenCL uploads are built from
+  results.push_back(measure("point::toFloat3", "scalar/float", [&](int i) { keep(a[i].toFloat3()); }));
+}
+
+auto benchSphere(std::vector<result>& results) -> void {
+  std::mt19937 gen(2);
+  const sphere s(point(0,6,0), 1, point(1,1,1));
+
+  // through the inside of the sphere, and past it without touching: aimed
+  // near it, but only the rays whose line clears it
+  const ray_set hit = raysTowards(gen, [&] { return shell(gen, s.centre, 0, 0.9*s.radius); });
+  const ray_set miss = raysTowards(gen, [&] { return shell(gen, s.centre, 1.2*s.radius, 2*s.radius); },
+                                   [&](const ray& r) { return pastSphere(r, s.centre, 1.05*s.radius); });
+  expect("sphere/hit", s, hit, true);
+  expect("sphere/miss", s, miss, false);
+
+  results.push_back(measure("sphere::distance/hit", "scalar/double", [&](int i) { keep(s.distance(hit.rays[i])); }));
+  results.push_back(measure("sphere::distance/miss", "scalar/double", [&](int i) { keep(s.distance(miss.rays[i])); }));
+  results.push_back(measure("sphere::occluded/hit", "scalar/double", [&](int i) { keep(s.occluded(hit.rays[i], hit.tmax[i])); }));
+  results.push_back(measure("sphere::occluded/miss", "scalar/double", [&](int i) { keep(s.occluded(miss.rays[i], miss.tmax[i])); }));
+}
+
+auto benchPlane(std::vector<result>& results) -> void {
+  std::mt19937 gen(3);
+  const plane p(point(0,0,-2), point(0,0,1), point(1,1,1));
+
+  // down onto the plane, and up away from it
+  const ray_set hit = raysTowards(gen, [&] { return randomPoint(gen, -10, 10)*point(1,1,0) + point(0,0,-2); });
+  const ray_set miss = raysTowards(gen, [&] { return randomPoint(gen, -10, 10)*point(1,1,0) + point(0,0,2); });
+  expect("plane/hit", p, hit, true);
+  expect("plane/miss", p, miss, false);
+
+  results.push_back(measure("plane::distance/hit", "scalar/double", [&](int i) { keep(p.distance(hit.rays[i])); }));
+  results.push_back(measure("plane::distance/miss", "scalar/double", [&](int i) { keep(p.distance(miss.rays[i])); }));
+  results.push_back(measure("plane::occluded/hit", "scalar/double", [&](int i) { keep(p.occluded(hit.rays[i], hit.tmax[i])); }));
+  results.push_back(measure("plane::occluded/miss", "scalar/double", [&](int i) { keep(p.occluded(miss.rays[i], miss.tmax[i])); }));
+}
+
+auto benchSDF(std::vector<result>& results) -> void {
+  std::mt19937 gen(4);
+
+  // the SDF_SCENE shape, see createScene
+  const sdf shape(std::vector<sdf_node>{
+      {sdf_box, point(7,10,-2), point(1,1,1)},
+      {sdf_torus, point(7,10,-1), point(1.8,0.45,0)},
+      {sdf_displace, point(7,10,-1), point(0.08,0,0), 6.0},
+      {sdf_smooth_union, point(), point(), 0.6}
+    }, point(1,1,1), 0.3, 1.0);
+
+  // into the block, and past the bounds where the slab test rejects: aimed
+  // near them, but only the rays whose line clears the box. A few rays into
+  // the block graze the ring and run out of SDF_MAX_STEPS first, they would
+  // time the step limit instead
+  const ray_set hit = raysTowards(gen, [&] { return shell(gen, point(7,10,-2), 0, 0.8); },
+                                  [&](const ray& r) { return shape.distance(r) != NO_HIT; });
+  const point centre = (shape.lower() + shape.upper()) * 0.5;
+  const pos_type extent = (shape.upper() - shape.lower()).length();
+  const ray_set miss = raysTowards(gen, [&] { return shell(gen, centre, extent, 1.5*extent); },
+                                   [&](const ray& r) { return pastBox(r, shape.lower(), shape.upper()); });
+  expect("sdf/hit", shape, hit, true);
+  expect("sdf/miss", shape, miss, false);
+
+  results.push_back(measure("sdf::distance/hit", "scalar/double", [&](int i) { keep(shape.distance(hit.rays[i])); }));
+  results.push_back(measure("sdf::distance/miss", "scalar/double", [&](int i) { keep(shape.distance(miss.rays[i])); }));
+  results.push_back(measure("sdf::occluded/hit", "scalar/double", [&](int i) { keep(shape.occluded(hit.rays[i], hit.tmax[i])); }));
+  results.push_back(measure("sdf::occluded/miss", "scalar/double", [&](int i) { keep(shape.occluded(miss.rays[i], miss.tmax[i])); }));
+
+  // the packet marcher takes sdf::LANES rays at a time, ops are still rays
+  const auto packet = [&](const ray_set& set) {
+    return [&shape, &set](int i) {
+      if (i % sdf::LANES == 0) {
+        bool out[sdf::LANES] = {};
+        shape.occludedPacket(&set.rays[i], &set.tmax[i], sdf::LANES, out);
+        keep(out);
+      }
+    };
+  };
+
+  results.push_back(measure("sdf::occludedPacket/hit", "simd/double", packet(hit)));
+  results.push_back(measure("sdf::occludedPacket/miss", "simd/double", packet(miss)));
+}
+
+auto benchCamera(std::vector<result>& results) -> void {
+  std::mt19937 gen(5);
+  std::uniform_real_distribution<pos_type> px(0, WIDTH);
+  std::uniform_real_distribution<pos_type> py(0, HEIGHT);
+  std::vector<pos_type> x(INPUTS), y(INPUTS);
+  for (int i = 0; i<INPUTS; i++) {
+    x[i] = px(gen);
+    y[i] = py(gen);
+  }
+
+  const camera cam{point(1,-2,0.5), 0.3};
+
+  results.push_back(measure("rayDir", "scalar/double", [&](int i) { keep(rayDir(90.0, x[i], y[i])); }));
+  results.push_back(measure("rayDir/camera", "scalar/double", [&](int i) { keep(rayDir(cam, 90.0, x[i], y[i])); }));
+}
+
+auto benchSampling(std::vector<result>& results) -> void {
+  results.push_back(measure("random_double", "scalar/double", [&](int) { keep(random_double()); }));
+  results.push_back(measure("sobolSample", "scalar/double", [&](int i) { keep(sobolSample(i, i & 7, 0x9e3779b9u)); }));
+  results.push_back(measure("blueNoise", "scalar/double", [&](int i) { keep(blueNoise(i % WIDTH, i / WIDTH, i & 7)); }));
+  // a pixel sample as rayCast starts one, under this build's SAMPLER
+  results.push_back(measure("sampler::get2D", "scalar/double", [&](int i) {
+    sampler s(i % WIDTH, i / WIDTH, i);
+    keep(s.get2D());
+  }));
+}
+
+auto writeJSON(const std::string& file, const std::vector<result>& results) -> void {
+  std::ofstream out(file);
+  out << std::setprecision(6);
+  out << "{\n  \"context\": {\"compiler\": \"" << __VERSION__ << "\", \"sampler\": " << SAMPLER
+      << ", \"inputs\": " << INPUTS << ", \"samples\": " << SAMPLES << ", \"sample_seconds\": " << SAMPLE_SECONDS
+      << ", \"cpu\": " << sched_getcpu() << "},\n  \"benchmarks\": [\n";
+
+  for (size_t i = 0; i<results.size(); i++) {
+    const result& r = results[i];
+    out << "    {\"name\": \"" << r.name << "\", \"variant\": \"" << r.variant
+        << "\", \"ns_per_op\": " << r.median_ns << ", \"ops_per_second\": " << 1e9 / r.median_ns
+        << ", \"min_ns\": " << r.min_ns << ", \"max_ns\": " << r.max_ns
+        << ", \"mean_ns\": " << r.mean_ns << ", \"stddev_ns\": " << r.stddev_ns
+        << ", \"mad_ns\": " << r.mad_ns << ", \"ops_per_sample\": " << r.ops_per_sample << "}"
+        << (i+1 < results.size() ? "," : "") << "\n";
+  }
+
+  out << "  ]\n}\n";
+}
+
+}
+
+auto main(int argc, char** argv) -> int {
+  const std::string file = argc > 1 ? argv[1] : "bench.json";
+
+  // one core for the whole run, so samples don't move between caches
+  pinThread(sched_getcpu());
+
+  std::vector<result> results;
+  benchPoint(results);
+  benchSphere(results);
+  benchPlane(results);
+  benchSDF(results);
+  benchCamera(results);
+  benchSampling(results);
+
+  std::cout << std::left << std::setw(28) << "benchmark" << std::setw(15) << "variant" << std::right
+            << std::setw(10) << "ns/op" << std::setw(10) << "mad" << std::setw(12) << "Mops/s" << std::endl;
+
+  for (const result& r : results) {
+    std::cout << std::left << std::setw(28) << r.name << std::setw(15) << r.variant << std::right << std::fixed
+              << std::setprecision(2) << std::setw(10) << r.median_ns << std::setw(10) << r.mad_ns
+              << std::setw(12) << 1e3 / r.median_ns << std::endl;
+  }
+
+  writeJSON(file, results);
+  std::cout << "Wrote " << file << std::endl;
+}
@@ -0,0 +1,231 @@
+// Builds kernels/sampler.cl and kernels/path.cl with the renderer's own
+// options and traces a SAMPLES spp frame of a small scene with a signed
+// distance object and scene lights, on an OpenCL CPU device (POCL, say) when
+// there is one. The frame fails the check if any pixel is not finite, if a
+// pixel all of whose primary rays miss on the CPU shows anything but sky, or
+// one all of whose rays hit shows only sky, or if the specialised and generic
+// kernels' frames differ. Prints every stage's device time and the path
+// records it read and wrote.
+//
+//   make clcheck && ./clcheck
+
+#include <cmath>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <memory>
+#include <iomanip>
+#include <iostream>
+
+#include "common.hpp"
+#include "pathcl.hpp"
+#include "trace.hpp"
+#include "scene.hpp"
+#include "image.hpp"
+#include "lights.hpp"
+#include "Structures/ray.hpp"
+#include "Structures/sdf.hpp"
+#include "Structures/objects.hpp"
+
+namespace {
+
+constexpr int SAMPLES = 4;
+// pixels further apart than this on the 0-255 scale differ
+constexpr pos_type MAX_SKY_ERROR = 1e-3;
+constexpr pos_type MAX_PIXEL_ERROR = 8;
+// share of pixels the specialised and generic frames may differ in, float
+// constants folded into the kernels can round differently and send a path
+// elsewhere
+constexpr double MAX_DIFFERING = 0.01;
+
+auto createScene() -> std::vector<std::shared_ptr<object>> {
+  std::vector<std::shared_ptr<object>> objects;
+  objects.push_back(std::make_shared<plane>(point(0,0,-3), point(0,0,1), point(0.5, 0.5, 0.5), 0.0, 1.0));
+  objects.push_back(std::make_shared<sphere>(point(0,20,2), 5, point(0.9, 0.1, 0.1), 0.2, 0.8));
+  objects.push_back(std::make_shared<sphere>(point(-8,18,0), 3, point(0.1, 0.1, 0.9), 0.6, 0.4));
+  objects.push_back(std::make_shared<sdf>(std::vector<sdf_node>{
+      {sdf_box, point(7,14,-1), point(1,1,1)},
+      {sdf_torus, point(7,14,0), point(1.8,0.45,0)},
+      {sdf_displace, point(7,14,0), point(0.08,0,0), 6.0},
+      {sdf_smooth_union, point(), point(), 0.6}
+    }, point(0.1, 0.9, 0.1), 0.3, 1.0));
+  return objects;
+}
+
+// one of each shape, so the light tree has more than a leaf
+auto createLights() -> std::vector<light> {
+  return {
+    light{point_light, point(-6,10,12), point(30,30,30)},
+    light{sphere_light, point(4,16,10), point(100,90,80), 0.3},
+    light{rect_light, point(0,24,14), point(30,30,40), 0, point(1,0,0), point(0,-1,0)}
+  };
+}
+
+// a device to check the kernels on, the first CPU one if there is one
+auto pickDevice() -> bool {
+  std::vector<cl::Platform> platforms;
+  cl::Platform::get(&platforms);
+
+  bool found = false;
+  for (const cl::Platform& platform : platforms) {
+    std::vector<cl::Device> devices;
+    platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+
+    for (const cl::Device& candidate : devices) {
+      if (candidate.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU) {
+        device = candidate;
+        return true;
+      }
+      if (!found) {
+        device = candidate;
+        found = true;
+      }
+    }
+  }
+
+  return found;
+}
+
+// whether every primary ray of pixel (x, y) misses, or every one hits. Rays
+// start anywhere in the pixel, so its corners and centre stand in for them
+auto primaryCoverage(const scene_t& scene, const camera& cam, int x, int y, bool& all_miss, bool& all_hit) -> void {
+  constexpr pos_type CORNERS[][2] = {{0,0}, {-0.55,-0.55}, {0.55,-0.55}, {-0.55,0.55}, {0.55,0.55}};
+  int hits = 0;
+
+  for (const auto& corner : CORNERS) {
+    features surface;
+    hits += firstHit(rayDir(cam, 90.0, x + corner[0], y + corner[1]), scene, surface) >= 0;
+  }
+
+  all_miss = hits == 0;
+  all_hit = hits == static_cast<int>(std::size(CORNERS));
+}
+
+auto distance(point a, point b) -> pos_type {
+  return std::max({std::abs(a.x - b.x), std::abs(a.y - b.y), std::abs(a.z - b.z)});
+}
+
+auto checkFrame(const scene_t& scene, const camera& cam, const array_t& image) -> int {
+  int failures = 0;
+  int misses = 0;
+  int hits = 0;
+  point sky;
+
+  for (int x = 0; x<WIDTH; x++) {
+    for (int y = 0; y<HEIGHT; y++) {
+      const point pixel = (*image)[x][y];
+      bool all_miss, all_hit;
+      primaryCoverage(scene, cam, x, y, all_miss, all_hit);
+
+      if (misses == 0 && all_miss) {
+        sky = pixel;
+      }
+      misses += all_miss;
+      hits += all_hit;
+
+      const bool broken = !std::isfinite(pixel.x) || !std::isfinite(pixel.y) || !std::isfinite(pixel.z)
+        || (all_miss && distance(pixel, sky) > MAX_SKY_ERROR)
+        || (all_hit && misses > 0 && distance(pixel, sky) <= MAX_SKY_ERROR);
+
+      if (broken) {
+        if (failures < 8) {
+          std::cerr << "pixel (" << x << ", " << y << ") is " << pixel << ", sky is " << sky
+                    << (all_miss ? ", every ray misses" : all_hit ? ", every ray hits" : "") << std::endl;
+        }
+        failures++;
+      }
+    }
+  }
+
+  std::cout << "frame: " << misses << " sky pixels at " << sky << ", " << hits << " covered, "
+            << failures << " wrong" << std::endl;
+  return failures + (misses == 0) + (hits == 0);
+}
+
+auto compareFrames(const array_t& a, const array_t& b) -> int {
+  int differing = 0;
+  pos_type worst = 0;
+
+  for (int x = 0; x<WIDTH; x++) {
+    for (int y = 0; y<HEIGHT; y++) {
+      const pos_type d = distance((*a)[x][y], (*b)[x][y]);
+      differing += d > MAX_PIXEL_ERROR;
+      worst = std::max(worst, d);
+    }
+  }
+
+  const double share = static_cast<double>(differing) / (WIDTH*HEIGHT);
+  std::cout << "specialised against generic: " << differing << " pixels differ, worst by " << worst << std::endl;
+  return share > MAX_DIFFERING ? 1 : 0;
+}
+
+// bytes of path records one work item of each stage reads and writes, as
+// kernels/path.cl does; scene, noise and light reads are left out
+auto recordBytes(const std::string& stage, const path_cl& state) -> size_t {
+  constexpr size_t slot = sizeof(cl_int);
+  constexpr size_t contrib = sizeof(cl_float4);
+
+  if (stage == "generate") {
+    return slot;
+  } else if (stage == "extend") {
+    return slot + sizeof(cl_PathState) + sizeof(cl_PathHit);
+  } else if (stage == "shade") {
+    return 2*slot + sizeof(cl_PathHit) + 2*sizeof(cl_PathState) + contrib + sizeof(cl_float3);
+  } else if (stage == "connect") {
+    return slot + sizeof(cl_PathHit) + sizeof(cl_PathState) + contrib;
+  } else if (stage == "resolve") {
+    return state.batchSpp*contrib + 2*sizeof(cl_float3);
+  }
+  return 0;
+}
+
+auto printStats(const path_cl& state) -> void {
+  double total_ms = 0;
+  double total_mb = 0;
+
+  for (const auto& [stage, stats] : state.stats) {
+    const double mb = static_cast<double>(stats.items) * recordBytes(stage, state) / (1 << 20);
+    std::cout << std::setw(9) << stage << ": " << std::setw(5) << stats.launches << " launches, "
+              << std::setw(9) << stats.items << " items, " << std::fixed << std::setprecision(2)
+              << std::setw(9) << stats.ms << " ms, " << std::setw(9) << mb << " MB of path records"
+              << std::endl;
+    total_ms += stats.ms;
+    total_mb += mb;
+  }
+
+  std::cout << "    total: " << total_ms << " ms, " << total_mb << " MB of path records"
+            << std::defaultfloat << std::setprecision(6) << std::endl;
+}
+
+}
+
+auto main() -> int {
+  if (!pickDevice()) {
+    std::cerr << "No openCL devices detected, cannot check the kernels" << std::endl;
+    return 1;
+  }
+
+  context = cl::Context(device);
+  std::cout << "Device: " << device.getInfo<CL_DEVICE_NAME>() << ", " << device.getInfo<CL_DEVICE_VERSION>() << std::endl;
+
+  const scene_t scene(createScene(), createLights());
+  const camera cam{};
+
+  path_cl state = setupPathCL(scene, SAMPLES, true);
+  gbuffer_t gbuffer = std::make_unique<std::array<std::array<features, HEIGHT>, WIDTH>>();
+
+  const array_t first = pathCL(state, scene, cam, gbuffer);
+  int failures = checkFrame(scene, cam, first);
+  printStats(state);
+
+  // the same frame from the other build of the kernels
+  buildPathKernels(state, !state.specialised);
+  state.stats.clear();
+
+  const array_t second = pathCL(state, scene, cam, gbuffer);
+  failures += checkFrame(scene, cam, second);
+  failures += compareFrames(first, second);
+  printStats(state);
+
+  return failures == 0 ? 0 : 1;
+}
@@ -1,4 +1,7 @@
+#pragma once
+
 #include <random>
+#include <cstddef>
 #include <tuple>
 
 constexpr int WIDTH = 128*4;
@@ -8,10 +11,120 @@ constexpr int MAX_RAY_DEPTH_PER_PIXEL = 8; // per path is more accurate
 constexpr int INITIAL_RAYS_PER_PIXEL = 128;
 constexpr int GRID_SIZE = 8;
 
+// device memory the OpenCL path tracer may use, frames are split into sample
+// batches (and row tiles if needed) to stay under it
+constexpr size_t OPENCL_MEMORY_BUDGET = 256 << 20;
+
+// single frame scenes up to this size are compiled into the OpenCL kernels as
+// constants, built programs are kept in OPENCL_KERNEL_CACHE
+constexpr bool OPENCL_SPECIALISE = true;
+constexpr int OPENCL_SPECIALISE_MAX_PRIMS = 64;
+constexpr const char* OPENCL_KERNEL_CACHE = "kernel_cache";
+
+// scene lights scattered over the default scene by createLights(), 0 keeps
+// the fixed area light. Shading points pick one through a light BVH, or
+// uniformly without LIGHT_TREE
+constexpr int SCENE_LIGHTS = 0;
+constexpr bool LIGHT_TREE = true;
+
+// image textures, every mip level stored as tiles in TEXTURE_CACHE_DIR and
+// read on first use into a cache of TEXTURE_CACHE_BYTES. FLOOR_TEXTURE, if
+// set, is a BMP repeated every FLOOR_TEXTURE_SCALE units on the floor.
+// Secondary rays pick mip levels as a cone of TEXTURE_BOUNCE_SPREAD radians.
+// OpenCL gets an atlas of at most TEXTURE_ATLAS_BYTES, without the finest
+// levels when they don't fit
+constexpr size_t TEXTURE_CACHE_BYTES = 16 << 20;
+constexpr const char* TEXTURE_CACHE_DIR = "texture_cache";
+constexpr const char* FLOOR_TEXTURE = "";
+constexpr double FLOOR_TEXTURE_SCALE = 4.0;
+constexpr double TEXTURE_BOUNCE_SPREAD = 0.05;
+constexpr size_t TEXTURE_ATLAS_BYTES = 64 << 20;
+
+// ENVIRONMENT_MAP, if set, is an equirectangular PFM lighting the scene from
+// all around, z up, times ENVIRONMENT_SCALE. Rays that miss see it instead of
+// the sky, and half of the light samples are drawn from it by luminance, see
+// environment.hpp
+constexpr const char* ENVIRONMENT_MAP = "";
+constexpr double ENVIRONMENT_SCALE = 1.0;
+
+// signed distance objects, see Structures/sdf.hpp, are sphere traced in at
+// most SDF_MAX_STEPS steps to within SDF_HIT_DISTANCE of the surface.
+// SDF_SCENE adds a displaced torus blended into a box to the default scene
+constexpr bool SDF_SCENE = false;
+constexpr int SDF_MAX_STEPS = 128;
+constexpr double SDF_HIT_DISTANCE = 1e-3;
+
+// more than one frame renders the createSequence() animation to
+// frame_NNNN.bmp in a single run
+constexpr int FRAMES = 1;
+
+// path tracing in coarse-to-fine passes, starting with one sample per
+// PROGRESSIVE_BLOCK^2 pixels, every pass rewrites PREVIEW_FILE
+constexpr bool PROGRESSIVE = false;
+constexpr int PROGRESSIVE_BLOCK = 8;
+constexpr const char* PREVIEW_FILE = "preview.bmp";
+
+// render a single frame, then change the material of every object in turn,
+// each time re-tracing only the EDIT_TILE square tiles whose paths shaded
+// that object. CPU path tracing only; moving an object can change any pixel
+constexpr bool EDIT_RERENDER = false;
+constexpr int EDIT_TILE = 16;
+
+// render for DEADLINE_SECONDS instead of a fixed sample count, in passes over
+// every pixel of one sample, INITIAL_RAYS_PER_PIXEL on OpenCL. The image holds
+// the complete passes, at least one; Ctrl-C stops early. 0 is off
+constexpr double DEADLINE_SECONDS = 0;
+
+// bidirectional CPU path tracing, see bdpt.hpp. Glossy surfaces reflect in
+// a Phong lobe of BDPT_GLOSSY_EXPONENT, and without SCENE_LIGHTS the fixed
+// area light has radiance BDPT_LIGHT_RADIANCE
+constexpr double BDPT_GLOSSY_EXPONENT = 64;
+constexpr double BDPT_LIGHT_RADIANCE = 25;
+
+// path guiding for CPU path tracing. Renders in passes of doubling sample
+// counts; after each, a spatial tree of directional histograms is refined from
+// what the pass saw. Diffuse bounces then sample the histograms with
+// probability 1-GUIDING_BSDF_FRACTION. Leaves that record more than
+// GUIDING_SPLIT_SAMPLES in a pass are split, up to GUIDING_MAX_LEAVES.
+constexpr bool PATH_GUIDING = false;
+constexpr double GUIDING_BSDF_FRACTION = 0.5;
+constexpr int GUIDING_SPLIT_SAMPLES = 4000;
+constexpr int GUIDING_MAX_LEAVES = 4096;
+
+// equal-time convergence benchmark instead of a render. Each budget (seconds)
+// records the error against a cached CONVERGENCE_REFERENCE_SPP reference,
+// appended to CONVERGENCE_CSV.
+constexpr bool CONVERGENCE = false;
+constexpr int CONVERGENCE_REFERENCE_SPP = 4096;
+constexpr double CONVERGENCE_BUDGETS[] = {0.25, 0.5, 1, 2, 4, 8, 16, 32};
+constexpr const char* CONVERGENCE_CSV = "convergence.csv";
+
+// frames are written while they render, in bands of OUTPUT_BAND_ROWS rows
+// with at most OUTPUT_QUEUE_DEPTH bands waiting between output stages
+constexpr int OUTPUT_BAND_ROWS = 8;
+constexpr int OUTPUT_QUEUE_DEPTH = 4;
+
+// frames are written as output.OUTPUT_FORMAT: "bmp", "png" (deflated at
+// PNG_LEVEL in bands of PNG_BAND_ROWS rows on every thread at once) or "qoi"
+constexpr const char* OUTPUT_FORMAT = "bmp";
+constexpr int PNG_LEVEL = 3;
+constexpr int PNG_BAND_ROWS = 32;
+
+// a-trous denoise pass between tracing and saving
+constexpr bool DENOISE = false;
+constexpr int DENOISE_ITERATIONS = 5;
+
+// irradiance cache for distributed tracing, error is Ward's a and the cache
+// is seeded from every SPACING-th pixel before the full pass
+constexpr bool IRRADIANCE_CACHE = true;
+constexpr double IRRADIANCE_CACHE_ERROR = 0.3;
+constexpr int IRRADIANCE_CACHE_SPACING = 4;
+
 enum trace_type {
   test,
   path,
   distributed,
+  bidirectional,
 };
 
 enum exec_type {
@@ -20,8 +133,42 @@ enum exec_type {
   opencl
 };
 
+enum sample_type {
+  uniform,
+  sobol,
+  blue_noise
+};
+
+enum pin_type {
+  unpinned,
+  compact,
+  spread
+};
+
+enum subset_type {
+  every_pixel,
+  checkerboard,
+  half_resolution
+};
+
 constexpr trace_type TYPE = path;
 constexpr exec_type EXEC = opencl;
+constexpr sample_type SAMPLER = sobol;
+
+// OpenMP thread placement. compact fills one NUMA node's cpus before the next,
+// spread splits the threads evenly over the nodes. When pinned, every band is
+// split by x between the nodes in use, each rendering from its own scene
+// copy, so framebuffer pages are first touched by the node that writes them.
+constexpr pin_type PINNING = spread;
+
+// CPU rendering that shades only a subset of pixels each pass: a checkerboard
+// (half of them) or one pixel of every 2x2 quad (a quarter), moving on every
+// pass. Pixels not shaded yet are rebuilt from shaded neighbours whose first
+// hit, found by one unshaded ray per pixel, has the same object, depth and
+// normal. SUBSET_PASSES passes of INITIAL_RAYS_PER_PIXEL samples; 2 and 4
+// shade every pixel once. Every pass rewrites PREVIEW_FILE
+constexpr subset_type SHADING_SUBSET = every_pixel;
+constexpr int SUBSET_PASSES = 1;
 
 inline constexpr auto get_grid_value(int grid_section) -> std::tuple<double, double> {
   // [[assume(grid_section < GRID_SIZE*GRID_SIZE)]]
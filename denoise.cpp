@@ -0,0 +1,190 @@
+#include "denoise.hpp"
+
+#include <vector>
+#include <cstdint>
+#include <bit>
+#include <cmath>
+#include <algorithm>
+
+// the image is stored [x][y], so planes are laid out the same way and the
+// inner (vectorised) loops run along y
+constexpr int TILE_SIZE = 32;
+
+// edge-stopping strengths; colour noise falls with 1/sqrt(spp), and the
+// colour term is halved every iteration
+constexpr float SIGMA_COLOUR = 0.8f;
+constexpr float SIGMA_NORMAL = 0.1f;
+constexpr float SIGMA_DEPTH = 0.02f;
+constexpr float SIGMA_ALBEDO = 0.05f;
+
+constexpr float B3_SPLINE[5] = {1.0f/16, 1.0f/4, 3.0f/8, 1.0f/4, 1.0f/16};
+
+// exp() for x <= 0 that vectorises under omp simd, 0 below 2^-126
+inline auto fastExp(float x) -> float {
+  x *= 1.4426950408889634f;
+
+  // clamped while still a float, so the cast below is always in range; NaN
+  // clamps too, as the comparison fails
+  const bool underflow = !(x >= -126.0f);
+  x = std::max(-126.0f, x);
+
+  // split into integer and fractional parts, truncation keeps f in (-1, 0]
+  const int xi = static_cast<int>(x);
+  const float f = x - static_cast<float>(xi);
+
+  // 2^f, 4th order Taylor
+  const float p = 1.0f + f*(0.6931471806f + f*(0.2402265070f + f*(0.0555041087f + f*0.0096181291f)));
+
+  const int32_t bits = (xi + 127) << 23;
+
+  return underflow ? 0.0f : p * std::bit_cast<float>(bits);
+}
+
+struct planes {
+  std::vector<float> r, g, b;
+
+  planes() : r(WIDTH*HEIGHT), g(WIDTH*HEIGHT), b(WIDTH*HEIGHT) {};
+};
+
+auto denoise(array_t image, const gbuffer_t& gbuffer, int spp) -> array_t {
+  constexpr int len = WIDTH*HEIGHT;
+
+  planes in;
+  planes out;
+  std::vector<float> nx(len), ny(len), nz(len);
+  std::vector<float> ar(len), ag(len), ab(len);
+  std::vector<float> depth(len);
+
+  for (int x = 0; x<WIDTH; x++) {
+    for (int y = 0; y<HEIGHT; y++) {
+      const int i = x*HEIGHT + y;
+      const auto& f = (*gbuffer)[x][y];
+
+      in.r[i] = (*image)[x][y].x / 255.0f;
+      in.g[i] = (*image)[x][y].y / 255.0f;
+      in.b[i] = (*image)[x][y].z / 255.0f;
+
+      nx[i] = f.normal.x;
+      ny[i] = f.normal.y;
+      nz[i] = f.normal.z;
+      ar[i] = f.albedo.x;
+      ag[i] = f.albedo.y;
+      ab[i] = f.albedo.z;
+      depth[i] = f.depth;
+    }
+  }
+
+  constexpr int tiles_x = (WIDTH + TILE_SIZE - 1) / TILE_SIZE;
+  constexpr int tiles_y = (HEIGHT + TILE_SIZE - 1) / TILE_SIZE;
+
+  for (int iter = 0; iter < DENOISE_ITERATIONS; iter++) {
+    const int step = 1 << iter;
+    const float sigma_colour = SIGMA_COLOUR / (std::sqrt(static_cast<float>(spp)) * step);
+    const float inv_colour = 1.0f / (sigma_colour*sigma_colour);
+    constexpr float inv_normal = 1.0f / (SIGMA_NORMAL*SIGMA_NORMAL);
+    constexpr float inv_depth = 1.0f / (SIGMA_DEPTH*SIGMA_DEPTH);
+    constexpr float inv_albedo = 1.0f / (SIGMA_ALBEDO*SIGMA_ALBEDO);
+
+    const float* in_r = in.r.data();
+    const float* in_g = in.g.data();
+    const float* in_b = in.b.data();
+    const float* n_x = nx.data();
+    const float* n_y = ny.data();
+    const float* n_z = nz.data();
+    const float* a_r = ar.data();
+    const float* a_g = ag.data();
+    const float* a_b = ab.data();
+    const float* z = depth.data();
+
+    #pragma omp parallel for collapse(2) schedule(dynamic)
+    for (int tx = 0; tx < tiles_x; tx++) {
+      for (int ty = 0; ty < tiles_y; ty++) {
+        const int x0 = tx*TILE_SIZE;
+        const int x1 = std::min(x0 + TILE_SIZE, WIDTH);
+        const int y0 = ty*TILE_SIZE;
+        const int y1 = std::min(y0 + TILE_SIZE, HEIGHT);
+
+        float sum_r[TILE_SIZE], sum_g[TILE_SIZE], sum_b[TILE_SIZE], sum_w[TILE_SIZE];
+
+        for (int x = x0; x < x1; x++) {
+          std::fill(sum_r, sum_r + TILE_SIZE, 0.0f);
+          std::fill(sum_g, sum_g + TILE_SIZE, 0.0f);
+          std::fill(sum_b, sum_b + TILE_SIZE, 0.0f);
+          std::fill(sum_w, sum_w + TILE_SIZE, 0.0f);
+
+          for (int dx = -2; dx <= 2; dx++) {
+            const int qx = x + dx*step;
+            if (qx < 0 || qx >= WIDTH) {
+              continue;
+            }
+
+            for (int dy = -2; dy <= 2; dy++) {
+              const float h = B3_SPLINE[dx+2] * B3_SPLINE[dy+2];
+              const int offset = dy*step;
+
+              // clip the row so every tap in the simd loop is in bounds
+              const int ya = std::max(y0, -offset);
+              const int yb = std::min(y1, HEIGHT - offset);
+
+              const int p_row = x*HEIGHT;
+              const int q_row = qx*HEIGHT + offset;
+
+              #pragma omp simd
+              for (int y = ya; y < yb; y++) {
+                const int p = p_row + y;
+                const int q = q_row + y;
+
+                const float dr = in_r[p] - in_r[q];
+                const float dg = in_g[p] - in_g[q];
+                const float db = in_b[p] - in_b[q];
+
+                const float dnx = n_x[p] - n_x[q];
+                const float dny = n_y[p] - n_y[q];
+                const float dnz = n_z[p] - n_z[q];
+
+                const float dar = a_r[p] - a_r[q];
+                const float dag = a_g[p] - a_g[q];
+                const float dab = a_b[p] - a_b[q];
+
+                // relative depth difference, bounded to [-1, 1]
+                const float dz = (z[p] - z[q]) / (z[p] + z[q] + 1.0f);
+
+                const float energy = (dr*dr + dg*dg + db*db) * inv_colour
+                                   + (dnx*dnx + dny*dny + dnz*dnz) * inv_normal
+                                   + (dz*dz) * inv_depth
+                                   + (dar*dar + dag*dag + dab*dab) * inv_albedo;
+
+                const float w = h * fastExp(-energy);
+
+                sum_r[y-y0] += w * in_r[q];
+                sum_g[y-y0] += w * in_g[q];
+                sum_b[y-y0] += w * in_b[q];
+                sum_w[y-y0] += w;
+              }
+            }
+          }
+
+          // the centre tap always has weight h > 0, so sum_w is never zero
+          #pragma omp simd
+          for (int y = y0; y < y1; y++) {
+            const int p = x*HEIGHT + y;
+            out.r[p] = sum_r[y-y0] / sum_w[y-y0];
+            out.g[p] = sum_g[y-y0] / sum_w[y-y0];
+            out.b[p] = sum_b[y-y0] / sum_w[y-y0];
+          }
+        }
+      }
+    }
+
+    std::swap(in, out);
+  }
+
+  for (int x = 0; x<WIDTH; x++) {
+    for (int y = 0; y<HEIGHT; y++) {
+      const int i = x*HEIGHT + y;
+      (*image)[x][y] = point(in.r[i], in.g[i], in.b[i])*255;
+    }
+  }
+
+  return image;
+}
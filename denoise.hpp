@@ -0,0 +1,8 @@
+#pragma once
+
+#include "image.hpp"
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010), guided by the
+// albedo, normal and depth written at the first hit. Works on the 0-255 image,
+// spp sets how much colour noise to expect.
+auto denoise(array_t image, const gbuffer_t& gbuffer, int spp) -> array_t;
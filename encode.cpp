@@ -0,0 +1,396 @@
+#include "encode.hpp"
+
+#include "common.hpp"
+
+#include <cstdlib>
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <zlib.h>
+
+namespace {
+
+constexpr int RGB_ROW = WIDTH*3;
+
+auto open(const std::string& file) -> std::ofstream {
+  std::ofstream out(file, std::ofstream::binary);
+  if (!out.is_open()) {
+    throw std::runtime_error("Can't open " + file + " to write");
+  }
+  return out;
+}
+
+auto putU32LE(std::ofstream& out, uint32_t v) -> void {
+  for (int i = 0; i < 4; i++) {
+    out.put(static_cast<char>((v >> (8*i)) & 0xff));
+  }
+}
+
+auto putU32BE(uint8_t* p, uint32_t v) -> void {
+  for (int i = 0; i < 4; i++) {
+    p[i] = (v >> (8*(3-i))) & 0xff;
+  }
+}
+
+// Writes bands to their place in the file as they come. Rows are padded to 4
+// bytes, stored bottom to top and BGR
+class bmp_encoder : public frame_encoder {
+public:
+  static constexpr int ROW_BYTES = (WIDTH*3 + 3) & ~3;
+  static constexpr int HEADER_BYTES = 54;
+
+  explicit bmp_encoder(const std::string& file) : out(open(file)) {
+    writeHeader();
+  }
+
+  auto band(int y0, int y1, std::vector<uint8_t> rgb) -> void override {
+    std::vector<uint8_t> bytes((y1-y0)*ROW_BYTES, 0);
+
+    // bottom row of the band comes first in the file
+    for (int y = y1-1; y >= y0; y--) {
+      uint8_t* row = &bytes[(y1-1 - y)*ROW_BYTES];
+      const uint8_t* src = &rgb[(y-y0)*RGB_ROW];
+
+      for (int x = 0; x<WIDTH; x++) {
+        row[3*x] = src[3*x + 2];
+        row[3*x + 1] = src[3*x + 1];
+        row[3*x + 2] = src[3*x];
+      }
+    }
+
+    out.seekp(HEADER_BYTES + static_cast<std::streamoff>(HEIGHT - y1)*ROW_BYTES);
+    out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+  }
+
+  auto finish() -> size_t override {
+    out.close();
+    return HEADER_BYTES + static_cast<size_t>(ROW_BYTES)*HEIGHT;
+  }
+
+private:
+  // same 24 bit header EasyBMP writes
+  auto writeHeader() -> void {
+    const uint32_t image_bytes = ROW_BYTES*HEIGHT;
+
+    out.put('B');
+    out.put('M');
+    putU32LE(out, image_bytes + HEADER_BYTES);
+    putU32LE(out, 0);
+    putU32LE(out, HEADER_BYTES);
+    putU32LE(out, 40);
+    putU32LE(out, WIDTH);
+    putU32LE(out, HEIGHT);
+    putU32LE(out, 1 | (24 << 16));
+    putU32LE(out, 0);
+    putU32LE(out, image_bytes);
+
+    for (int i = 0; i < 4; i++) {
+      putU32LE(out, 0);
+    }
+  }
+
+  std::ofstream out;
+};
+
+// encoders that need the whole frame keep the bands here
+class frame_buffer : public frame_encoder {
+public:
+  auto band(int y0, int y1, std::vector<uint8_t> rgb) -> void override {
+    std::copy(rgb.begin(), rgb.end(), frame.begin() + static_cast<size_t>(y0)*RGB_ROW);
+  }
+
+protected:
+  std::vector<uint8_t> frame = std::vector<uint8_t>(static_cast<size_t>(RGB_ROW)*HEIGHT);
+};
+
+auto paeth(int a, int b, int c) -> int {
+  const int p = a + b - c;
+  const int pa = std::abs(p - a);
+  const int pb = std::abs(p - b);
+  const int pc = std::abs(p - c);
+  return (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+}
+
+// row filtered with PNG filter type into out, prev is the row above or null
+auto filterRow(int type, const uint8_t* row, const uint8_t* prev, uint8_t* out) -> void {
+  for (int i = 0; i < RGB_ROW; i++) {
+    const int a = i >= 3 ? row[i-3] : 0;
+    const int b = prev ? prev[i] : 0;
+    const int c = (prev && i >= 3) ? prev[i-3] : 0;
+
+    int predicted = 0;
+    switch (type) {
+      case 1: predicted = a; break;
+      case 2: predicted = b; break;
+      case 3: predicted = (a + b) / 2; break;
+      case 4: predicted = paeth(a, b, c); break;
+    }
+    out[i] = static_cast<uint8_t>(row[i] - predicted);
+  }
+}
+
+// PNG compressed in bands of PNG_BAND_ROWS rows on every thread at once. Each
+// band is a raw deflate stream primed with the 32KB before it and ended on a
+// byte boundary, so the bands join into one zlib stream, as pigz does. Rows
+// take whichever filter leaves the smallest sum of magnitudes.
+class png_encoder : public frame_buffer {
+public:
+  explicit png_encoder(const std::string& file) : out(open(file)) {}
+
+  auto finish() -> size_t override {
+    constexpr int FILTERED_ROW = RGB_ROW + 1;
+    constexpr int bands = (HEIGHT + PNG_BAND_ROWS - 1) / PNG_BAND_ROWS;
+    constexpr size_t WINDOW = 32768;
+
+    std::vector<uint8_t> filtered(static_cast<size_t>(FILTERED_ROW)*HEIGHT);
+
+    #pragma omp parallel
+    {
+      std::vector<uint8_t> trial(RGB_ROW);
+
+      #pragma omp for schedule(static)
+      for (int y = 0; y < HEIGHT; y++) {
+        const uint8_t* row = &frame[static_cast<size_t>(y)*RGB_ROW];
+        const uint8_t* prev = y > 0 ? row - RGB_ROW : nullptr;
+        uint8_t* dst = &filtered[static_cast<size_t>(y)*FILTERED_ROW];
+        long best = -1;
+
+        for (int type = 0; type < 5; type++) {
+          filterRow(type, row, prev, trial.data());
+
+          long cost = 0;
+          for (uint8_t v : trial) {
+            cost += std::abs(static_cast<int8_t>(v));
+          }
+
+          if (best < 0 || cost < best) {
+            best = cost;
+            dst[0] = type;
+            std::copy(trial.begin(), trial.end(), dst + 1);
+          }
+        }
+      }
+    }
+
+    std::vector<std::vector<uint8_t>> streams(bands);
+    std::vector<uLong> checks(bands);
+    std::vector<char> failed(bands, false);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b < bands; b++) {
+      const size_t start = static_cast<size_t>(b)*PNG_BAND_ROWS*FILTERED_ROW;
+      const size_t end = std::min(static_cast<size_t>(b+1)*PNG_BAND_ROWS, static_cast<size_t>(HEIGHT))*FILTERED_ROW;
+      const bool last = b == bands-1;
+
+      checks[b] = adler32(adler32(0, nullptr, 0), &filtered[start], end - start);
+
+      z_stream z{};
+      if (deflateInit2(&z, PNG_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        failed[b] = true;
+        continue;
+      }
+
+      if (start > 0) {
+        const size_t from = start > WINDOW ? start - WINDOW : 0;
+        deflateSetDictionary(&z, &filtered[from], start - from);
+      }
+
+      std::vector<uint8_t>& bytes = streams[b];
+      bytes.resize(deflateBound(&z, end - start) + 16);
+      z.next_in = &filtered[start];
+      z.avail_in = end - start;
+
+      // only the last band ends the stream, the others flush to a byte boundary
+      while (true) {
+        z.next_out = bytes.data() + z.total_out;
+        z.avail_out = bytes.size() - z.total_out;
+        const int result = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+
+        if (result == Z_STREAM_ERROR) {
+          failed[b] = true;
+          break;
+        }
+        if ((last && result == Z_STREAM_END) || (!last && z.avail_out > 0)) {
+          break;
+        }
+        bytes.resize(bytes.size()*2);
+      }
+
+      bytes.resize(z.total_out);
+      deflateEnd(&z);
+    }
+
+    if (std::find(failed.begin(), failed.end(), true) != failed.end()) {
+      throw std::runtime_error("PNG compression failed");
+    }
+
+    // zlib header, then the bands, then the checksum of everything
+    uLong check = adler32(0, nullptr, 0);
+    size_t idat_bytes = 2 + 4;
+    for (int b = 0; b < bands; b++) {
+      const size_t start = static_cast<size_t>(b)*PNG_BAND_ROWS*FILTERED_ROW;
+      const size_t end = std::min(static_cast<size_t>(b+1)*PNG_BAND_ROWS, static_cast<size_t>(HEIGHT))*FILTERED_ROW;
+      check = adler32_combine(check, checks[b], end - start);
+      idat_bytes += streams[b].size();
+    }
+
+    const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    write(signature, 8);
+
+    uint8_t ihdr[13] = {};
+    putU32BE(ihdr, WIDTH);
+    putU32BE(ihdr + 4, HEIGHT);
+    ihdr[8] = 8;   // bits per channel
+    ihdr[9] = 2;   // RGB
+    chunk("IHDR", {{ihdr, sizeof(ihdr)}});
+
+    const uint8_t zlib_header[2] = {0x78, 0x9c};
+    uint8_t trailer[4];
+    putU32BE(trailer, check);
+
+    std::vector<std::pair<const uint8_t*, size_t>> parts = {{zlib_header, 2}};
+    for (const auto& s : streams) {
+      parts.push_back({s.data(), s.size()});
+    }
+    parts.push_back({trailer, 4});
+    chunk("IDAT", parts);
+    chunk("IEND", {});
+
+    out.close();
+    return 8 + (12 + 13) + (12 + idat_bytes) + 12;
+  }
+
+private:
+  auto write(const uint8_t* data, size_t size) -> void {
+    out.write(reinterpret_cast<const char*>(data), size);
+  }
+
+  // length, type, data and CRC of type and data
+  auto chunk(const char* type, const std::vector<std::pair<const uint8_t*, size_t>>& parts) -> void {
+    size_t length = 0;
+    for (const auto& [data, size] : parts) {
+      length += size;
+    }
+
+    uint8_t word[4];
+    putU32BE(word, length);
+    write(word, 4);
+
+    const auto* name = reinterpret_cast<const uint8_t*>(type);
+    write(name, 4);
+    uLong crc = crc32(crc32(0, nullptr, 0), name, 4);
+
+    for (const auto& [data, size] : parts) {
+      write(data, size);
+      crc = crc32(crc, data, size);
+    }
+
+    putU32BE(word, crc);
+    write(word, 4);
+  }
+
+  std::ofstream out;
+};
+
+// QOI (qoiformat.org), one pass over the frame. Every pixel is a run of the
+// last, a recently seen colour, a small difference from the last, or itself
+class qoi_encoder : public frame_buffer {
+public:
+  explicit qoi_encoder(const std::string& file) : out(open(file)) {}
+
+  auto finish() -> size_t override {
+    constexpr size_t pixels = static_cast<size_t>(WIDTH)*HEIGHT;
+
+    // the worst case is 4 bytes a pixel
+    std::vector<uint8_t> bytes(14 + pixels*4 + 8);
+    uint8_t* p = bytes.data();
+
+    *p++ = 'q'; *p++ = 'o'; *p++ = 'i'; *p++ = 'f';
+    putU32BE(p, WIDTH);
+    putU32BE(p + 4, HEIGHT);
+    p += 8;
+    *p++ = 3;   // RGB
+    *p++ = 0;   // sRGB with linear alpha
+
+    // alpha is always 255, but the table starts out all 0
+    struct rgba { uint8_t r, g, b, a; };
+    rgba seen[64] = {};
+    rgba last{0, 0, 0, 255};
+    int run = 0;
+
+    for (size_t i = 0; i < pixels; i++) {
+      const rgba px{frame[3*i], frame[3*i + 1], frame[3*i + 2], 255};
+
+      if (px.r == last.r && px.g == last.g && px.b == last.b) {
+        run++;
+        if (run == 62 || i == pixels-1) {
+          *p++ = 0xc0 | (run - 1);
+          run = 0;
+        }
+        continue;
+      }
+
+      if (run > 0) {
+        *p++ = 0xc0 | (run - 1);
+        run = 0;
+      }
+
+      const int slot = (px.r*3 + px.g*5 + px.b*7 + px.a*11) % 64;
+      if (seen[slot].r == px.r && seen[slot].g == px.g && seen[slot].b == px.b && seen[slot].a == px.a) {
+        *p++ = slot;
+
+      } else {
+        seen[slot] = px;
+
+        const int dr = static_cast<int8_t>(px.r - last.r);
+        const int dg = static_cast<int8_t>(px.g - last.g);
+        const int db = static_cast<int8_t>(px.b - last.b);
+        const int dr_dg = dr - dg;
+        const int db_dg = db - dg;
+
+        if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+          *p++ = 0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+        } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+          *p++ = 0x80 | (dg + 32);
+          *p++ = (dr_dg + 8) << 4 | (db_dg + 8);
+        } else {
+          *p++ = 0xfe;
+          *p++ = px.r;
+          *p++ = px.g;
+          *p++ = px.b;
+        }
+      }
+
+      last = px;
+    }
+
+    for (int i = 0; i < 7; i++) {
+      *p++ = 0;
+    }
+    *p++ = 1;
+
+    const size_t size = p - bytes.data();
+    out.write(reinterpret_cast<const char*>(bytes.data()), size);
+    out.close();
+    return size;
+  }
+
+private:
+  std::ofstream out;
+};
+
+}
+
+auto encoderFor(const std::string& file) -> std::unique_ptr<frame_encoder> {
+  const std::string ext = file.substr(file.find_last_of('.') + 1);
+
+  if (ext == "bmp") {
+    return std::make_unique<bmp_encoder>(file);
+  } else if (ext == "png") {
+    return std::make_unique<png_encoder>(file);
+  } else if (ext == "qoi") {
+    return std::make_unique<qoi_encoder>(file);
+  }
+
+  throw std::runtime_error("No encoder for " + file + ", use .bmp, .png or .qoi");
+}
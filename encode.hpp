@@ -0,0 +1,23 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Turns the output pipeline's quantised rows into a file. Bands are rows
+// [y0, y1) as 8 bit RGB, top row first, and may come in any order; each
+// encoder decides whether to write them as they come or keep them until
+// finish().
+class frame_encoder {
+public:
+  virtual ~frame_encoder() = default;
+
+  virtual auto band(int y0, int y1, std::vector<uint8_t> rgb) -> void = 0;
+  // every band has been given. Writes what is left, closes the file and
+  // returns its size in bytes
+  virtual auto finish() -> size_t = 0;
+};
+
+// by the extension of file: .bmp, .png or .qoi
+auto encoderFor(const std::string& file) -> std::unique_ptr<frame_encoder>;
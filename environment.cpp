@@ -0,0 +1,171 @@
+#include "environment.hpp"
+
+#include <cmath>
+#include <chrono>
+#include <fstream>
+#include <numbers>
+#include <algorithm>
+#include <stdexcept>
+
+alias_table::alias_table(const std::vector<double>& weights) : bins(weights.size()) {
+  const int n = weights.size();
+  double sum = 0;
+  for (double weight : weights) {
+    sum += weight;
+  }
+
+  // every weight scaled so the mean is one; bins under one are topped up by
+  // one over it, which loses that much of its own
+  std::vector<double> scaled(n);
+  std::vector<int> small;
+  std::vector<int> large;
+  for (int i = 0; i < n; i++) {
+    scaled[i] = sum > 0 ? weights[i] * n / sum : 1;
+    (scaled[i] < 1 ? small : large).push_back(i);
+  }
+
+  while (!small.empty() && !large.empty()) {
+    const int less = small.back();
+    const int more = large.back();
+    small.pop_back();
+
+    bins[less] = {static_cast<float>(scaled[less]), more};
+    scaled[more] -= 1 - scaled[less];
+
+    if (scaled[more] < 1) {
+      large.pop_back();
+      small.push_back(more);
+    }
+  }
+
+  // what's left is one up to rounding
+  for (int i : small) {
+    bins[i] = {1, i};
+  }
+  for (int i : large) {
+    bins[i] = {1, i};
+  }
+}
+
+auto alias_table::sample(pos_type& u) const -> int {
+  return sample(bins.data(), bins.size(), u);
+}
+
+auto alias_table::sample(const entry* bins, int count, pos_type& u) -> int {
+  // keeps the rescaled number below one however the rounding goes
+  u = std::min(u, 1 - 1e-12);
+
+  const int i = std::min(static_cast<int>(u*count), count-1);
+  const pos_type f = u*count - i;
+
+  if (f < bins[i].threshold) {
+    u = f / bins[i].threshold;
+    return i;
+  }
+
+  u = (f - bins[i].threshold) / (1 - bins[i].threshold);
+  return bins[i].alias;
+}
+
+namespace {
+
+constexpr pos_type PI = std::numbers::pi;
+
+// mean of the channels, as the light tree weighs power
+auto luminance(point c) -> pos_type {
+  return (c.x + c.y + c.z) / 3;
+}
+
+}
+
+environment_map::environment_map(const std::string& file, pos_type scale) {
+  std::ifstream in(file, std::ifstream::binary);
+  std::string magic;
+  double endian = 0;
+  in >> magic >> w >> h >> endian;
+  // one whitespace byte before the floats
+  in.get();
+
+  if (!in || (magic != "PF" && magic != "Pf") || w <= 0 || h <= 0) {
+    throw std::runtime_error("Can't read environment map " + file + ", expected a PFM");
+  }
+  // a negative scale is little endian, which is what this reads
+  if (endian >= 0) {
+    throw std::runtime_error("Big endian PFM isn't supported in " + file);
+  }
+
+  const int channels = magic == "PF" ? 3 : 1;
+  std::vector<float> data(static_cast<size_t>(w)*h*channels);
+  in.read(reinterpret_cast<char*>(data.data()), data.size()*sizeof(float));
+
+  if (!in) {
+    throw std::runtime_error("Truncated environment map " + file);
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+
+  // nothing negative or non-finite can be sampled sensibly
+  auto fix = [&](pos_type v) { return std::isfinite(v) ? std::max(v * scale, 0.0) : 0.0; };
+
+  texels.resize(static_cast<size_t>(w)*h);
+  for (int row = 0; row < h; row++) {
+    // PFM rows go bottom to top
+    const float* src = &data[static_cast<size_t>(h-1-row)*w*channels];
+
+    for (int col = 0; col < w; col++) {
+      const float* c = src + col*channels;
+      const point texel = channels == 3 ? point(c[0], c[1], c[2]) : point(c[0], c[0], c[0]);
+      texels[static_cast<size_t>(row)*w + col] = point(fix(texel.x), fix(texel.y), fix(texel.z));
+    }
+  }
+
+  std::vector<double> row_weights(h);
+  std::vector<double> weights(w);
+  column_entries.reserve(static_cast<size_t>(w)*h);
+
+  for (int row = 0; row < h; row++) {
+    for (int col = 0; col < w; col++) {
+      weights[col] = weight(row, col);
+      row_weights[row] += weights[col];
+    }
+
+    const alias_table columns(weights);
+    column_entries.insert(column_entries.end(), columns.entries().begin(), columns.entries().end());
+    weight_sum += row_weights[row];
+  }
+
+  row_table = alias_table(row_weights);
+  build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+auto environment_map::weight(int row, int col) const -> pos_type {
+  return luminance(texels[static_cast<size_t>(row)*w + col]) * std::sin(PI * (row + 0.5) / h);
+}
+
+auto environment_map::radiance(point dir) const -> point {
+  const pos_type length = std::sqrt(dir.x*dir.x + dir.y*dir.y + dir.z*dir.z);
+  pos_type u = std::atan2(dir.y, dir.x) / (2*PI);
+  u = u < 0 ? u + 1 : u;
+  const pos_type v = std::acos(std::clamp(dir.z / length, -1.0, 1.0)) / PI;
+
+  const int col = std::min(static_cast<int>(u*w), w-1);
+  const int row = std::min(static_cast<int>(v*h), h-1);
+  return texels[static_cast<size_t>(row)*w + col];
+}
+
+auto environment_map::sample(pos_type u, pos_type v, point& dir) const -> point {
+  const int row = row_table.sample(u);
+  const int col = alias_table::sample(&column_entries[static_cast<size_t>(row)*w], w, v);
+
+  const pos_type phi = 2*PI * (col + v) / w;
+  const pos_type theta = PI * (row + u) / h;
+  const pos_type sin_theta = std::sin(theta);
+  dir = point(sin_theta * std::cos(phi), sin_theta * std::sin(phi), std::cos(theta));
+
+  // the texel's share of the weight spread over its solid angle, which is
+  // 2 pi^2 sin(theta) / (w h) per unit of (u, v)
+  const pos_type pdf = weight_sum > 0 && sin_theta > 0
+    ? weight(row, col) / weight_sum * w * h / (2*PI*PI * sin_theta)
+    : 0;
+  return pdf > 0 ? texels[static_cast<size_t>(row)*w + col] / pdf : point(0, 0, 0);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "Structures/point.hpp"
+
+// Vose's alias method. After an O(n) build, an index is drawn in proportion to
+// its weight with one uniform number: pick a bin, then keep it or take its
+// alias by comparing the rest of the number with the bin's threshold.
+class alias_table {
+public:
+  // same layout as AliasEntry in kernels/path.cl
+  struct entry {
+    float threshold;
+    int alias;
+  };
+
+  alias_table() = default;
+  // all zero weights draw uniformly
+  explicit alias_table(const std::vector<double>& weights);
+
+  // u is rescaled to a fresh uniform number, as in light_tree::pick
+  auto sample(pos_type& u) const -> int;
+  // the same over a table laid out elsewhere
+  static auto sample(const entry* bins, int count, pos_type& u) -> int;
+  auto entries() const -> const std::vector<entry>& { return bins; }
+
+private:
+  std::vector<entry> bins;
+};
+
+// Equirectangular light around the whole scene, with z up: u runs around z
+// from +x, v from straight up to straight down. Radiance is constant over a
+// texel. Directions are drawn in proportion to a texel's luminance times the
+// sine at its centre, roughly its share of the sphere's power, with a 2D alias
+// table: one table picks the row, then that row's own table picks the texel.
+class environment_map {
+public:
+  environment_map() = default;
+  // a colour or grey PFM, every texel times scale
+  environment_map(const std::string& file, pos_type scale);
+
+  auto empty() const -> bool { return texels.empty(); }
+  auto width() const -> int { return w; }
+  auto height() const -> int { return h; }
+
+  // dir needn't be unit length
+  auto radiance(point dir) const -> point;
+  // unit direction for (u, v) in [0,1), value is its radiance over the solid
+  // angle density of drawing it
+  auto sample(pos_type u, pos_type v, point& dir) const -> point;
+
+  // for the OpenCL copy, see setupPathCL. Columns are every row's table in
+  // turn, total is the sum of the weights described above
+  auto pixels() const -> const std::vector<point>& { return texels; }
+  auto rows() const -> const alias_table& { return row_table; }
+  auto columns() const -> const std::vector<alias_table::entry>& { return column_entries; }
+  auto total() const -> pos_type { return weight_sum; }
+  // time taken to build both levels of tables
+  auto buildMs() const -> double { return build_ms; }
+
+private:
+  auto weight(int row, int col) const -> pos_type;
+
+  int w = 0;
+  int h = 0;
+  std::vector<point> texels;
+  alias_table row_table;
+  std::vector<alias_table::entry> column_entries;
+  pos_type weight_sum = 0;
+  double build_ms = 0;
+};
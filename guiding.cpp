@@ -0,0 +1,187 @@
+#include "guiding.hpp"
+
+#include <cmath>
+#include <atomic>
+#include <algorithm>
+
+namespace {
+
+constexpr pos_type PI = 3.14159265358979323;
+
+// distinct for every pass of every guide, so a thread can tell its cached
+// accumulator is stale
+std::atomic<uint64_t> generations = 0;
+
+auto coord(const point& p, int axis) -> pos_type {
+  return axis == 0 ? p.x : (axis == 1 ? p.y : p.z);
+}
+
+auto setCoord(point& p, int axis, pos_type v) -> void {
+  (axis == 0 ? p.x : (axis == 1 ? p.y : p.z)) = v;
+}
+
+}
+
+path_guide::path_guide(int split_samples, int max_leaves)
+  : split_samples(split_samples), max_leaves(max_leaves) {
+  reset(point(-1,-1,-1), point(1,1,1));
+}
+
+auto path_guide::reset(point lo, point hi) -> void {
+  nodes.assign(1, node{lo, hi, -1, 0, 0});
+
+  cdf.resize(BINS);
+  for (int b = 0; b<BINS; b++) {
+    cdf[b] = static_cast<float>(b+1) / BINS;
+  }
+
+  leaf_count = 1;
+  accumulators.clear();
+  generation = ++generations;
+}
+
+auto path_guide::leaves() const -> size_t {
+  return leaf_count;
+}
+
+auto path_guide::leaf(const point& pos) const -> int {
+  int n = 0;
+
+  while (nodes[n].child >= 0) {
+    const node& cur = nodes[n];
+    const pos_type mid = (coord(cur.lo, cur.axis) + coord(cur.hi, cur.axis)) / 2;
+    n = cur.child + (coord(pos, cur.axis) >= mid);
+  }
+
+  return nodes[n].leaf;
+}
+
+auto path_guide::bin(const point& dir) const -> int {
+  const int t = std::clamp(static_cast<int>((dir.z + 1) / 2 * THETA_BINS), 0, THETA_BINS-1);
+  const int p = std::clamp(static_cast<int>((std::atan2(dir.y, dir.x) + PI) / (2*PI) * PHI_BINS), 0, PHI_BINS-1);
+  return t*PHI_BINS + p;
+}
+
+auto path_guide::sample(int leaf, pos_type u, pos_type v) const -> point {
+  const float* row = &cdf[leaf*BINS];
+  const int b = std::min(static_cast<int>(std::upper_bound(row, row + BINS, u) - row), BINS-1);
+
+  // reuse what is left of u to place the sample inside its bin
+  const pos_type before = b > 0 ? row[b-1] : 0;
+  const pos_type p = row[b] - before;
+  const pos_type w = p > 0 ? std::clamp((u - before) / p, 0.0, 1.0) : 0.5;
+
+  const pos_type z = -1 + (b/PHI_BINS + w) * 2 / THETA_BINS;
+  const pos_type phi = -PI + (b%PHI_BINS + v) * 2*PI / PHI_BINS;
+  const pos_type r = std::sqrt(std::max(0.0, 1 - z*z));
+
+  return point(r*std::cos(phi), r*std::sin(phi), z);
+}
+
+auto path_guide::pdf(int leaf, const point& dir) const -> pos_type {
+  const float* row = &cdf[leaf*BINS];
+  const int b = bin(dir);
+  const pos_type p = row[b] - (b > 0 ? row[b-1] : 0);
+
+  // every bin covers the same solid angle
+  return p * BINS / (4*PI);
+}
+
+auto path_guide::local() -> accumulator& {
+  thread_local uint64_t cached_generation = 0;
+  thread_local accumulator* cached = nullptr;
+
+  if (cached_generation != generation) {
+    auto acc = std::make_unique<accumulator>();
+    acc->recorded.assign(leaf_count*BINS, 0);
+    acc->counts.assign(leaf_count, 0);
+
+    std::scoped_lock guard(accumulators_lock);
+    cached = acc.get();
+    cached_generation = generation;
+    accumulators.push_back(std::move(acc));
+  }
+
+  return *cached;
+}
+
+auto path_guide::record(int leaf, const point& dir, pos_type value) -> void {
+  accumulator& acc = local();
+  acc.recorded[leaf*BINS + bin(dir)] += static_cast<float>(value);
+  acc.counts[leaf]++;
+}
+
+auto path_guide::split(int n, uint32_t samples) -> void {
+  if (static_cast<int>(samples) <= split_samples || static_cast<int>(leaf_count) >= max_leaves) {
+    return;
+  }
+
+  // halve the longest side, the children start from the parent's histogram
+  const point extent = nodes[n].hi - nodes[n].lo;
+  const int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z ? 1 : 2);
+  const pos_type mid = (coord(nodes[n].lo, axis) + coord(nodes[n].hi, axis)) / 2;
+
+  node lower = nodes[n];
+  node upper = nodes[n];
+  setCoord(lower.hi, axis, mid);
+  setCoord(upper.lo, axis, mid);
+
+  upper.leaf = leaf_count++;
+  cdf.insert(cdf.end(), cdf.begin() + lower.leaf*BINS, cdf.begin() + (lower.leaf+1)*BINS);
+
+  const int child = nodes.size();
+  nodes.push_back(lower);
+  nodes.push_back(upper);
+  nodes[n].child = child;
+  nodes[n].axis = axis;
+  nodes[n].leaf = -1;
+
+  // assume the samples were spread evenly over the box
+  split(child, samples/2);
+  split(child+1, samples/2);
+}
+
+auto path_guide::refine() -> void {
+  std::vector<double> recorded(leaf_count*BINS, 0);
+  std::vector<uint32_t> counts(leaf_count, 0);
+
+  for (const auto& acc : accumulators) {
+    for (size_t i = 0; i<recorded.size(); i++) {
+      recorded[i] += acc->recorded[i];
+    }
+    for (size_t l = 0; l<counts.size(); l++) {
+      counts[l] += acc->counts[l];
+    }
+  }
+
+  for (size_t l = 0; l<leaf_count; l++) {
+    const double* values = &recorded[l*BINS];
+
+    double total = 0;
+    for (int b = 0; b<BINS; b++) {
+      total += std::max(values[b], 0.0);
+    }
+
+    // leaves that saw nothing keep what they had
+    if (counts[l] == 0 || total <= 0) {
+      continue;
+    }
+
+    double sum = 0;
+    for (int b = 0; b<BINS; b++) {
+      sum += std::max(values[b], 0.0);
+      cdf[l*BINS + b] = static_cast<float>(sum / total);
+    }
+    cdf[l*BINS + BINS-1] = 1;
+  }
+
+  const int old_nodes = nodes.size();
+  for (int n = 0; n<old_nodes; n++) {
+    if (nodes[n].child < 0) {
+      split(n, counts[nodes[n].leaf]);
+    }
+  }
+
+  accumulators.clear();
+  generation = ++generations;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+#include "Structures/point.hpp"
+
+// Path guiding (after Müller et al. 2017, "Practical Path Guiding"). Space is
+// a binary tree of boxes, each leaf holds a histogram over directions on an
+// equal-area (cos theta, phi) grid. A pass samples from the histograms built
+// by the passes before it while recording new estimates of incident radiance
+// times cosine; refine() then turns those into the next histograms and splits
+// leaves that saw many samples. Every thread records into its own buffers,
+// which refine() sums, and the tree and histograms being sampled are
+// read-only during a pass.
+class path_guide {
+public:
+  static constexpr int THETA_BINS = 8;
+  static constexpr int PHI_BINS = 16;
+  static constexpr int BINS = THETA_BINS*PHI_BINS;
+
+  path_guide(int split_samples, int max_leaves);
+
+  // forgets everything, leaves one uniform leaf covering [lo, hi]
+  auto reset(point lo, point hi) -> void;
+  // leaf holding pos, positions outside the bounds go to the nearest leaf
+  auto leaf(const point& pos) const -> int;
+
+  // unit direction from two uniform numbers, and the solid angle density of
+  // picking dir from leaf
+  auto sample(int leaf, pos_type u, pos_type v) const -> point;
+  auto pdf(int leaf, const point& dir) const -> pos_type;
+
+  // estimate of radiance times cosine over the sampling density, for unit dir
+  auto record(int leaf, const point& dir, pos_type value) -> void;
+  // rebuilds the histograms from what was recorded and splits busy leaves,
+  // must not run during a pass
+  auto refine() -> void;
+
+  auto leaves() const -> size_t;
+
+private:
+  struct node {
+    point lo, hi;
+    int child = -1; // children are child and child+1, -1 on leaves
+    int axis = 0;
+    int leaf = -1;
+  };
+
+  // one thread's records for one pass
+  struct accumulator {
+    std::vector<float> recorded;
+    std::vector<uint32_t> counts;
+  };
+
+  auto bin(const point& dir) const -> int;
+  auto split(int n, uint32_t samples) -> void;
+  auto local() -> accumulator&;
+
+  std::vector<node> nodes;
+  // per leaf, BINS entries each
+  std::vector<float> cdf;
+  size_t leaf_count = 0;
+
+  // threads register an accumulator on their first record of a pass, only
+  // that takes the lock
+  std::mutex accumulators_lock;
+  std::vector<std::unique_ptr<accumulator>> accumulators;
+  uint64_t generation = 0;
+
+  int split_samples;
+  int max_leaves;
+};
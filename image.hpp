@@ -0,0 +1,50 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <new>
+
+#include "common.hpp"
+#include "Structures/point.hpp"
+
+using array_t = std::unique_ptr<std::array<std::array<point, HEIGHT>, WIDTH>>;
+
+// frame whose pages are not touched until the renderer writes them, so on a
+// NUMA machine each page lands on the node of the thread that renders it.
+// Every pixel must be written before it is read.
+inline auto uninitialisedImage() -> array_t {
+  using frame = array_t::element_type;
+  return array_t(static_cast<frame*>(::operator new(sizeof(frame))));
+}
+
+// first-hit surface data, averaged over a pixel's samples
+struct features {
+  point albedo;
+  point normal;
+  pos_type depth = 0;
+
+  features& operator+=(const features& f) {
+    albedo += f.albedo;
+    normal += f.normal;
+    depth += f.depth;
+    return *this;
+  }
+
+  features operator*(pos_type scalar) const {
+    return features{albedo*scalar, normal*scalar, depth*scalar};
+  }
+
+  features operator/(pos_type scalar) const {
+    return features{albedo/scalar, normal/scalar, depth/scalar};
+  }
+};
+
+using gbuffer_t = std::unique_ptr<std::array<std::array<features, HEIGHT>, WIDTH>>;
+
+#pragma omp declare reduction(featureAdd : features : omp_out += omp_in)
+
+// features counterpart of uninitialisedImage()
+inline auto uninitialisedFeatures() -> gbuffer_t {
+  using frame = gbuffer_t::element_type;
+  return gbuffer_t(static_cast<frame*>(::operator new(sizeof(frame))));
+}
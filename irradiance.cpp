@@ -0,0 +1,126 @@
+#include "irradiance.hpp"
+
+#include <cmath>
+#include <mutex>
+#include <algorithm>
+
+irradiance_cache::irradiance_cache(pos_type error, pos_type min_radius, pos_type max_radius)
+  : error(error), min_radius(min_radius), max_radius(max_radius), cell_size(error*max_radius) {}
+
+auto irradiance_cache::cellOf(pos_type v) const -> int {
+  return static_cast<int>(std::floor(v / cell_size));
+}
+
+auto irradiance_cache::cellKey(int x, int y, int z) const -> uint64_t {
+  // 21 bits per axis is plenty for any scene we render
+  constexpr uint64_t mask = (1 << 21) - 1;
+  return ((static_cast<uint64_t>(x) & mask) << 42)
+       | ((static_cast<uint64_t>(y) & mask) << 21)
+       | (static_cast<uint64_t>(z) & mask);
+}
+
+auto irradiance_cache::shardOf(uint64_t key) const -> int {
+  // mix first, a flat floor otherwise puts every cell in the same shard
+  return static_cast<int>((key * 0x9e3779b97f4a7c15ull) >> 58) % SHARDS;
+}
+
+auto irradiance_cache::clampRadius(pos_type radius) const -> pos_type {
+  return std::clamp(radius, min_radius, max_radius);
+}
+
+auto irradiance_cache::lookup(point pos, point normal, int obj) const -> irradiance_sample {
+  const uint64_t key = cellKey(cellOf(pos.x), cellOf(pos.y), cellOf(pos.z));
+  const shard& sh = shards[shardOf(key)];
+
+  irradiance_sample result;
+  pos_type weight_sum = 0;
+  pos_type indirect_weight = 0;
+  bool light_agrees = true;
+  int light_records = 0;
+
+  std::shared_lock guard(sh.lock);
+
+  const auto cell = sh.cells.find(key);
+  if (cell == sh.cells.end()) {
+    return result;
+  }
+
+  for (const auto& record : cell->second) {
+    if (record.obj != obj) {
+      continue;
+    }
+
+    const point offset = pos - record.pos;
+
+    // skip records in front of the point, they see lighting it doesn't
+    if (dot(offset, (normal + record.normal)*0.5) < -0.01) {
+      continue;
+    }
+
+    const pos_type facing = std::max(0.0, 1.0 - dot(normal, record.normal));
+    const pos_type e = offset.length()/record.radius + std::sqrt(facing);
+
+    if (e >= error) {
+      continue;
+    }
+
+    const pos_type w = 1.0 / std::max(e, 1e-6);
+
+    if (weight_sum == 0) {
+      result.light = record.light;
+    }
+    light_agrees = light_agrees && record.light_uniform
+                   && record.light.x == result.light.x;
+    light_records++;
+    weight_sum += w;
+
+    if (record.has_indirect) {
+      result.indirect += record.indirect*w;
+      indirect_weight += w;
+    }
+  }
+
+  result.covered = weight_sum > 0;
+  // one record can sit just outside a penumbra, so ask for a few to agree
+  result.found_light = light_records >= MIN_LIGHT_RECORDS && light_agrees;
+
+  if (indirect_weight > 0) {
+    result.found_indirect = true;
+    result.indirect = result.indirect / indirect_weight;
+  }
+
+  return result;
+}
+
+auto irradiance_cache::insert(irradiance_record record) -> void {
+  record.radius = clampRadius(record.radius);
+  const pos_type reach = error*record.radius;
+
+  // reach <= cell_size, so this touches at most 2x2x2 cells
+  for (int x = cellOf(record.pos.x - reach); x <= cellOf(record.pos.x + reach); x++) {
+    for (int y = cellOf(record.pos.y - reach); y <= cellOf(record.pos.y + reach); y++) {
+      for (int z = cellOf(record.pos.z - reach); z <= cellOf(record.pos.z + reach); z++) {
+        const uint64_t key = cellKey(x, y, z);
+        shard& sh = shards[shardOf(key)];
+
+        std::unique_lock guard(sh.lock);
+        sh.cells[key].push_back(record);
+      }
+    }
+  }
+
+  count.fetch_add(1, std::memory_order_relaxed);
+}
+
+auto irradiance_cache::size() const -> size_t {
+  return count.load(std::memory_order_relaxed);
+}
+
+auto irradiance_cache::clear() -> void {
+  for (auto& sh : shards) {
+    std::unique_lock guard(sh.lock);
+    sh.cells.clear();
+  }
+
+  count.store(0, std::memory_order_relaxed);
+}
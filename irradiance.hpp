@@ -0,0 +1,74 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include "Structures/point.hpp"
+
+// lighting gathered at one surface point, valid within error*radius of it.
+// light_uniform is set when every shadow ray agreed, i.e. the point is fully
+// lit or fully in shadow.
+struct irradiance_record {
+  point pos;
+  point normal;
+  pos_type radius;
+  // the object's index in its scene_t, which replicas and scenes rebuilt
+  // from the same objects share, unlike its address
+  int obj;
+  point light;
+  bool light_uniform;
+  point indirect;
+  bool has_indirect;
+};
+
+struct irradiance_sample {
+  bool covered = false;
+  bool found_light = false;
+  point light;
+  bool found_indirect = false;
+  point indirect;
+};
+
+// Irradiance cache (Ward et al. 1988) for distributed tracing. Indirect light
+// is interpolated from records on the same object. Direct light is only reused
+// when every record in reach saw the same uniform visibility, penumbrae are
+// always traced. Records live in a hashed grid split over shards, each behind
+// its own reader/writer lock, so lookups only contend with inserts that land
+// in the same shard.
+class irradiance_cache {
+public:
+  irradiance_cache(pos_type error, pos_type min_radius, pos_type max_radius);
+
+  // weighted average of nearby records on the same object, covered is false
+  // when none are within the error bound
+  auto lookup(point pos, point normal, int obj) const -> irradiance_sample;
+  auto insert(irradiance_record record) -> void;
+  auto size() const -> size_t;
+  // drop every record, the scene geometry changed
+  auto clear() -> void;
+
+private:
+  static constexpr int SHARDS = 64;
+  static constexpr int MIN_LIGHT_RECORDS = 3;
+
+  struct shard {
+    mutable std::shared_mutex lock;
+    std::unordered_map<uint64_t, std::vector<irradiance_record>> cells;
+  };
+
+  auto cellKey(int x, int y, int z) const -> uint64_t;
+  auto cellOf(pos_type v) const -> int;
+  auto shardOf(uint64_t key) const -> int;
+  auto clampRadius(pos_type radius) const -> pos_type;
+
+  std::array<shard, SHARDS> shards;
+  pos_type error;
+  pos_type min_radius;
+  pos_type max_radius;
+  pos_type cell_size;
+  std::atomic<size_t> count = 0;
+};
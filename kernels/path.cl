@@ -5,193 +5,991 @@ typedef struct Ray {
   float3 direction;
 } Ray;
 
+// texture is an index into the texture atlas or -1
 typedef struct Material {
   float3 colour;
   float spec;
   float diff;
+  int texture;
+  float texture_scale;
 } Material;
 
-typedef struct Obj {
+typedef struct Camera {
   float3 pos;
-  int type;
-  float3 params;
-} Obj;
+  float2 rot; // (cos, sin) of the yaw
+  float focal;
+} Camera;
+
+// 16 byte path record, a packed origin and an octahedral unit direction
+typedef struct PathState {
+  float ox, oy, oz;
+  uint dir;
+} PathState;
+
+// closest hit of a path slot, obj is -1 on a miss
+typedef struct PathHit {
+  float t;
+  int obj;
+} PathHit;
+
+// scene light, pos.w is the sphere radius and emission.w the shape
+typedef struct Light {
+  float4 pos;
+  float4 emission;
+  float4 edge_u;
+  float4 edge_v;
+} Light;
+
+// tiles of one texture in the atlas, starting at level first_level
+typedef struct TextureInfo {
+  int width;
+  int height;
+  int levels;
+  int first_level;
+  int level_tile[16];
+} TextureInfo;
+
+// light BVH node, children are child and child+1, leaves hold -(light+1)
+typedef struct LightNode {
+  float lo[3];
+  float power;
+  float hi[3];
+  int child;
+} LightNode;
+
+// one bin of an alias table, see alias_table in environment.hpp
+typedef struct AliasEntry {
+  float threshold;
+  int alias;
+} AliasEntry;
 
 typedef struct rayHit {
-  int intersect;
   float depth;
   float3 pos;
   float3 norm;
 } rayHit;
 
+// -- Scene --
+// The host can bake a small static scene into the program, see
+// specialisedScene() in main.cpp. SCENE_PRIMS and SCENE_MATS are then
+// initialiser lists, SPHERE_COUNT and PRIM_COUNT are literals, and the buffer
+// arguments go unused. The intersection loops run over __constant data with
+// compile-time bounds, so they can be unrolled.
+
+#ifdef PRIM_COUNT
+#define SCENE_SPACE __constant
+__constant float4 scene_prims[PRIM_COUNT] = SCENE_PRIMS;
+__constant Material scene_mats[PRIM_COUNT] = SCENE_MATS;
+#define scenePrims(prims) scene_prims
+#define sceneMats(mats) scene_mats
+#define sceneSpheres(count) SPHERE_COUNT
+#define scenePrimCount(count) PRIM_COUNT
+#else
+#define SCENE_SPACE __global
+#define scenePrims(prims) (prims)
+#define sceneMats(mats) (mats)
+#define sceneSpheres(count) (count)
+#define scenePrimCount(count) (count)
+#endif
+
+// batch size and depth are baked in too when the host knows them up front
+#ifdef RAYS_PER_PIXEL
+#define batchSpp(arg) RAYS_PER_PIXEL
+#else
+#define batchSpp(arg) (arg)
+#endif
+
+#ifdef MAX_DEPTH
+#define maxDepth(arg) MAX_DEPTH
+#else
+#define maxDepth(arg) (arg)
+#endif
+
 // -- Helper Functions --
-rayHit intersect(Obj object, Ray r) {
-  rayHit new_hit;
 
-  if (object.type == 0) { // plane
-    // in this case, params refers to the plane normal
-    float t = dot(object.pos - r.origin, object.params) /
-              dot(r.direction, object.params);
+// Primitives are one float4 each, spheres first as (centre, radius), then
+// SDF_COUNT signed distance objects as (first node, 0, 0, 0), then planes as
+// (unit normal, distance from the origin along it). obj indices, and so
+// materials, follow the same order.
+
+float intersectSphere(float4 s, Ray r) {
+  float3 oc = r.origin - (float3)(s.x, s.y, s.z);
+  float a = dot(r.direction, r.direction);
+  float half_b = dot(oc, r.direction);
+  float c = dot(oc, oc) - (s.w * s.w);
 
-    float3 intersection_pos = r.origin + (r.direction * t);
+  // outside and pointing away
+  if (c > 0 && half_b > 0) {
+    return INFINITY;
+  }
 
-    new_hit.intersect = t>0 ? 1 : 0;
-    new_hit.depth = t;
-    new_hit.pos = intersection_pos,
-    new_hit.norm = normalize(object.params);
+  float d = half_b*half_b - a*c;
 
-  } else if (object.type == 1) { // sphere
-    // in this case, params[0] is the sphere radius
-    float3 oc = r.origin - object.pos;
-    float a = dot(r.direction, r.direction);
-    float b = 2.0 * dot(oc, r.direction);
-    float c = dot(oc, oc) - (object.params.x * object.params.x);
-    float d = b*b - 4*a*c;
+  if (d < 0) {
+    return INFINITY;
+  }
 
-    if (d < 0) {
-      new_hit.intersect = 0;
+  float t = (-half_b - sqrt(d)) / a;
 
-    } else {
-      float t = (-b - sqrt(d)) / (2.0*a);
+  return t>0 ? t : INFINITY;
+}
+
+float intersectPlane(float4 p, Ray r) {
+  float3 n = (float3)(p.x, p.y, p.z);
+  float denom = dot(r.direction, n);
+
+  // parallel rays never hit
+  if (denom == 0.0f) {
+    return INFINITY;
+  }
+
+  float t = (p.w - dot(r.origin, n)) / denom;
+
+  return t>0 ? t : INFINITY;
+}
+
+// -- Signed distance objects --
+// Mirrors Structures/sdf.cpp. Every object's program starts at its first node
+// with a header, (lower bound, node count) and (upper bound, 1/lipschitz),
+// followed by (centre, op) and (size, k) for every node in postfix order. ops
+// follow sdf_op: 0 sphere, 1 box, 2 torus, 3 union, 4 smooth union, 5 displace.
+
+float sdfEvaluate(__global const float4* nodes, int first, float3 p) {
+  float stack[SDF_MAX_STACK];
+  int top = 0;
+  const int count = (int)nodes[first].w;
+
+  for (int i=0; i<count; i++) {
+    const float4 a = nodes[first + 2 + 2*i];
+    const float4 b = nodes[first + 3 + 2*i];
+    const float3 q = p - (float3)(a.x, a.y, a.z);
+
+    switch ((int)a.w) {
+      case 0:
+        stack[top++] = length(q) - b.x;
+        break;
+      case 1: {
+        const float3 e = fabs(q) - (float3)(b.x, b.y, b.z);
+        const float3 outside = (float3)(fmax(e.x, 0.0f), fmax(e.y, 0.0f), fmax(e.z, 0.0f));
+        stack[top++] = length(outside) + fmin(fmax(e.x, fmax(e.y, e.z)), 0.0f);
+        break;
+      }
+      case 2: {
+        const float ring = sqrt(q.x*q.x + q.y*q.y) - b.x;
+        stack[top++] = sqrt(ring*ring + q.z*q.z) - b.y;
+        break;
+      }
+      case 3:
+        top--;
+        stack[top-1] = fmin(stack[top-1], stack[top]);
+        break;
+      case 4: {
+        top--;
+        const float d0 = stack[top-1];
+        const float d1 = stack[top];
+        const float h = clamp(0.5f + 0.5f*(d1 - d0)/b.w, 0.0f, 1.0f);
+        stack[top-1] = d1 + (d0 - d1)*h - b.w*h*(1 - h);
+        break;
+      }
+      case 5:
+        stack[top-1] += b.x * sin(b.w*q.x)*sin(b.w*q.y)*sin(b.w*q.z);
+        break;
+    }
+  }
+
+  return stack[0];
+}
+
+// sphere traced inside the object's bounds, see sdf::march()
+float intersectSDF(__global const float4* nodes, int first, Ray r, float tmax) {
+  const float4 lo = nodes[first];
+  const float4 hi = nodes[first + 1];
+
+  const float3 inv = (float3)(1.0f, 1.0f, 1.0f) / r.direction;
+  const float3 a = ((float3)(lo.x, lo.y, lo.z) - r.origin) * inv;
+  const float3 b = ((float3)(hi.x, hi.y, hi.z) - r.origin) * inv;
+
+  const float len = length(r.direction);
+  float t = fmax(fmax(fmax(fmin(a.x, b.x), fmin(a.y, b.y)), fmax(fmin(a.z, b.z), 0.0f)), 0.01f/len);
+  const float end = fmin(fmin(fmin(fmax(a.x, b.x), fmax(a.y, b.y)), fmax(a.z, b.z)), tmax);
+  const float scale = hi.w / len;
+
+  for (int i=0; i<SDF_MAX_STEPS && t < end; i++) {
+    const float d = sdfEvaluate(nodes, first, r.origin + r.direction*t);
+
+    if (d < SDF_HIT_DISTANCE) {
+      return t;
+    }
+
+    t += d*scale;
+  }
+
+  return INFINITY;
+}
+
+// tetrahedral differences, see sdf::surface()
+float3 sdfNormal(__global const float4* nodes, int first, float3 p) {
+  const float h = SDF_HIT_DISTANCE;
+  const float3 k0 = (float3)(1.0f, -1.0f, -1.0f);
+  const float3 k1 = (float3)(-1.0f, -1.0f, 1.0f);
+  const float3 k2 = (float3)(-1.0f, 1.0f, -1.0f);
+  const float3 k3 = (float3)(1.0f, 1.0f, 1.0f);
+
+  return normalize(k0*sdfEvaluate(nodes, first, p + k0*h) + k1*sdfEvaluate(nodes, first, p + k1*h)
+                 + k2*sdfEvaluate(nodes, first, p + k2*h) + k3*sdfEvaluate(nodes, first, p + k3*h));
+}
+
+// closest-hit query, distance along r or INFINITY on a miss
+float closestHit(SCENE_SPACE const float4* prims, int sphereCount, int primCount,
+                 __global const float4* sdf_nodes, Ray r, int* obj) {
+  float nearest = INFINITY;
+  *obj = -1;
+
+  for (int i=0; i<sphereCount; i++) {
+    float t = intersectSphere(prims[i], r);
+
+    if (t < nearest) {
+      *obj = i;
+      nearest = t;
+    }
+  }
+
+  for (int i=sphereCount; i<sphereCount+SDF_COUNT; i++) {
+    float t = intersectSDF(sdf_nodes, (int)prims[i].x, r, nearest);
+
+    if (t < nearest) {
+      *obj = i;
+      nearest = t;
+    }
+  }
+
+  for (int i=sphereCount+SDF_COUNT; i<primCount; i++) {
+    float t = intersectPlane(prims[i], r);
+
+    if (t < nearest) {
+      *obj = i;
+      nearest = t;
+    }
+  }
 
-      float3 intersection_pos = r.origin + (r.direction * t);
+  return nearest;
+}
+
+// any-hit query, true if anything is hit before tmax
+bool occluded(SCENE_SPACE const float4* prims, int sphereCount, int primCount,
+              __global const float4* sdf_nodes, Ray r, float tmax) {
+  for (int i=0; i<sphereCount; i++) {
+    if (intersectSphere(prims[i], r) < tmax) {
+      return true;
+    }
+  }
+
+  for (int i=sphereCount; i<sphereCount+SDF_COUNT; i++) {
+    if (intersectSDF(sdf_nodes, (int)prims[i].x, r, tmax) < tmax) {
+      return true;
+    }
+  }
 
-      new_hit.intersect = t>0 ? 1 : 0;
-      new_hit.depth = t;
-      new_hit.pos = intersection_pos,
-      new_hit.norm = normalize(intersection_pos - object.pos);
+  for (int i=sphereCount+SDF_COUNT; i<primCount; i++) {
+    if (intersectPlane(prims[i], r) < tmax) {
+      return true;
     }
   }
 
+  return false;
+}
+
+// surface interaction, only for the final closest hit
+rayHit surface(SCENE_SPACE const float4* prims, int sphereCount, __global const float4* sdf_nodes,
+               int obj, Ray r, float t) {
+  const float4 prim = prims[obj];
+
+  rayHit new_hit;
+  new_hit.depth = t;
+  new_hit.pos = r.origin + (r.direction * t);
+
+  if (obj < sphereCount) {
+    new_hit.norm = (new_hit.pos - (float3)(prim.x, prim.y, prim.z)) / prim.w;
+  } else if (obj < sphereCount+SDF_COUNT) {
+    new_hit.norm = sdfNormal(sdf_nodes, (int)prim.x, new_hit.pos);
+  } else {
+    new_hit.norm = (float3)(prim.x, prim.y, prim.z);
+  }
+
   return new_hit;
 }
 
+// -- Lights --
+// Mirrors lights.cpp. Shapes follow light_shape: 0 point, 1 sphere, 2 rect.
+
+float lightImportance(__global const LightNode* n, float3 x) {
+  const float3 lo = (float3)(n->lo[0], n->lo[1], n->lo[2]);
+  const float3 hi = (float3)(n->hi[0], n->hi[1], n->hi[2]);
+  const float3 to_centre = x - (lo + hi)*0.5f;
+  const float3 half_extent = (hi - lo)*0.5f;
+
+  return n->power / fmax(fmax(dot(to_centre, to_centre), dot(half_extent, half_extent)), 1e-4f);
+}
+
+// light for x and its probability, u is rescaled so it can place the sample
+int pickLight(__global const LightNode* nodes, int lightCount, float3 x, float* u, float* prob) {
+  const float below_one = 0x1.fffffep-1f;
+  *u = fmin(*u, below_one);
+
+#if LIGHT_TREE
+  int n = 0;
+  *prob = 1.0f;
+
+  while (nodes[n].child >= 0) {
+    const int child = nodes[n].child;
+    const float left = lightImportance(&nodes[child], x);
+    const float right = lightImportance(&nodes[child+1], x);
+    const float p = left + right > 0 ? left / (left + right) : 0.5f;
+
+    if (*u < p) {
+      *u = *u / p;
+      *prob *= p;
+      n = child;
+    } else {
+      *u = (*u - p) / (1.0f - p);
+      *prob *= 1.0f - p;
+      n = child+1;
+    }
+
+    *u = fmin(*u, below_one);
+  }
+
+  return -nodes[n].child - 1;
+#else
+  const int i = min((int)(*u * lightCount), lightCount-1);
+  *u = *u * lightCount - i;
+  *prob = 1.0f / lightCount;
+  return i;
+#endif
+}
+
+// point on the light to aim at, value is what it sends to x over the density
+// of picking that point
+float3 sampleLight(__global const Light* l, float3 x, float u, float v, float3* value) {
+  const float3 pos = (float3)(l->pos.x, l->pos.y, l->pos.z);
+  const float3 emission = (float3)(l->emission.x, l->emission.y, l->emission.z);
+  const int shape = (int)l->emission.w;
+
+  if (shape == 0) {
+    const float3 to_light = pos - x;
+    *value = emission / dot(to_light, to_light);
+    return pos;
+  }
+
+  if (shape == 1) {
+    const float radius = l->pos.w;
+    const float3 w = pos - x;
+    const float dist2 = dot(w, w);
+
+    if (dist2 <= radius*radius) {
+      *value = (float3)(0.0f, 0.0f, 0.0f);
+      return pos;
+    }
+
+    // uniform over the cone the sphere fills
+    const float cos_max = sqrt(1.0f - radius*radius / dist2);
+    const float cos_t = 1.0f - u*(1.0f - cos_max);
+    const float sin_t = sqrt(fmax(0.0f, 1.0f - cos_t*cos_t));
+    const float phi = 2.0f*M_PI_F*v;
+
+    const float3 n = w / sqrt(dist2);
+    const float sign = n.z >= 0 ? 1.0f : -1.0f;
+    const float a = -1.0f / (sign + n.z);
+    const float b = n.x*n.y*a;
+    const float3 t1 = (float3)(1.0f + sign*n.x*n.x*a, sign*b, -sign*n.x);
+    const float3 t2 = (float3)(b, sign + n.y*n.y*a, -n.y);
+
+    const float3 dir = t1*(sin_t*cos(phi)) + t2*(sin_t*sin(phi)) + n*cos_t;
+    const float half_b = dot(dir, w);
+    const float t = half_b - sqrt(fmax(0.0f, half_b*half_b - (dist2 - radius*radius)));
+
+    *value = emission * (2.0f*M_PI_F*(1.0f - cos_max));
+    return x + dir*t;
+  }
+
+  const float3 edge_u = (float3)(l->edge_u.x, l->edge_u.y, l->edge_u.z);
+  const float3 edge_v = (float3)(l->edge_v.x, l->edge_v.y, l->edge_v.z);
+  const float3 target = pos + edge_u*u + edge_v*v;
+  const float3 to_x = x - target;
+  const float dist2 = dot(to_x, to_x);
+  const float cos_area = dot(cross(edge_u, edge_v), to_x) / sqrt(dist2);
+
+  *value = cos_area > 0 ? emission * (cos_area / dist2) : (float3)(0.0f, 0.0f, 0.0f);
+  return target;
+}
+
+// -- Environment --
+// Mirrors environment.cpp: equirectangular around z from +x, the first row
+// straight up, drawn with a table over rows then the row's table over texels.
+// Only used when the host passes -DENVIRONMENT=1.
+
+float3 environmentRadiance(__global const float4* texels, int width, int height, float3 dir) {
+  const float3 d = normalize(dir);
+  float u = atan2(d.y, d.x) / (2.0f*M_PI_F);
+  u = u < 0 ? u + 1.0f : u;
+  const float v = acos(clamp(d.z, -1.0f, 1.0f)) / M_PI_F;
+
+  const int col = min((int)(u*width), width-1);
+  const int row = min((int)(v*height), height-1);
+  const float4 texel = texels[row*width + col];
+  return (float3)(texel.x, texel.y, texel.z);
+}
+
+// bin of a table of count, u is rescaled as in pickLight
+int aliasSample(__global const AliasEntry* bins, int count, float* u) {
+  const float below_one = 0x1.fffffep-1f;
+  const float scaled = fmin(*u, below_one) * count;
+  const int i = min((int)scaled, count-1);
+  const float f = scaled - i;
+  const AliasEntry bin = bins[i];
+
+  if (f < bin.threshold) {
+    *u = f / bin.threshold;
+    return i;
+  }
+
+  *u = fmin((f - bin.threshold) / (1.0f - bin.threshold), below_one);
+  return bin.alias;
+}
+
+// unit direction for (u, v), value is its radiance over the solid angle
+// density of drawing it
+float3 sampleEnvironment(__global const float4* texels, __global const AliasEntry* rows,
+                         __global const AliasEntry* columns, int width, int height, float total,
+                         float u, float v, float3* value) {
+  const int row = aliasSample(rows, height, &u);
+  const int col = aliasSample(columns + row*width, width, &v);
+
+  const float phi = 2.0f*M_PI_F*(col + v) / width;
+  const float theta = M_PI_F*(row + u) / height;
+  const float sin_t = sin(theta);
+
+  const float4 texel = texels[row*width + col];
+  const float3 radiance = (float3)(texel.x, texel.y, texel.z);
+  const float weight = (radiance.x + radiance.y + radiance.z) / 3.0f * sin(M_PI_F*(row + 0.5f) / height);
+  const float pdf = total > 0 && sin_t > 0 ? weight / total * width * height / (2.0f*M_PI_F*M_PI_F*sin_t) : 0.0f;
+
+  *value = pdf > 0 ? radiance / pdf : (float3)(0.0f, 0.0f, 0.0f);
+  return (float3)(sin_t*cos(phi), sin_t*sin(phi), cos(theta));
+}
+
+// -- Textures --
+// Mirrors texture.cpp. The atlas holds TEXTURE_TILE^2 RGBA8 tiles, one uint
+// per texel, for every texture level the host could fit.
+
+float3 atlasTexel(__global const uint* atlas, __global const TextureInfo* tex, int level, int x, int y) {
+  const int tiles_x = (max(tex->width >> level, 1) + TEXTURE_TILE - 1) / TEXTURE_TILE;
+  const int tile = tex->level_tile[level] + (y / TEXTURE_TILE)*tiles_x + x / TEXTURE_TILE;
+  const uint t = atlas[tile*TEXTURE_TILE*TEXTURE_TILE + (y % TEXTURE_TILE)*TEXTURE_TILE + x % TEXTURE_TILE];
+
+  return (float3)(t & 0xff, (t >> 8) & 0xff, (t >> 16) & 0xff) / 255.0f;
+}
+
+float3 bilinearTexel(__global const uint* atlas, __global const TextureInfo* tex, int level, float u, float v) {
+  const int w = max(tex->width >> level, 1);
+  const int h = max(tex->height >> level, 1);
+
+  const float x = (u - floor(u))*w - 0.5f;
+  const float y = (v - floor(v))*h - 0.5f;
+  const int x0 = (int)floor(x);
+  const int y0 = (int)floor(y);
+  const float fx = x - x0;
+  const float fy = y - y0;
+
+  const int xa = (x0 + w) % w, xb = (x0 + 1) % w;
+  const int ya = (y0 + h) % h, yb = (y0 + 1) % h;
+
+  return atlasTexel(atlas, tex, level, xa, ya)*((1-fx)*(1-fy)) + atlasTexel(atlas, tex, level, xb, ya)*(fx*(1-fy))
+       + atlasTexel(atlas, tex, level, xa, yb)*((1-fx)*fy) + atlasTexel(atlas, tex, level, xb, yb)*(fx*fy);
+}
+
+// trilinear, footprint is in uv units
+float3 sampleTexture(__global const uint* atlas, __global const TextureInfo* tex, float u, float v, float footprint) {
+  const float level = clamp(log2(fmax(footprint*max(tex->width, tex->height), 1e-9f)),
+                            (float)tex->first_level, (float)(tex->levels-1));
+  const int fine = (int)level;
+  const float blend = level - fine;
+  const float3 colour = bilinearTexel(atlas, tex, fine, u, v);
+
+  if (blend == 0 || fine+1 >= tex->levels) {
+    return colour;
+  }
+
+  return colour*(1-blend) + bilinearTexel(atlas, tex, fine+1, u, v)*blend;
+}
+
+// material colour at a hit, see surfaceColour() in trace.cpp
+float3 surfaceColour(SCENE_SPACE const float4* prims, int sphereCount, int obj, Material mat, rayHit h, Ray r,
+                     bool primary, __global const uint* atlas, __global const TextureInfo* textures) {
+  if (mat.texture < 0) {
+    return mat.colour;
+  }
+
+  const float3 n = h.norm;
+  float u, v, uv_size;
+
+  if (obj < sphereCount) {
+    u = 0.5f + atan2(n.y, n.x) / (2.0f*M_PI_F);
+    v = acos(clamp(n.z, -1.0f, 1.0f)) / M_PI_F;
+    uv_size = 2.0f*M_PI_F*prims[obj].w;
+  } else {
+    // planes, and signed distance objects on the tangents at the hit
+    const float sign = n.z >= 0 ? 1.0f : -1.0f;
+    const float a = -1.0f / (sign + n.z);
+    const float b = n.x*n.y*a;
+    u = dot(h.pos, (float3)(1.0f + sign*n.x*n.x*a, sign*b, -sign*n.x)) / mat.texture_scale;
+    v = dot(h.pos, (float3)(b, sign + n.y*n.y*a, -n.y)) / mat.texture_scale;
+    uv_size = mat.texture_scale;
+  }
+
+  const float len = length(r.direction);
+  const float width = primary ? h.depth : h.depth*len*TEXTURE_BOUNCE_SPREAD;
+  const float cos_n = fmax(fabs(dot(r.direction, n)) / len, 0.01f);
+
+  return sampleTexture(atlas, &textures[mat.texture], u, v, width / sqrt(cos_n) / uv_size);
+}
+
+uint packColour(float3 c) {
+  const uint r = (uint)(clamp(c.x, 0.0f, 1.0f)*255.0f + 0.5f);
+  const uint g = (uint)(clamp(c.y, 0.0f, 1.0f)*255.0f + 0.5f);
+  const uint b = (uint)(clamp(c.z, 0.0f, 1.0f)*255.0f + 0.5f);
+  return r | (g << 8) | (b << 16);
+}
+
+float3 unpackColour(uint p) {
+  return (float3)(p & 0xff, (p >> 8) & 0xff, (p >> 16) & 0xff) / 255.0f;
+}
+
+// octahedral map (Cigolle et al. 2014), two 16 bit snorms in a uint
+float signNotZero(float v) {
+  return v >= 0.0f ? 1.0f : -1.0f;
+}
+
+uint packDirection(float3 d) {
+  d /= fabs(d.x) + fabs(d.y) + fabs(d.z);
+
+  float u = d.x;
+  float v = d.y;
+
+  // fold the lower hemisphere over the diagonals
+  if (d.z < 0) {
+    u = (1.0f - fabs(d.y)) * signNotZero(d.x);
+    v = (1.0f - fabs(d.x)) * signNotZero(d.y);
+  }
+
+  const int pu = (int)rint(clamp(u, -1.0f, 1.0f) * 32767.0f);
+  const int pv = (int)rint(clamp(v, -1.0f, 1.0f) * 32767.0f);
+
+  return ((uint)pu & 0xffff) | ((uint)pv << 16);
+}
+
+float3 unpackDirection(uint p) {
+  const float u = (short)(p & 0xffff) / 32767.0f;
+  const float v = (short)(p >> 16) / 32767.0f;
+
+  float3 d = (float3)(u, v, 1.0f - fabs(u) - fabs(v));
+
+  if (d.z < 0) {
+    d.x = (1.0f - fabs(v)) * signNotZero(u);
+    d.y = (1.0f - fabs(u)) * signNotZero(v);
+  }
+
+  return normalize(d);
+}
+
+void storeOrigin(__global PathState* paths, int slot, float3 origin) {
+  paths[slot].ox = origin.x;
+  paths[slot].oy = origin.y;
+  paths[slot].oz = origin.z;
+}
+
+float3 loadOrigin(__global const PathState* paths, int slot) {
+  return (float3)(paths[slot].ox, paths[slot].oy, paths[slot].oz);
+}
+
+// mirrors rayDir(camera, ...) in Structures/ray.cpp
+Ray primaryRay(float x, float y, Camera cam) {
+  float3 d = (float3)(x - IMAGE_WIDTH*0.5f, cam.focal, -(y - IMAGE_HEIGHT*0.5f));
+
+  Ray r;
+  r.origin = cam.pos;
+  r.direction = (float3)(cam.rot.x*d.x - cam.rot.y*d.y, cam.rot.y*d.x + cam.rot.x*d.y, d.z);
+
+  return r;
+}
+
 bool isEqual(float3 a, float3 b) {
   return a.x == b.x && a.y == b.y && a.z == b.z;
 }
 
-// -- Main Path Tracing --
-__kernel void pathTrace(
-  __global Obj* scene,
-  __global Material* mats,
-  int sceneLen,
-  __global Ray* rays,
+// -- Wavefront Path Tracing --
+// Every sample of the current batch owns a path slot,
+// slot = (pixel - pixelOffset) * raysPerPixel + sample. Kernels run one work
+// item per queued slot and append survivors to the next queue with atomics.
+// A path's contribution to the current iteration goes to contrib[slot] as
+// (colour, ray count), and resolve() folds a pixel's slots into the image.
+//
+// Shadow samples stop at their first hit and sample the light from there on
+// every iteration. Missed paths are parked with a negative count and keep
+// adding sky without being traced.
+
+int slotPixel(int slot, int raysPerPixel, int pixelOffset) {
+  return pixelOffset + slot / raysPerPixel;
+}
+
+int slotSample(int slot, int raysPerPixel, int sampleOffset) {
+  return sampleOffset + slot % raysPerPixel;
+}
+
+// Primary directions are not unit length and the first bounce depends on it,
+// so the first iteration rebuilds them from the slot instead of storing them.
+// Every later ray is unit length and comes from the path record.
+Ray pathRay(__global const PathState* paths, int slot, int iter, int px, int py, int sample_i,
+            __global const float* blue_noise, Camera cam) {
+  if (iter == 0) {
+    // dimensions 0 and 1 are the sub-pixel jitter
+    const float jitter_x = sample1D(px, py, sample_i, 0, blue_noise);
+    const float jitter_y = sample1D(px, py, sample_i, 1, blue_noise);
+
+    return primaryRay(px + jitter_x - 0.5f, py + jitter_y - 0.5f, cam);
+  }
+
+  Ray r;
+  r.origin = loadOrigin(paths, slot);
+  r.direction = unpackDirection(paths[slot].dir);
+
+  return r;
+}
+
+__kernel void generate(
+  __global int* queue
+) {
+  const int slot = get_global_id(0);
+  queue[slot] = slot;
+}
+
+__kernel void extend(
+  __global const float4* prims,
+  int sphereCount,
+  int primCount,
+  __global const PathState* paths,
+  __global const int* queue,
+  __global PathHit* hits,
   int raysPerPixel,
-  __global float3* jitter,
-  __global int* shadow,
-  __global float3* image,
+  int sampleOffset,
+  int pixelOffset,
   int iter,
-  int max_depth
+  __global const float* blue_noise,
+  Camera cam,
+  __global const float4* sdf_nodes
 ) {
-  int id = get_global_id(0);
-  float3 colour = (float3)(0.0,0.0,0.0);
-  bool firstIter = iter == 0;
-  int raysCount = 0;
+  raysPerPixel = batchSpp(raysPerPixel);
+  const int slot = queue[get_global_id(0)];
+  const int pixel = slotPixel(slot, raysPerPixel, pixelOffset);
+  const int sample_i = slotSample(slot, raysPerPixel, sampleOffset);
+  const int px = pixel / IMAGE_WIDTH;
+  const int py = pixel % IMAGE_WIDTH;
 
-  for (int ray_i=0; ray_i<raysPerPixel; ray_i++) {
-    const int ray_id = id * raysPerPixel + ray_i;
+  const Ray cur_ray = pathRay(paths, slot, iter, px, py, sample_i, blue_noise, cam);
 
-    Ray cur_ray = rays[ray_id];
+  // distance only, shade() builds the surface for the winner
+  PathHit nearest;
+  nearest.t = closestHit(scenePrims(prims), sceneSpheres(sphereCount), scenePrimCount(primCount),
+                         sdf_nodes, cur_ray, &nearest.obj);
 
-    rayHit nearest_hit;
-    int nearest_obj_i = -1;
+  hits[slot] = nearest;
+}
 
-    // check intersections
-    for (int i=0; i<sceneLen; i++) {
-      Obj cur_obj = scene[i];
+__kernel void shade(
+  __global const float4* prims,
+  int sphereCount,
+  __global Material* mats,
+  __global PathState* paths,
+  __global const int* queue,
+  __global const PathHit* hits,
+  __global int* next_queue,
+  __global int* shadow_queue,
+  volatile __global int* queue_len,
+  __global float4* contrib,
+  __global const float3* image,
+  int raysPerPixel,
+  int sampleOffset,
+  int pixelOffset,
+  int iter,
+  __global const float* blue_noise,
+  Camera cam,
+  __global float3* slot_albedo,
+  __global float3* slot_normal,
+  __global float* slot_depth,
+  __global const uint* atlas,
+  __global const TextureInfo* textures,
+  __global const float4* sdf_nodes,
+  __global const float4* env_texels,
+  int envWidth,
+  int envHeight
+) {
+  raysPerPixel = batchSpp(raysPerPixel);
+  const int slot = queue[get_global_id(0)];
+  const int id = slot / raysPerPixel;
+  const int pixel = slotPixel(slot, raysPerPixel, pixelOffset);
+  const int sample_i = slotSample(slot, raysPerPixel, sampleOffset);
+  const int px = pixel / IMAGE_WIDTH;
+  const int py = pixel % IMAGE_WIDTH;
+  const bool firstIter = iter == 0;
+
+  const PathHit path_hit = hits[slot];
+
+  if (path_hit.obj == -1) { // hits nothing
+#if ENVIRONMENT
+    float3 sky = environmentRadiance(env_texels, envWidth, envHeight,
+                                     pathRay(paths, slot, iter, px, py, sample_i, blue_noise, cam).direction);
+#else
+    float3 sky = (float3)(0.1f, 0.1f, 0.2f);
+#endif
+    float count = 1.0f;
+
+    if (!firstIter) {
+      sky += (float3)(0.8f, 0.8f, 0.8f);
+      count += 1.0f;
+    }
 
-      rayHit cur_hit = intersect(cur_obj, cur_ray);
+    contrib[slot] = (float4)(sky, -count);
 
-      if (cur_hit.intersect == 1) {
-        if (nearest_obj_i == -1 || cur_hit.depth < nearest_hit.depth) {
-          nearest_obj_i = i;
-          nearest_hit = cur_hit;
-        }
-      }
+#if DENOISE
+    if (firstIter) {
+      slot_albedo[slot] = (float3)(0.1f, 0.1f, 0.2f);
+      slot_normal[slot] = (float3)(0.0f, 0.0f, 0.0f);
+      slot_depth[slot] = 0.0f;
     }
+#endif
+    return;
+  }
 
-    Ray next_ray = cur_ray;
-
-    // determining colour
-    if (nearest_obj_i != -1) {
-      Obj nearest_obj = scene[nearest_obj_i];
-      Material nearest_mat = mats[nearest_obj_i];
+  const Ray cur_ray = pathRay(paths, slot, iter, px, py, sample_i, blue_noise, cam);
+  Material nearest_mat = sceneMats(mats)[path_hit.obj];
+  const rayHit nearest_hit = surface(scenePrims(prims), sceneSpheres(sphereCount), sdf_nodes,
+                                    path_hit.obj, cur_ray, path_hit.t);
+  nearest_mat.colour = surfaceColour(scenePrims(prims), sceneSpheres(sphereCount), path_hit.obj, nearest_mat,
+                                     nearest_hit, cur_ray, firstIter, atlas, textures);
+
+#if DENOISE
+  if (firstIter) {
+    slot_albedo[slot] = nearest_mat.colour;
+    slot_normal[slot] = nearest_hit.norm;
+    slot_depth[slot] = path_hit.t;
+  }
+#endif
+
+  // every pixel makes the same light/bounce choice for a given sample
+  if (hashU(sample_i) & 1) {
+    // shadow paths don't move again, so a textured colour goes in place of the direction
+    storeOrigin(paths, slot, nearest_hit.pos + nearest_hit.norm*0.01f);
+    paths[slot].dir = packColour(nearest_mat.colour);
+    shadow_queue[atomic_inc(&queue_len[1])] = slot;
+    return;
+  }
 
-      if (shadow[ray_i]) { // lighting ray
+  const uint dim = 2 + iter*6;
+  const float3 reflect_jitter = sampleSphere(
+    sample1D(px, py, sample_i, dim, blue_noise), sample1D(px, py, sample_i, dim+1, blue_noise));
+  const float3 diffuse_jitter = sampleSphere(
+    sample1D(px, py, sample_i, dim+2, blue_noise), sample1D(px, py, sample_i, dim+3, blue_noise));
 
-        // light ray
-        float3 light_colour = nearest_mat.colour;
-        float3 light_start = nearest_hit.pos + nearest_hit.norm*0.01f;
-        float3 light_end = jitter[ray_id]; // [-1, 1]
-        light_end.x *= 7.5f;
-        light_end.y = fabs(light_end.y) * 15.0f;
-        light_end.z = 40.0f;
+  // relfection rays
+  const float fuzz = 0.8;
+  const float3 reflection = ((cur_ray.direction -
+    2*dot(cur_ray.direction, nearest_hit.norm))
+    * nearest_hit.norm)+(reflect_jitter*fuzz);
 
-        Ray light_ray;
-        light_ray.origin = light_start;
-        light_ray.direction = normalize(light_end - light_start);
+  const float3 diffuse = nearest_hit.norm + diffuse_jitter;
 
-        bool hitlight = true;
-        for (int i=0; i<sceneLen; i++) {
-          Obj cur_obj = scene[i];
+  const float3 next_dir = normalize((reflection * (1-nearest_mat.diff))
+    + (diffuse * nearest_mat.diff));
 
-          rayHit cur_hit = intersect(cur_obj, light_ray);
+  // if its the first one, we're looking directly at the object
+  float3 reflection_colour;
+  if (firstIter) {
+    reflection_colour = nearest_mat.colour*(1.0f-nearest_mat.spec);
 
-          if (cur_hit.intersect == 1) {
-            hitlight = false;
+  } else {
+    reflection_colour = (image[id]/255)*(1.0f-nearest_mat.spec) + (nearest_mat.colour) * (nearest_mat.spec);
+  }
 
-            break;
-          }
-        }
+  contrib[slot] = (float4)(reflection_colour, 1.0f);
+  storeOrigin(paths, slot, nearest_hit.pos);
+  paths[slot].dir = packDirection(next_dir);
+  next_queue[atomic_inc(&queue_len[0])] = slot;
+}
 
-        if (hitlight) {
-          light_colour += (float3)(0.9f, 0.9f, 0.9f);
-        }
+__kernel void connect(
+  __global const float4* prims,
+  int sphereCount,
+  int primCount,
+  __global Material* mats,
+  __global const PathState* paths,
+  __global const int* shadow_queue,
+  __global const PathHit* hits,
+  __global float4* contrib,
+  int raysPerPixel,
+  int sampleOffset,
+  int pixelOffset,
+  int iter,
+  __global const float* blue_noise,
+  __global const LightNode* light_nodes,
+  __global const Light* lights,
+  int lightCount,
+  __global const float4* sdf_nodes,
+  __global const float4* env_texels,
+  __global const AliasEntry* env_rows,
+  __global const AliasEntry* env_columns,
+  int envWidth,
+  int envHeight,
+  float envTotal
+) {
+  raysPerPixel = batchSpp(raysPerPixel);
+  const int slot = shadow_queue[get_global_id(0)];
+  const int pixel = slotPixel(slot, raysPerPixel, pixelOffset);
+  const int sample_i = slotSample(slot, raysPerPixel, sampleOffset);
+  const int px = pixel / IMAGE_WIDTH;
+  const int py = pixel % IMAGE_WIDTH;
+
+  const uint dim = 2 + iter*6;
+  float2 light_jitter = (float2)(
+    sample1D(px, py, sample_i, dim+4, blue_noise), sample1D(px, py, sample_i, dim+5, blue_noise));
+
+#if ENVIRONMENT
+  // half the samples go to the environment and count double, the first
+  // number picks and is then rescaled to place the sample
+  const bool sky_light = light_jitter.x < 0.5f;
+  light_jitter.x = sky_light ? light_jitter.x*2.0f : light_jitter.x*2.0f - 1.0f;
+#endif
+
+  // light ray
+  const Material mat = sceneMats(mats)[hits[slot].obj];
+  float3 light_colour = mat.texture < 0 ? mat.colour : unpackColour(paths[slot].dir);
+  float3 light_start = loadOrigin(paths, slot);
+  float3 light_end;
+  float3 light_value = (float3)(0.9f, 0.9f, 0.9f);
+
+#if ENVIRONMENT
+  if (sky_light) {
+    light_end = light_start + sampleEnvironment(env_texels, env_rows, env_columns, envWidth, envHeight, envTotal,
+                                                light_jitter.x, light_jitter.y, &light_value);
+  } else
+#endif
+  if (lightCount > 0) {
+    // the first number picks the light and then places the sample
+    float u = light_jitter.x;
+    float prob;
+    const int index = pickLight(light_nodes, lightCount, light_start, &u, &prob);
+
+    light_end = sampleLight(&lights[index], light_start, u, light_jitter.y, &light_value);
+    light_value /= prob;
+
+  } else {
+    light_end.x = light_jitter.x*15.0f - 7.5f;
+    light_end.y = light_jitter.y*15.0f;
+    light_end.z = 40.0f;
+  }
 
-        light_colour /= 2;
-        colour += light_colour;
-        raysCount++;
+  float light_dist = length(light_end - light_start);
 
-      } else {
+  Ray light_ray;
+  light_ray.origin = light_start;
+  light_ray.direction = (light_end - light_start) / light_dist;
 
-        // relfection rays
-        const float fuzz = 0.8;
-        const float3 reflection = ((cur_ray.direction -
-          2*dot(cur_ray.direction, nearest_hit.norm))
-          * nearest_hit.norm)+(normalize(jitter[ray_id])*fuzz);
+#if ENVIRONMENT
+  // environment samples are only a direction, anything along it blocks
+  if (sky_light) {
+    light_dist = INFINITY;
+  }
+  light_value *= 2.0f;
+#endif
 
-        const float3 diffuse = nearest_hit.norm + normalize(jitter[ray_id]);
+  bool hitlight = !occluded(scenePrims(prims), sceneSpheres(sphereCount), scenePrimCount(primCount),
+                           sdf_nodes, light_ray, light_dist);
 
-        next_ray.origin = nearest_hit.pos;
-        next_ray.direction = normalize((reflection * (1-nearest_mat.diff))
-          + (diffuse * nearest_mat.diff));
+  if (hitlight) {
+    light_colour += light_value;
+  }
 
-        // if its the first one, we're looking directly at the object
-        float3 reflection_colour;
-        if (firstIter) {
-          reflection_colour = nearest_mat.colour*(1.0f-nearest_mat.spec);
+  light_colour /= 2;
+  contrib[slot] = (float4)(light_colour, 1.0f);
+}
 
-        } else {
-          reflection_colour = (image[id]/255)*(1.0f-nearest_mat.spec) + (nearest_mat.colour) * (nearest_mat.spec);
-        }
+// one work item per pixel of the tile
+__kernel void resolve(
+  __global float4* contrib,
+  __global float3* image,
+  __global float3* accum,
+  int raysPerPixel,
+  int sampleOffset,
+  int pixelOffset,
+  int iter,
+  int max_depth,
+  __global const float3* slot_albedo,
+  __global const float3* slot_normal,
+  __global const float* slot_depth,
+  __global float3* albedo,
+  __global float3* normal,
+  __global float* depth
+) {
+  raysPerPixel = batchSpp(raysPerPixel);
+  const int id = get_global_id(0);
+  const int pixel = pixelOffset + id;
 
-        colour += reflection_colour;
-        raysCount++;
-      }
-    } else { // hits nothing
-      colour += (float3)(0.1,0.1,0.2);
-      raysCount++;
+  float3 colour = (float3)(0.0f, 0.0f, 0.0f);
+  float raysCount = 0.0f;
 
-      if (!firstIter) {
-        colour += (float3)(0.8,0.8,0.8);
-        raysCount++;
-      }
+  for (int ray_i=0; ray_i<raysPerPixel; ray_i++) {
+    const int slot = id * raysPerPixel + ray_i;
+    const float4 c = contrib[slot];
+
+    colour += (float3)(c.x, c.y, c.z);
+    raysCount += fabs(c.w);
+
+    // parked misses add sky at the later-iteration rate from now on
+    if (c.w < 0) {
+#if ENVIRONMENT
+      // what the ray saw stays, first-iteration misses gain the later 0.8
+      contrib[slot] = c.w < -1.5f ? c : (float4)(c.x + 0.8f, c.y + 0.8f, c.z + 0.8f, -2.0f);
+#else
+      contrib[slot] = (float4)(0.9f, 0.9f, 1.0f, -2.0f);
+#endif
     }
-
-    rays[ray_id] = next_ray;
   }
 
   colour /= raysCount;
 
   image[id] = ((colour*255) + image[id]) / 2;
+
+  // fold the batch into the frame, weighted by its sample count
+  if (iter == maxDepth(max_depth)-1) {
+    accum[pixel] += image[id] * raysPerPixel;
+  }
+
+#if DENOISE
+  // features come from the first sample batch only
+  if (iter == 0 && sampleOffset == 0) {
+    float3 albedo_sum = (float3)(0.0f, 0.0f, 0.0f);
+    float3 normal_sum = (float3)(0.0f, 0.0f, 0.0f);
+    float depth_sum = 0.0f;
+
+    for (int ray_i=0; ray_i<raysPerPixel; ray_i++) {
+      const int slot = id * raysPerPixel + ray_i;
+      albedo_sum += slot_albedo[slot];
+      normal_sum += slot_normal[slot];
+      depth_sum += slot_depth[slot];
+    }
+
+    albedo[pixel] = albedo_sum / raysPerPixel;
+    normal[pixel] = normal_sum / raysPerPixel;
+    depth[pixel] = depth_sum / raysPerPixel;
+  }
+#endif
 }
@@ -0,0 +1,110 @@
+// -- Sampling --
+// Owen-scrambled Sobol and blue-noise rotation, mirrors sampler.cpp
+// SAMPLER matches sample_type: 0 uniform, 1 sobol, 2 blue noise
+
+// same primitive polynomials as sobolDirections() in sampler.cpp
+__constant uint sobol_dirs[4][32] = {
+  {
+    0x80000000, 0x40000000, 0x20000000, 0x10000000, 0x08000000, 0x04000000, 0x02000000, 0x01000000,
+    0x00800000, 0x00400000, 0x00200000, 0x00100000, 0x00080000, 0x00040000, 0x00020000, 0x00010000,
+    0x00008000, 0x00004000, 0x00002000, 0x00001000, 0x00000800, 0x00000400, 0x00000200, 0x00000100,
+    0x00000080, 0x00000040, 0x00000020, 0x00000010, 0x00000008, 0x00000004, 0x00000002, 0x00000001
+  },
+  {
+    0x80000000, 0xc0000000, 0xa0000000, 0xf0000000, 0x88000000, 0xcc000000, 0xaa000000, 0xff000000,
+    0x80800000, 0xc0c00000, 0xa0a00000, 0xf0f00000, 0x88880000, 0xcccc0000, 0xaaaa0000, 0xffff0000,
+    0x80008000, 0xc000c000, 0xa000a000, 0xf000f000, 0x88008800, 0xcc00cc00, 0xaa00aa00, 0xff00ff00,
+    0x80808080, 0xc0c0c0c0, 0xa0a0a0a0, 0xf0f0f0f0, 0x88888888, 0xcccccccc, 0xaaaaaaaa, 0xffffffff
+  },
+  {
+    0x80000000, 0xc0000000, 0x60000000, 0x90000000, 0xe8000000, 0x5c000000, 0x8e000000, 0xc5000000,
+    0x68800000, 0x9cc00000, 0xee600000, 0x55900000, 0x80680000, 0xc09c0000, 0x60ee0000, 0x90550000,
+    0xe8808000, 0x5cc0c000, 0x8e606000, 0xc5909000, 0x6868e800, 0x9c9c5c00, 0xeeee8e00, 0x5555c500,
+    0x8000e880, 0xc0005cc0, 0x60008e60, 0x9000c590, 0xe8006868, 0x5c009c9c, 0x8e00eeee, 0xc5005555
+  },
+  {
+    0x80000000, 0xc0000000, 0x20000000, 0x50000000, 0xf8000000, 0x74000000, 0xa2000000, 0x93000000,
+    0xd8800000, 0x25400000, 0x59e00000, 0xe6d00000, 0x78080000, 0xb40c0000, 0x82020000, 0xc3050000,
+    0x208f8000, 0x51474000, 0xfbea2000, 0x75d93000, 0xa0858800, 0x914e5400, 0xdbe79e00, 0x25db6d00,
+    0x58800080, 0xe54000c0, 0x79e00020, 0xb6d00050, 0x800800f8, 0xc00c0074, 0x200200a2, 0x50050093
+  }
+};
+
+uint sobolBits(uint index, uint dim) {
+  uint x = 0;
+  for (int bit = 0; index; index >>= 1, bit++) {
+    if (index & 1) {
+      x ^= sobol_dirs[dim][bit];
+    }
+  }
+
+  return x;
+}
+
+uint hashU(uint x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+uint hashCombine(uint seed, uint v) {
+  return seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+uint reverseBits(uint x) {
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+uint owenScramble(uint x, uint seed) {
+  x = reverseBits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return reverseBits(x);
+}
+
+float sobolSample(uint index, uint dim, uint seed) {
+  uint group_seed = hashCombine(seed, hashU(dim / 4));
+  uint shuffled = owenScramble(index, group_seed);
+  uint x = owenScramble(sobolBits(shuffled, dim % 4), hashCombine(group_seed, dim % 4));
+
+  // keep 24 bits so the result stays below 1 in float
+  return (x >> 8) * 0x1p-24f;
+}
+
+float sample1D(int x, int y, uint index, uint dim, __global const float* blue_noise) {
+#if SAMPLER == 2
+  int ox = (int)(dim * 0.7548776662466927f * BLUE_NOISE_SIZE);
+  int oy = (int)(dim * 0.5698402909980532f * BLUE_NOISE_SIZE);
+  int tx = (x + ox) % BLUE_NOISE_SIZE;
+  int ty = (y + oy) % BLUE_NOISE_SIZE;
+
+  float v = sobolSample(index, dim, 0) + blue_noise[ty*BLUE_NOISE_SIZE + tx];
+  return v - floor(v);
+#elif SAMPLER == 1
+  return sobolSample(index, dim, hashCombine(hashU(x), y));
+#else
+  // independent values hashed from pixel, sample and dimension
+  uint h = hashU(hashCombine(hashCombine(hashCombine(hashU(x), y), index), dim));
+  return (h >> 8) * 0x1p-24f;
+#endif
+}
+
+// uniform direction on the unit sphere
+float3 sampleSphere(float u, float v) {
+  float z = 1.0f - 2.0f*u;
+  float r = sqrt(max(0.0f, 1.0f - z*z));
+  float phi = 2.0f * M_PI_F * v;
+
+  return (float3)(r*cos(phi), r*sin(phi), z);
+}
+
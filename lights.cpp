@@ -0,0 +1,221 @@
+#include "lights.hpp"
+
+#include "common.hpp"
+
+#include <cmath>
+#include <numeric>
+#include <algorithm>
+
+namespace {
+
+constexpr pos_type PI = 3.14159265358979323;
+
+auto luminance(point c) -> pos_type {
+  return (c.x + c.y + c.z) / 3;
+}
+
+auto coord(const point& p, int axis) -> pos_type {
+  return axis == 0 ? p.x : (axis == 1 ? p.y : p.z);
+}
+
+auto bounds(const light& l, point& lo, point& hi) -> void {
+  switch (l.shape) {
+    case point_light:
+      lo = hi = l.pos;
+      break;
+    case sphere_light:
+      lo = l.pos - l.radius;
+      hi = l.pos + l.radius;
+      break;
+    case rect_light: {
+      lo = hi = l.pos;
+      for (const point corner : {l.pos + l.edge_u, l.pos + l.edge_v, l.pos + l.edge_u + l.edge_v}) {
+        lo = point(std::min(lo.x, corner.x), std::min(lo.y, corner.y), std::min(lo.z, corner.z));
+        hi = point(std::max(hi.x, corner.x), std::max(hi.y, corner.y), std::max(hi.z, corner.z));
+      }
+      break;
+    }
+  }
+}
+
+// power over squared distance to the centre, never closer than the box itself
+auto importance(const light_tree::node& n, point x) -> pos_type {
+  const point centre = (n.lo + n.hi) * 0.5;
+  const pos_type half_diagonal = ((n.hi - n.lo) * 0.5).length_squared();
+
+  return n.power / std::max({(x - centre).length_squared(), half_diagonal, 1e-4});
+}
+
+}
+
+auto sampleLight(const light& l, point x, pos_type u, pos_type v) -> light_sample {
+  switch (l.shape) {
+    case point_light: {
+      return light_sample{l.pos, l.emission / (l.pos - x).length_squared()};
+    }
+
+    case sphere_light: {
+      // uniform over the cone the sphere fills as seen from x
+      const point w = l.pos - x;
+      const pos_type dist2 = w.length_squared();
+      if (dist2 <= l.radius*l.radius) {
+        return light_sample{l.pos, point(0,0,0)};
+      }
+
+      const pos_type cos_max = std::sqrt(1 - l.radius*l.radius / dist2);
+      const pos_type cos_t = 1 - u*(1 - cos_max);
+      const pos_type sin_t = std::sqrt(std::max(0.0, 1 - cos_t*cos_t));
+      const pos_type phi = 2*PI*v;
+
+      // orthonormal basis around the axis (Duff et al. 2017)
+      const point n = w / std::sqrt(dist2);
+      const pos_type sign = std::copysign(1.0, n.z);
+      const pos_type a = -1 / (sign + n.z);
+      const pos_type b = n.x*n.y*a;
+      const point t1 = point(1 + sign*n.x*n.x*a, sign*b, -sign*n.x);
+      const point t2 = point(b, sign + n.y*n.y*a, -n.y);
+
+      const point dir = t1*(sin_t*std::cos(phi)) + t2*(sin_t*std::sin(phi)) + n*cos_t;
+
+      // nearest point of the sphere along dir
+      const pos_type half_b = dot(dir, w);
+      const pos_type t = half_b - std::sqrt(std::max(0.0, half_b*half_b - (dist2 - l.radius*l.radius)));
+
+      return light_sample{x + dir*t, l.emission * (2*PI*(1 - cos_max))};
+    }
+
+    case rect_light: {
+      const point normal_area = cross(l.edge_u, l.edge_v);
+      const point pos = l.pos + l.edge_u*u + l.edge_v*v;
+      const point to_x = x - pos;
+      const pos_type dist2 = to_x.length_squared();
+
+      // area density turned into solid angle, the back side is dark
+      const pos_type cos_area = dot(normal_area, to_x) / std::sqrt(dist2);
+      if (cos_area <= 0) {
+        return light_sample{pos, point(0,0,0)};
+      }
+
+      return light_sample{pos, l.emission * (cos_area / dist2)};
+    }
+  }
+
+  return light_sample{l.pos, point(0,0,0)};
+}
+
+auto lightPower(const light& l) -> pos_type {
+  switch (l.shape) {
+    case point_light:
+      return luminance(l.emission) * 4*PI;
+    case sphere_light:
+      return luminance(l.emission) * PI * 4*PI*l.radius*l.radius;
+    case rect_light:
+      return luminance(l.emission) * PI * cross(l.edge_u, l.edge_v).length();
+  }
+
+  return 0;
+}
+
+light_tree::light_tree(std::vector<light> lights) {
+  // dark lights would only ever be picked with zero probability
+  std::erase_if(lights, [](const light& l) { return lightPower(l) <= 0; });
+  emitters = std::move(lights);
+
+  if (emitters.empty()) {
+    return;
+  }
+
+  std::vector<int> order(emitters.size());
+  std::iota(order.begin(), order.end(), 0);
+
+  tree.reserve(2*emitters.size() - 1);
+  tree.emplace_back();
+  build(order, 0, order.size(), 0);
+}
+
+// fills tree[at] with lights order[first, last), splitting at the median
+// centre along the longest axis of the centres
+auto light_tree::build(std::vector<int>& order, int first, int last, int at) -> void {
+  point lo, hi;
+  point centre_lo, centre_hi;
+  pos_type power = 0;
+
+  for (int i = first; i<last; i++) {
+    const light& l = emitters[order[i]];
+    point l_lo, l_hi;
+    bounds(l, l_lo, l_hi);
+    const point centre = (l_lo + l_hi) * 0.5;
+
+    if (i == first) {
+      lo = l_lo; hi = l_hi;
+      centre_lo = centre_hi = centre;
+    }
+
+    lo = point(std::min(lo.x, l_lo.x), std::min(lo.y, l_lo.y), std::min(lo.z, l_lo.z));
+    hi = point(std::max(hi.x, l_hi.x), std::max(hi.y, l_hi.y), std::max(hi.z, l_hi.z));
+    centre_lo = point(std::min(centre_lo.x, centre.x), std::min(centre_lo.y, centre.y), std::min(centre_lo.z, centre.z));
+    centre_hi = point(std::max(centre_hi.x, centre.x), std::max(centre_hi.y, centre.y), std::max(centre_hi.z, centre.z));
+    power += lightPower(l);
+  }
+
+  tree[at] = node{lo, hi, power, -(order[first]+1)};
+
+  if (last - first == 1) {
+    return;
+  }
+
+  const point extent = centre_hi - centre_lo;
+  const int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z ? 1 : 2);
+  const int mid = (first + last) / 2;
+
+  std::nth_element(order.begin() + first, order.begin() + mid, order.begin() + last, [&](int a, int b) {
+    point a_lo, a_hi, b_lo, b_hi;
+    bounds(emitters[a], a_lo, a_hi);
+    bounds(emitters[b], b_lo, b_hi);
+    return coord(a_lo + a_hi, axis) < coord(b_lo + b_hi, axis);
+  });
+
+  const int child = tree.size();
+  tree[at].child = child;
+  tree.emplace_back();
+  tree.emplace_back();
+
+  build(order, first, mid, child);
+  build(order, mid, last, child+1);
+}
+
+auto light_tree::pick(point x, pos_type& u) const -> std::pair<int, pos_type> {
+  // keeps the rescaled number below one however the rounding goes
+  u = std::min(u, 1 - 1e-12);
+
+  if constexpr(!LIGHT_TREE) {
+    const int count = emitters.size();
+    const int i = std::min(static_cast<int>(u*count), count-1);
+    u = u*count - i;
+    return {i, 1.0 / count};
+  }
+
+  int n = 0;
+  pos_type prob = 1;
+
+  while (tree[n].child >= 0) {
+    const int child = tree[n].child;
+    const pos_type left = importance(tree[child], x);
+    const pos_type right = importance(tree[child+1], x);
+    const pos_type p = left + right > 0 ? left / (left + right) : 0.5;
+
+    if (u < p) {
+      u = u / p;
+      prob *= p;
+      n = child;
+    } else {
+      u = (u - p) / (1 - p);
+      prob *= 1 - p;
+      n = child+1;
+    }
+
+    u = std::min(u, 1 - 1e-12);
+  }
+
+  return {-tree[n].child - 1, prob};
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+
+#include "Structures/point.hpp"
+
+enum light_shape {
+  point_light,
+  sphere_light,
+  rect_light
+};
+
+// Emitter in the scene. Point lights give intensity, spheres and rects give
+// radiance. A rect spans pos + [0,1]*edge_u + [0,1]*edge_v and emits on the
+// side of cross(edge_u, edge_v) only.
+struct light {
+  light_shape shape;
+  point pos;
+  point emission;
+  pos_type radius = 0;
+  point edge_u;
+  point edge_v;
+};
+
+// a point on a light and the light it sends to x over the density of picking
+// that point, visibility not included
+struct light_sample {
+  point pos;
+  point value;
+};
+
+// u and v uniform in [0,1)
+auto sampleLight(const light& l, point x, pos_type u, pos_type v) -> light_sample;
+// total emitted power, by luminance
+auto lightPower(const light& l) -> pos_type;
+
+// Light BVH in the spirit of Conty & Kulla 2018, without orientation cones.
+// Every node holds the bounds and power of the lights below it, and a
+// shading point walks from the root picking either child in proportion to
+// power over squared distance, so picking a light costs O(log n) whatever the
+// light count. Children of a node are adjacent, leaves hold one light.
+class light_tree {
+public:
+  struct node {
+    point lo, hi;
+    pos_type power;
+    int child; // children are child and child+1, leaves hold -(light+1)
+  };
+
+  light_tree() = default;
+  explicit light_tree(std::vector<light> lights);
+
+  // picks a light for x with u, returning its index and probability. u is
+  // rescaled to a fresh uniform number, so it can also place the sample
+  auto pick(point x, pos_type& u) const -> std::pair<int, pos_type>;
+
+  auto lights() const -> const std::vector<light>& { return emitters; }
+  auto nodes() const -> const std::vector<node>& { return tree; }
+
+private:
+  auto build(std::vector<int>& order, int first, int last, int at) -> void;
+
+  std::vector<light> emitters;
+  std::vector<node> tree;
+};
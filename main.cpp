@@ -6,41 +6,109 @@
 #include <iostream>
 #include <sstream>
 #include <memory>
+#include <chrono>
+#include <iomanip>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <atomic>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
+#include <algorithm>
+#include <iterator>
+#include <filesystem>
+#include <csignal>
 #include <omp.h>
 #include <CL/opencl.hpp>
 
 #include "common.hpp"
 #include "Structures/ray.hpp"
 #include "Structures/objects.hpp"
-#include "Structures/clStructs.hpp"
+#include "Structures/sdf.hpp"
 #include "trace.hpp"
+#include "sampler.hpp"
+#include "image.hpp"
+#include "denoise.hpp"
+#include "pipeline.hpp"
+#include "metrics.hpp"
+#include "numa.hpp"
+#include "scene.hpp"
+#include "lights.hpp"
+#include "texture.hpp"
+#include "environment.hpp"
+#include "bdpt.hpp"
+#include "pathcl.hpp"
 #include "EasyBMP.hpp"
 
 // ray tracing in one weekend consulted for path tracing
 // https://raytracing.github.io/
 
-using array_t = std::unique_ptr<std::array<std::array<point, HEIGHT>, WIDTH>>;
+// camera and per-object offsets from the scene as built, for one frame
+struct frame_desc {
+  camera cam;
+  std::vector<point> offsets;
+};
 
-auto createScene() -> std::vector<std::shared_ptr<object>>;
-auto saveImage(array_t image) -> void;
-auto loadKernel(std::string file) -> std::string;
-auto checkErr(std::string ctx, cl_int err) -> void;
-auto checkBuildErr(cl::Program prog, cl_int err) -> void;
-auto pathTrace(std::vector<std::shared_ptr<object>> scene) -> array_t;
-auto distTrace(std::vector<std::shared_ptr<object>> scene) -> array_t;
-auto pathCL(std::vector<std::shared_ptr<object>> scene) -> array_t;
-
-// openCL globals
-cl::Device device;
-cl::Context context;
+// a rendered frame and, for every EDIT_TILE square tile, the objects its
+// paths shaded, so material edits only re-trace the tiles they can change
+struct edit_cache {
+  array_t image;
+  std::vector<uint64_t> touched;
+};
+
+// a lighter's change to one object's material, by its index in the scene.
+// Nothing moves, so applyEdit() only re-traces the tiles that shaded it
+struct material_edit {
+  size_t object;
+  point colour;
+  pos_type specular;
+  pos_type diffuse;
+};
+
+auto createScene(bool with_sdf = SDF_SCENE) -> std::vector<std::shared_ptr<object>>;
+auto createLights(int count = SCENE_LIGHTS) -> std::vector<light>;
+auto createSequence(size_t objects) -> std::vector<frame_desc>;
+auto saveImage(array_t image, std::string file = "output.bmp") -> void;
+auto renderFrame(const scene_t& scene, const camera& cam, const std::string& file) -> void;
+auto renderSequence(std::vector<std::shared_ptr<object>> objects, const std::vector<light>& lights) -> void;
+auto pathTrace(const scene_t& scene, const camera& cam, gbuffer_t& gbuffer, output_pipeline* out) -> array_t;
+auto editSession(const std::vector<std::shared_ptr<object>>& objects, const std::vector<light>& lights) -> void;
+auto traceTiles(const scene_t& scene, const camera& cam, edit_cache& cache, const std::vector<char>& retrace) -> void;
+auto applyEdit(const std::vector<std::shared_ptr<object>>& objects, const std::vector<light>& lights, const camera& cam,
+               edit_cache& cache, const material_edit& edit) -> int;
+auto progressiveTrace(const scene_t& scene, const camera& cam, gbuffer_t& gbuffer) -> array_t;
+auto guidedTrace(const scene_t& scene, const camera& cam, gbuffer_t& gbuffer) -> array_t;
+auto subsetTrace(const scene_t& scene, const camera& cam, gbuffer_t& gbuffer) -> array_t;
+auto bidirectionalTrace(const scene_t& scene, const camera& cam, gbuffer_t& gbuffer) -> array_t;
+auto deadlineTrace(const scene_t& scene, const camera& cam, gbuffer_t& gbuffer, const render_stop& stop, int& spp) -> array_t;
+auto savePreview(const array_t& image) -> void;
+auto distTrace(const scene_t& scene, const camera& cam, gbuffer_t& gbuffer, output_pipeline* out) -> array_t;
+auto seedIrradianceCache(const scene_t& scene, const camera& cam) -> void;
+auto traceSamples(const scene_t& scene, const camera& cam, array_t& sum, int first, int count, gbuffer_t* gbuffer = nullptr,
+                  const render_stop* stop = nullptr) -> bool;
+auto convergenceBenchmark() -> void;
+auto referenceKey(const scene_t& scene, const camera& cam) -> std::string;
+
+// samples go through the OpenCL kernels, which only path trace. Bidirectional
+// tracing always runs on the CPU, with OpenMP when EXEC asks for OpenCL
+constexpr bool DEVICE_TRACE = EXEC == opencl && TYPE == path;
 
 auto main() -> int {
-  // set up the scene
-  const auto scene = createScene();
-  array_t image;
+  // set up the scene, tracing reads the immutable copy
+  const auto objects = createScene();
+  const auto lights = createLights();
+  const scene_t scene(objects, lights);
+
+  if (ENVIRONMENT_MAP[0] != '\0') {
+    loadEnvironment(ENVIRONMENT_MAP);
+    const environment_map& env = environmentMap();
+    std::cout << "Environment: " << env.width() << "x" << env.height() << ", alias tables built in "
+              << env.buildMs() << "ms" << std::endl;
+  }
 
   // setup openCL
-  if constexpr(EXEC == opencl) {
+  if constexpr(EXEC == opencl && TYPE != bidirectional) {
 
     std::vector<cl::Platform> platforms;
     cl::Platform::get(&platforms);
@@ -63,14 +131,20 @@ auto main() -> int {
   }
 
   // tracing
-  if constexpr(TYPE == path) {
-    image = pathTrace(scene);
+  if constexpr(TYPE != test && CONVERGENCE) {
+    convergenceBenchmark();
 
-  } else if constexpr(TYPE == distributed) {
-    image = distTrace(scene);
+  } else if constexpr(TYPE == path && EXEC != opencl && EDIT_RERENDER) {
+    editSession(objects, lights);
+
+  } else if constexpr(TYPE != test && FRAMES > 1) {
+    renderSequence(objects, lights);
+
+  } else if constexpr(TYPE != test) {
+    renderFrame(scene, camera{}, std::string("output.") + OUTPUT_FORMAT);
 
   } else if constexpr(TYPE == test) {
-    image = std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>();
+    auto image = std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>();
 
     // shoot 1 ray per pixel for intersection testing
     for (int x = 0; x<WIDTH; x++) {
@@ -122,249 +196,808 @@ auto main() -> int {
         std::cout << arrayA[i] << " + " << arrayB[i] << " = " << arrayAB[i] << std::endl;
 
     }
-  }
 
-  saveImage(std::move(image));
+    saveImage(std::move(image));
+  }
 
   return 0;
 }
 
-auto pathTrace(std::vector<std::shared_ptr<object>> scene) -> array_t {
-  auto image = std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>();
+// OpenMP band scheduler. Threads are placed per PINNING, and every NUMA node
+// in use takes a contiguous x range of each band, so the pages it writes are
+// its own. A node's threads claim bands in order from the node's own counter
+// and trace from the node's own scene copy. A band goes to out once every
+// node has finished its part. trace(scene, x0, x1, y0, y1) renders one part.
+// Placement follows the team OpenMP actually starts, which OMP_DYNAMIC or
+// OMP_THREAD_LIMIT can make smaller than asked for, so every part has threads.
+template<typename Trace>
+auto renderBands(const scene_t& scene, const array_t& image, output_pipeline* out, Trace trace) -> void {
+  constexpr int threads = 12;
+  constexpr int bands = (HEIGHT + OUTPUT_BAND_ROWS - 1) / OUTPUT_BAND_ROWS;
+  const size_t nodes = numaNodes().size();
+
+  // filled in by the team, there are at most as many parts as nodes
+  int team = 0;
+  std::vector<thread_place> places;
+  std::vector<int> part_of(nodes, -1);
+  std::vector<int> part_node;
+  std::vector<int> leader;
+  int parts = 0;
+
+  std::vector<std::optional<scene_t>> copies(nodes);
+  std::vector<const scene_t*> replicas(nodes, &scene);
+  std::vector<std::atomic<int>> next_band(nodes);
+  std::vector<std::atomic<int>> parts_done(bands);
+  std::vector<double> finished(threads);
+
+  omp_set_num_threads(threads);
+  const auto start = std::chrono::steady_clock::now();
+
+  #pragma omp parallel
+  {
+    #pragma omp single
+    {
+      team = omp_get_num_threads();
+      places = threadPlacement(team);
+
+      // nodes in use, in order of their first thread, become the parts of a band
+      for (int t = 0; t<team; t++) {
+        if (part_of[places[t].node] == -1) {
+          part_of[places[t].node] = part_node.size();
+          part_node.push_back(places[t].node);
+          leader.push_back(t);
+        }
+      }
+      parts = part_node.size();
+    }
+
+    const int t = omp_get_thread_num();
+    const int part = part_of[places[t].node];
+    pinThread(places[t].cpu);
+
+    // with a single node in use the original is already local
+    if (t == leader[part] && PINNING != unpinned && parts > 1) {
+      replicas[part] = &copies[part].emplace(replicateScene(scene));
+    }
+
+    #pragma omp barrier
+
+    const int x0 = part*WIDTH / parts;
+    const int x1 = (part+1)*WIDTH / parts;
+
+    for (int band = next_band[part]++; band<bands; band = next_band[part]++) {
+      const int y0 = band*OUTPUT_BAND_ROWS;
+      const int y1 = std::min(y0 + OUTPUT_BAND_ROWS, HEIGHT);
+
+      trace(*replicas[part], x0, x1, y0, y1);
+
+      if (parts_done[band].fetch_add(1) == parts-1 && out) {
+        out->push(image, y0, y1);
+      }
+    }
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    finished[t] = elapsed.count();
+
+    // the pool's threads go on to run everything after the render
+    unpinThread();
+  }
+
+  // a node is done when its last thread is
+  for (int part = 0; part<parts; part++) {
+    double seconds = 0;
+    int node_threads = 0;
+    for (int t = 0; t<team; t++) {
+      if (part_of[places[t].node] == part) {
+        seconds = std::max(seconds, finished[t]);
+        node_threads++;
+      }
+    }
+
+    const int pixels = ((part+1)*WIDTH / parts - part*WIDTH / parts) * HEIGHT;
+    std::cout << "Node " << numaNodes()[part_node[part]].id << ": " << node_threads << " threads, "
+              << pixels / seconds / 1000 << " kpx/s" << std::endl;
+  }
+}
+
+// CPU tracers push each band to the output pipeline as soon as it is traced.
+// Frames that are only final at the end (OpenCL, progressive, guided, denoised) are
+// pushed whole once done.
+auto renderFrame(const scene_t& scene, const camera& cam, const std::string& file) -> void {
+  // the banded CPU tracers set every pixel's features from the node that
+  // renders it, so their pages are first touched there. The rest add to them
+  constexpr bool banded = EXEC != opencl && DEADLINE_SECONDS == 0 && SHADING_SUBSET == every_pixel
+    && TYPE != bidirectional && !(TYPE == path && (PROGRESSIVE || PATH_GUIDING));
+
+  array_t image;
+  gbuffer_t gbuffer = banded ? uninitialisedFeatures() : std::make_unique<std::array<std::array<features, HEIGHT>, WIDTH>>();
+  output_pipeline out(file);
+
+  constexpr bool streamed = banded && !DENOISE;
+  output_pipeline* stream = streamed ? &out : nullptr;
+  int spp = (TYPE == distributed) ? GRID_SIZE*GRID_SIZE : INITIAL_RAYS_PER_PIXEL;
+
+  if constexpr(DEADLINE_SECONDS > 0) {
+    render_stop stop;
+    stop.deadline = std::chrono::steady_clock::now()
+      + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(DEADLINE_SECONDS));
+
+    // Ctrl-C keeps the passes finished so far
+    static render_stop* interrupted;
+    interrupted = &stop;
+    std::signal(SIGINT, [](int) { interrupted->cancel.store(true); });
+
+    image = deadlineTrace(scene, cam, gbuffer, stop, spp);
+    std::signal(SIGINT, SIG_DFL);
+
+  } else if constexpr(TYPE == bidirectional) {
+    image = bidirectionalTrace(scene, cam, gbuffer);
+
+  } else if constexpr(SHADING_SUBSET != every_pixel && EXEC != opencl) {
+    image = subsetTrace(scene, cam, gbuffer);
+
+  } else if constexpr(TYPE == path && PATH_GUIDING && EXEC != opencl) {
+    image = guidedTrace(scene, cam, gbuffer);
+
+  } else if constexpr(TYPE == path && PROGRESSIVE && EXEC != opencl) {
+    image = progressiveTrace(scene, cam, gbuffer);
+
+  } else if constexpr(TYPE == path) {
+    image = pathTrace(scene, cam, gbuffer, stream);
+
+  } else if constexpr(TYPE == distributed) {
+    image = distTrace(scene, cam, gbuffer, stream);
+
+    if constexpr(IRRADIANCE_CACHE) {
+      std::cout << "Irradiance cache: " << irradianceCacheSize() << " records" << std::endl;
+    }
+  }
+
+  if constexpr(DENOISE) {
+    const auto start = std::chrono::steady_clock::now();
+    image = denoise(std::move(image), gbuffer, spp);
+    const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << "Denoise: " << elapsed.count() << "ms" << std::endl;
+  }
+
+  if (textureCache().size() > 0) {
+    const texture_cache& tex = textureCache();
+    const uint64_t lookups = tex.hits() + tex.misses();
+    std::cout << "Texture cache: " << (lookups ? 100.0*tex.hits() / lookups : 0) << "% hits of "
+              << lookups << " tile lookups, " << tex.resident() / 1024 << "KB resident of "
+              << tex.capacity() / 1024 << "KB" << std::endl;
+  }
+
+  const auto tail_start = std::chrono::steady_clock::now();
+
+  if constexpr(!streamed) {
+    for (int y = 0; y<HEIGHT; y+=OUTPUT_BAND_ROWS) {
+      out.push(image, y, std::min(y + OUTPUT_BAND_ROWS, HEIGHT));
+    }
+  }
+
+  out.finish();
+
+  // time from the last traced pixel to the file being complete
+  const std::chrono::duration<double, std::milli> tail = std::chrono::steady_clock::now() - tail_start;
+  std::cout << "Output tail: " << tail.count() << "ms" << std::endl;
+
+  // throughput over the 8 bit RGB frame
+  const double raw_mb = WIDTH*HEIGHT*3 / 1e6;
+  std::cout << "Encoded " << file << ": " << out.fileBytes() / 1024 << "KB in " << out.encodeMs() << "ms, "
+            << raw_mb / (out.encodeMs() / 1000) << "MB/s" << std::endl;
+}
+
+// renders every frame of createSequence() in one process, so the OpenCL
+// program, buffers and irradiance cache are reused, and writes each frame as
+// soon as it is done, lights stay where they are
+auto renderSequence(std::vector<std::shared_ptr<object>> objects, const std::vector<light>& lights) -> void {
+  const auto frames = createSequence(objects.size());
+  std::vector<point> applied(objects.size());
+
+  const auto start = std::chrono::steady_clock::now();
+
+  for (size_t f = 0; f<frames.size(); f++) {
+    const auto frame_start = std::chrono::steady_clock::now();
+    bool moved = false;
+
+    // objects are moved in place, only the difference to the last frame
+    for (size_t i = 0; i<objects.size(); i++) {
+      const point delta = frames[f].offsets[i] - applied[i];
+
+      if (delta.x != 0 || delta.y != 0 || delta.z != 0) {
+        objects[i]->translate(delta);
+        applied[i] = frames[f].offsets[i];
+        moved = true;
+      }
+    }
+
+    // cached lighting belongs to the old geometry, a camera move keeps it
+    if constexpr(IRRADIANCE_CACHE && TYPE == distributed) {
+      if (moved) {
+        clearIrradianceCache();
+      }
+    }
+
+    std::stringstream file;
+    file << "frame_" << std::setw(4) << std::setfill('0') << f << "." << OUTPUT_FORMAT;
+    renderFrame(scene_t(objects, lights), frames[f].cam, file.str());
+
+    const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - frame_start;
+    std::cout << "Frame " << f << ": " << elapsed.count() << "ms" << std::endl;
+  }
+
+  const std::chrono::duration<double> total = std::chrono::steady_clock::now() - start;
+  std::cout << frames.size() << " frames in " << total.count() << "s, "
+            << frames.size() / (total.count() / 60.0) << " frames/min" << std::endl;
+}
+
+auto pathTrace(const scene_t& scene, const camera& cam, gbuffer_t& gbuffer, output_pipeline* out) -> array_t {
+  auto image = (EXEC == opencl) ? std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>() : uninitialisedImage();
+  constexpr int bands = (HEIGHT + OUTPUT_BAND_ROWS - 1) / OUTPUT_BAND_ROWS;
 
   if constexpr(EXEC==seq) {
 
-    for (int x = 0; x<WIDTH; x++) {
-      for (int y = 0; y<HEIGHT; y++) {
-        point pixel = point(0,0,0);
+    for (int band = 0; band<bands; band++) {
+      const int y0 = band*OUTPUT_BAND_ROWS;
+      const int y1 = std::min(y0 + OUTPUT_BAND_ROWS, HEIGHT);
 
-        // scatter within pixel
-        for (int ray_i = 0; ray_i < INITIAL_RAYS_PER_PIXEL; ray_i++) {
+      for (int x = 0; x<WIDTH; x++) {
+        for (int y = y0; y<y1; y++) {
+          point pixel = point(0,0,0);
+          features pixel_features;
+
+          // scatter within pixel
+          for (int ray_i = 0; ray_i < INITIAL_RAYS_PER_PIXEL; ray_i++) {
+            auto s = sampler(x, y, ray_i);
+            const auto [jitter_x, jitter_y] = s.get2D();
+            features sample_features;
 
-          const ray r = rayDir(90.0, x+random_double(-0.5,0.5), y+random_double(-0.5,0.5));
-          pixel = pixel + rayCast(r, scene, MAX_RAY_DEPTH_PER_PIXEL);
+            const ray r = rayDir(cam, 90.0, x+jitter_x-0.5, y+jitter_y-0.5);
+            pixel = pixel + rayCast(r, scene, MAX_RAY_DEPTH_PER_PIXEL, s, DENOISE ? &sample_features : nullptr);
+            pixel_features += sample_features;
+          }
+
+          (*image)[x][y] = (pixel/(INITIAL_RAYS_PER_PIXEL))*255;
+          (*gbuffer)[x][y] = pixel_features/INITIAL_RAYS_PER_PIXEL;
         }
+      }
 
-        (*image)[x][y] = (pixel/(INITIAL_RAYS_PER_PIXEL))*255;
+      if (out) {
+        out->push(image, y0, y1);
       }
     }
 
   } else if constexpr(EXEC==openmp) {
 
-    omp_set_num_threads(12);
+    renderBands(scene, image, out, [&](const scene_t& node_scene, int x0, int x1, int y0, int y1) {
+      for (int x = x0; x<x1; x++) {
+        for (int y = y0; y<y1; y++) {
+          point pixel = point(0,0,0);
+          features pixel_features;
 
-    // collapse only valid when width == height
-    #pragma omp parallel for collapse(2)
-    for (int x = 0; x<WIDTH; x++) {
-      for (int y = 0; y<HEIGHT; y++) {
-        point pixel = point(0,0,0);
+          // scatter within pixel
+          #pragma omp parallel for reduction(pointAdd : pixel) reduction(featureAdd : pixel_features)
+          for (int ray_i = 0; ray_i < INITIAL_RAYS_PER_PIXEL; ray_i++) {
+            auto s = sampler(x, y, ray_i);
+            const auto [jitter_x, jitter_y] = s.get2D();
+            features sample_features;
 
-        // scatter within pixel
-        #pragma omp parallel for reduction(pointAdd : pixel)
-        for (int ray_i = 0; ray_i < INITIAL_RAYS_PER_PIXEL; ray_i++) {
+            const ray r = rayDir(cam, 90.0, x+jitter_x-0.5, y+jitter_y-0.5);
 
-          const ray r = rayDir(90.0, x+random_double(-0.5,0.5), y+random_double(-0.5,0.5));
+            pixel += rayCast(r, node_scene, MAX_RAY_DEPTH_PER_PIXEL, s, DENOISE ? &sample_features : nullptr);
+            pixel_features += sample_features;
+          }
 
-          pixel += rayCast(r, scene, MAX_RAY_DEPTH_PER_PIXEL);
+          //
+          (*image)[x][y] = (pixel/(INITIAL_RAYS_PER_PIXEL))*255;
+          (*gbuffer)[x][y] = pixel_features/INITIAL_RAYS_PER_PIXEL;
         }
-
-        //
-        (*image)[x][y] = (pixel/(INITIAL_RAYS_PER_PIXEL))*255;
       }
-    }
+    });
 
   } else if constexpr(EXEC==opencl) {
-    std::string vec_add = loadKernel("./kernels/path.cl");
+    image = pathCL(pathCLState(scene), scene, cam, gbuffer);
+  }
 
-    cl::Program prog(context, vec_add.c_str());
-    cl_int result = prog.build({device}, "");
-    checkBuildErr(prog, result);
+  return image;
+}
 
-    cl::Kernel kernel(prog, "pathTrace");
+// Coarse-to-fine path tracing. Each level traces one pixel per block x block
+// square up to spp samples, continuing that pixel's sample sequence, so the
+// last level gives the same image as pathTrace. Resolution is refined first at
+// 1 spp, then samples are doubled.
+auto progressiveTrace(const scene_t& scene, const camera& cam, gbuffer_t& gbuffer) -> array_t {
+  struct level {
+    int block;
+    int spp;
+  };
+
+  auto levels = std::vector<level>();
+  for (int block = PROGRESSIVE_BLOCK; block > 1; block /= 2) {
+    levels.push_back(level{block, 1});
+  }
+  for (int spp = 1; spp < INITIAL_RAYS_PER_PIXEL; spp *= 2) {
+    levels.push_back(level{1, spp});
+  }
+  levels.push_back(level{1, INITIAL_RAYS_PER_PIXEL});
 
-    // setup kernel params
-    const int len = WIDTH*HEIGHT;
+  auto sum = std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>();
+  auto counts = std::make_unique<std::array<std::array<int, HEIGHT>, WIDTH>>();
+  auto image = std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>();
 
-    // construct host representations
-    cl_int sceneLen = scene.size();
+  if constexpr(EXEC==openmp) {
+    omp_set_num_threads(12);
+  }
 
-    cl_Obj* objs_host = new cl_Obj[sceneLen];
-    cl_Material* mats_host = new cl_Material[sceneLen];
+  const auto start = std::chrono::steady_clock::now();
 
-    for (int i=0; i<sceneLen; i++) {
-      const auto& obj = scene[i];
+  for (size_t l = 0; l<levels.size(); l++) {
+    const int block = levels[l].block;
+    const int spp = levels[l].spp;
+    const int cols = (WIDTH + block - 1) / block;
+    const int rows = (HEIGHT + block - 1) / block;
 
-      cl_Obj new_obj;
+    #pragma omp parallel for collapse(2) schedule(dynamic) if(EXEC==openmp)
+    for (int col = 0; col<cols; col++) {
+      for (int row = 0; row<rows; row++) {
+        const int x = col*block;
+        const int y = row*block;
 
-      std::shared_ptr<sphere> obj_sphere = std::dynamic_pointer_cast<sphere>(obj);
-      if (obj_sphere) {
-        new_obj = cl_Obj{
-          pos: obj_sphere->centre.toFloat3(),
-          type: 1,
-          params: (cl_float3){obj_sphere->radius, 0, 0}
-        };
-      }
+        point pixel = (*sum)[x][y];
+        features pixel_features = (*gbuffer)[x][y];
 
-      std::shared_ptr<plane> obj_plane = std::dynamic_pointer_cast<plane>(obj);
-      if (obj_plane) {
-        new_obj = cl_Obj{
-          pos: obj_plane->vertex.toFloat3(),
-          type: 0,
-          params: obj_plane->normal.toFloat3()
-        };
-      }
+        // earlier levels already traced the first counts samples
+        for (int ray_i = (*counts)[x][y]; ray_i < spp; ray_i++) {
+          auto s = sampler(x, y, ray_i);
+          const auto [jitter_x, jitter_y] = s.get2D();
+          features sample_features;
 
-      cl_Material new_mat = cl_Material{
-        colour: obj->colour.toFloat3(),
-        spec: obj->specular,
-        diff: obj->diffuse
-      };
+          const ray r = rayDir(cam, 90.0, x+jitter_x-0.5, y+jitter_y-0.5);
+          pixel = pixel + rayCast(r, scene, MAX_RAY_DEPTH_PER_PIXEL, s, DENOISE ? &sample_features : nullptr);
+          pixel_features += sample_features;
+        }
 
-      objs_host[i] = new_obj;
-      mats_host[i] = new_mat;
+        (*sum)[x][y] = pixel;
+        (*gbuffer)[x][y] = pixel_features;
+        (*counts)[x][y] = std::max((*counts)[x][y], spp);
+      }
     }
 
-    const cl_int raysLen = len*INITIAL_RAYS_PER_PIXEL;
-    cl_Ray* rays_host = new cl_Ray[raysLen];
+    // untraced pixels take the value of their block's traced corner
     for (int x = 0; x<WIDTH; x++) {
       for (int y = 0; y<HEIGHT; y++) {
+        const int cx = x - x%block;
+        const int cy = y - y%block;
+        (*image)[x][y] = ((*sum)[cx][cy]/(*counts)[cx][cy])*255;
+      }
+    }
 
-        for (int ray_i = 0; ray_i < INITIAL_RAYS_PER_PIXEL; ray_i++) {
+    savePreview(image);
 
-          const ray r = rayDir(90.0, x+random_double(-0.5,0.5), y+random_double(-0.5,0.5));
+    const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "Preview " << l << " (" << cols << "x" << rows << ", " << spp << " spp): "
+              << elapsed.count() << "ms" << std::endl;
+  }
 
-          cl_Ray new_ray = cl_Ray{
-            origin: r.e.toFloat3(),
-            direction: r.d.toFloat3(),
-          };
+  for (int x = 0; x<WIDTH; x++) {
+    for (int y = 0; y<HEIGHT; y++) {
+      (*gbuffer)[x][y] = (*gbuffer)[x][y]/(*counts)[x][y];
+    }
+  }
 
-          const int index = (x * WIDTH + y) * INITIAL_RAYS_PER_PIXEL + ray_i;
+  return image;
+}
 
-          rays_host[index] = new_ray;
-        }
-      }
-    }
+// Path tracing in passes of 1, 2, 4, ... samples per pixel, training the path
+// guide after each one. Every pass is an unbiased estimate, so all of them go
+// into the image.
+auto guidedTrace(const scene_t& scene, const camera& cam, gbuffer_t& gbuffer) -> array_t {
+  auto sum = std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>();
+  const auto start = std::chrono::steady_clock::now();
+
+  resetPathGuide(scene);
+
+  int spp = 0;
+  for (int pass = 1; spp < INITIAL_RAYS_PER_PIXEL; pass *= 2) {
+    const int count = std::min(pass, INITIAL_RAYS_PER_PIXEL - spp);
+    traceSamples(scene, cam, sum, spp, count, &gbuffer);
+    spp += count;
+    trainPathGuide(spp);
+
+    const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "Guided pass " << spp << " spp: " << pathGuideLeaves() << " leaves, "
+              << elapsed.count() << "ms" << std::endl;
+  }
 
-    cl_float3* jitter_host = new cl_float3[raysLen];
-    for (int i=0; i<raysLen; i++) {
-      jitter_host[i] = point(random_double(-1,1), random_double(-1,1), random_double(-1,1)).toFloat3();
+  for (int x = 0; x<WIDTH; x++) {
+    for (int y = 0; y<HEIGHT; y++) {
+      (*sum)[x][y] = (*sum)[x][y]/spp;
+      (*gbuffer)[x][y] = (*gbuffer)[x][y]/spp;
     }
+  }
+
+  return sum;
+}
+
+// Every sample of every pixel at once, light paths splat across the whole
+// frame so it can't be written in bands. There is no OpenCL version, see
+// DEVICE_TRACE
+auto bidirectionalTrace(const scene_t& scene, const camera& cam, gbuffer_t& gbuffer) -> array_t {
+  auto image = std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>();
+  const auto start = std::chrono::steady_clock::now();
 
-    cl_int* shadows = new cl_int[INITIAL_RAYS_PER_PIXEL];
-    for (int i=0; i<INITIAL_RAYS_PER_PIXEL; i++) {
-      shadows[i] = static_cast<int>(random_double(0,2));
+  traceSamples(scene, cam, image, 0, INITIAL_RAYS_PER_PIXEL, &gbuffer);
+
+  for (int x = 0; x<WIDTH; x++) {
+    for (int y = 0; y<HEIGHT; y++) {
+      (*image)[x][y] = (*image)[x][y]/INITIAL_RAYS_PER_PIXEL;
+      (*gbuffer)[x][y] = (*gbuffer)[x][y]/INITIAL_RAYS_PER_PIXEL;
     }
+  }
 
-    cl_float3* imageOut = new cl_float3[len];
+  const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << "Bidirectional: " << elapsed.count() << "ms" << std::endl;
 
-    // construct device representations
-    cl::Buffer objBuf(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-      sceneLen*sizeof(cl_Obj), objs_host);
+  return image;
+}
 
-    cl::Buffer matBuf(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-      sceneLen*sizeof(cl_Material), mats_host);
+// whether SHADING_SUBSET shades pixel (x, y) in pass, every pixel is shaded
+// once per period passes
+auto inSubset(int x, int y, int pass) -> bool {
+  if constexpr(SHADING_SUBSET == checkerboard) {
+    return (x + y + pass) % 2 == 0;
+  } else if constexpr(SHADING_SUBSET == half_resolution) {
+    // opposite corners of the quad first, so two passes are already a checkerboard
+    constexpr int order[] = {0, 3, 1, 2};
+    return x%2 + 2*(y%2) == order[pass%4];
+  }
+  return true;
+}
 
-    cl::Buffer rayBuf(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
-      raysLen*sizeof(cl_Ray), rays_host);
+// Renders SUBSET_PASSES passes, each shading INITIAL_RAYS_PER_PIXEL samples at
+// the pixels inSubset() picks. A pixel not shaded yet is a weighted mean of
+// shaded ones in its 3x3 neighbourhood: only those whose first hit is the same
+// object count, less the more their depth and normal differ.
+auto subsetTrace(const scene_t& scene, const camera& cam, gbuffer_t& gbuffer) -> array_t {
+  auto ids = std::make_unique<std::array<std::array<int, HEIGHT>, WIDTH>>();
+  auto sum = std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>();
+  auto counts = std::make_unique<std::array<std::array<int, HEIGHT>, WIDTH>>();
+  auto image = std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>();
 
-    cl::Buffer jitterBuf(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-      raysLen*sizeof(cl_float3), jitter_host);
+  if constexpr(EXEC==openmp) {
+    omp_set_num_threads(12);
+  }
 
-    cl::Buffer shadowBuf(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-      INITIAL_RAYS_PER_PIXEL*sizeof(cl_int), shadows);
+  const auto start = std::chrono::steady_clock::now();
 
-    cl::Buffer imageBuf(context, CL_MEM_WRITE_ONLY, len*sizeof(cl_float3));
+  if constexpr(TYPE == distributed && IRRADIANCE_CACHE) {
+    seedIrradianceCache(scene, cam);
+  }
 
-    kernel.setArg(0, objBuf);
-    kernel.setArg(1, matBuf);
-    kernel.setArg(2, sceneLen);
-    kernel.setArg(3, rayBuf);
-    kernel.setArg(4, INITIAL_RAYS_PER_PIXEL);
-    kernel.setArg(5, jitterBuf); // random seed
-    kernel.setArg(6, shadowBuf);
-    kernel.setArg(7, imageBuf);
-    kernel.setArg(9, MAX_RAY_DEPTH_PER_PIXEL);
+  // through the pixel centres, also the denoiser's features
+  #pragma omp parallel for collapse(2) schedule(dynamic) if(EXEC==openmp)
+  for (int x = 0; x<WIDTH; x++) {
+    for (int y = 0; y<HEIGHT; y++) {
+      (*ids)[x][y] = firstHit(rayDir(cam, 90.0, x, y), scene, (*gbuffer)[x][y]);
+    }
+  }
+
+  long long shaded = 0;
 
-    // execute tracing
-    cl::CommandQueue queue(context, device);
+  for (int pass = 0; pass<SUBSET_PASSES; pass++) {
+    #pragma omp parallel for collapse(2) schedule(dynamic) reduction(+:shaded) if(EXEC==openmp)
+    for (int x = 0; x<WIDTH; x++) {
+      for (int y = 0; y<HEIGHT; y++) {
+        if (!inSubset(x, y, pass)) {
+          continue;
+        }
 
-    auto global_work_size = len;
-    auto local_work_size = 4;
+        point pixel = (*sum)[x][y];
+        const int first = (*counts)[x][y];
 
-    for (int i=0; i<MAX_RAY_DEPTH_PER_PIXEL; i++) {
-      kernel.setArg(8, i);
-      result = queue.enqueueNDRangeKernel(kernel, 0, global_work_size, local_work_size);
-      checkErr("Could not enqueue Kernel: ", result);
+        for (int ray_i = first; ray_i < first+INITIAL_RAYS_PER_PIXEL; ray_i++) {
+          auto s = sampler(x, y, ray_i);
+          const auto [jitter_x, jitter_y] = (TYPE==distributed && SAMPLER==uniform)
+            ? get_grid_value(ray_i % (GRID_SIZE*GRID_SIZE)) : s.get2D();
+
+          const ray r = rayDir(cam, 90.0, x+jitter_x-0.5, y+jitter_y-0.5);
+          pixel = pixel + rayCast(r, scene, MAX_RAY_DEPTH_PER_PIXEL, s);
+        }
+
+        (*sum)[x][y] = pixel;
+        (*counts)[x][y] = first + INITIAL_RAYS_PER_PIXEL;
+        shaded++;
+      }
     }
 
-    // read and paste image
-    result = queue.enqueueReadBuffer(imageBuf, CL_TRUE, 0, len*sizeof(cl_float3), imageOut);
-    checkErr("Could not enqueue read: ", result);
+    #pragma omp parallel for collapse(2) if(EXEC==openmp)
+    for (int x = 0; x<WIDTH; x++) {
+      for (int y = 0; y<HEIGHT; y++) {
+        if ((*counts)[x][y] > 0) {
+          (*image)[x][y] = (*sum)[x][y]/(*counts)[x][y]*255;
+          continue;
+        }
+
+        const features& f = (*gbuffer)[x][y];
+        point colour = point(0,0,0);
+        pos_type weights = 0;
+        point fallback = point(0,0,0);
+        pos_type fallback_weights = 0;
+
+        for (int nx = std::max(x-1, 0); nx <= std::min(x+1, WIDTH-1); nx++) {
+          for (int ny = std::max(y-1, 0); ny <= std::min(y+1, HEIGHT-1); ny++) {
+            if ((*counts)[nx][ny] == 0) {
+              continue;
+            }
+
+            const point c = (*sum)[nx][ny]/(*counts)[nx][ny];
+            const features& n = (*gbuffer)[nx][ny];
+            // edge neighbours are closer than corners
+            pos_type w = (nx == x || ny == y) ? 1.0 : 0.5;
+
+            fallback = fallback + c*w;
+            fallback_weights += w;
+
+            if ((*ids)[nx][ny] != (*ids)[x][y]) {
+              continue;
+            }
+
+            if ((*ids)[x][y] >= 0) {
+              w *= std::exp(-std::abs(n.depth - f.depth) / (0.05*f.depth))
+                * std::pow(std::max(dot(n.normal, f.normal), 0.0), 16);
+            }
+
+            colour = colour + c*w;
+            weights += w;
+          }
+        }
 
-    for (int row=0; row<WIDTH; row++) {
-      for (int col=0; col<HEIGHT; col++) {
-        const int index = row * WIDTH + col;
-        (*image)[row][col].x = imageOut[index].s[0];
-        (*image)[row][col].y = imageOut[index].s[1];
-        (*image)[row][col].z = imageOut[index].s[2];
+        // nothing alike nearby, a thin object only this pixel sees
+        (*image)[x][y] = (weights > 0 ? colour/weights : fallback/fallback_weights)*255;
       }
     }
 
-    delete [] jitter_host;
-    delete [] shadows;
-    delete [] objs_host;
-    delete [] rays_host;
-    delete [] imageOut;
+    savePreview(image);
+
+    const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "Subset pass " << pass << ": " << elapsed.count() << "ms" << std::endl;
   }
 
+  std::cout << "Shaded " << shaded*INITIAL_RAYS_PER_PIXEL << " samples, "
+            << 100.0*shaded / (WIDTH*HEIGHT) << "% of a full render" << std::endl;
+
   return image;
 }
 
-auto distTrace(std::vector<std::shared_ptr<object>> scene) -> array_t {
-  auto image = std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>();
+// Traces every sample of the tiles marked in retrace into cache.image and
+// records what each one shaded. A pixel's samples are its own, so a tile
+// traced again in an unchanged scene comes out the same.
+auto traceTiles(const scene_t& scene, const camera& cam, edit_cache& cache, const std::vector<char>& retrace) -> void {
+  constexpr int tiles_x = (WIDTH + EDIT_TILE - 1) / EDIT_TILE;
+  constexpr int tiles = tiles_x * ((HEIGHT + EDIT_TILE - 1) / EDIT_TILE);
+
+  #pragma omp parallel for schedule(dynamic) if(EXEC==openmp)
+  for (int tile = 0; tile<tiles; tile++) {
+    if (!retrace[tile]) {
+      continue;
+    }
 
-  if constexpr(EXEC==seq) {
-    for (int x = 0; x<WIDTH; x++) {
-      for (int y = 0; y<HEIGHT; y++) {
-        point pixel = point(0,0,0);
+    const int x0 = (tile % tiles_x) * EDIT_TILE;
+    const int y0 = (tile / tiles_x) * EDIT_TILE;
+    uint64_t mask = 0;
+    recordTouched(&mask);
 
-        // scatter within pixel grid
-        for (int ray_i = 0; ray_i < GRID_SIZE*GRID_SIZE; ray_i++) {
+    for (int x = x0; x<std::min(x0 + EDIT_TILE, WIDTH); x++) {
+      for (int y = y0; y<std::min(y0 + EDIT_TILE, HEIGHT); y++) {
+        point pixel = point(0,0,0);
 
-          const auto [ray_x, ray_y] = get_grid_value(ray_i);
+        for (int ray_i = 0; ray_i < INITIAL_RAYS_PER_PIXEL; ray_i++) {
+          auto s = sampler(x, y, ray_i);
+          const auto [jitter_x, jitter_y] = s.get2D();
 
-          const ray r = rayDir(90.0, (x+ray_x)-0.5, (y+ray_y)-0.5);
-          pixel = pixel + rayCast(r, scene, MAX_RAY_DEPTH_PER_PIXEL);
+          const ray r = rayDir(cam, 90.0, x+jitter_x-0.5, y+jitter_y-0.5);
+          pixel = pixel + rayCast(r, scene, MAX_RAY_DEPTH_PER_PIXEL, s);
         }
 
-        (*image)[x][y] = (pixel/(GRID_SIZE*GRID_SIZE))*255;
+        (*cache.image)[x][y] = (pixel/INITIAL_RAYS_PER_PIXEL)*255;
       }
     }
 
-  } else if constexpr(EXEC==openmp) {
+    recordTouched(nullptr);
+    cache.touched[tile] = mask;
+  }
+}
 
-    omp_set_num_threads(12);
+// Applies edit to objects and brings cache up to date with it. Only the tiles
+// whose paths shaded the edited object are traced again: materials don't move
+// anything, so every ray elsewhere hits the same surfaces with the same
+// samples. Returns how many tiles were traced
+auto applyEdit(const std::vector<std::shared_ptr<object>>& objects, const std::vector<light>& lights, const camera& cam,
+               edit_cache& cache, const material_edit& edit) -> int {
+  if (edit.object >= objects.size()) {
+    throw std::runtime_error("No object " + std::to_string(edit.object) + " to edit, the scene has "
+                             + std::to_string(objects.size()));
+  }
+
+  object& obj = *objects[edit.object];
+  obj.colour = edit.colour;
+  obj.specular = edit.specular;
+  obj.diffuse = edit.diffuse;
+
+  std::vector<char> retrace(cache.touched.size());
+  int count = 0;
+  for (size_t tile = 0; tile<retrace.size(); tile++) {
+    retrace[tile] = (cache.touched[tile] & objectBit(edit.object)) != 0;
+    count += retrace[tile];
+  }
+
+  traceTiles(scene_t(objects, lights), cam, cache, retrace);
+  return count;
+}
+
+// Renders the scene once, then edits the material of each object in turn as
+// a lighter would, keeping the earlier changes: colour channels rotated and
+// specular flipped
+auto editSession(const std::vector<std::shared_ptr<object>>& objects, const std::vector<light>& lights) -> void {
+  constexpr int tiles = ((WIDTH + EDIT_TILE - 1) / EDIT_TILE) * ((HEIGHT + EDIT_TILE - 1) / EDIT_TILE);
+  const camera cam{};
+
+  edit_cache cache{uninitialisedImage(), std::vector<uint64_t>(tiles)};
+
+  auto start = std::chrono::steady_clock::now();
+  traceTiles(scene_t(objects, lights), cam, cache, std::vector<char>(tiles, true));
+  const std::chrono::duration<double, std::milli> full = std::chrono::steady_clock::now() - start;
+  std::cout << "Full render: " << tiles << " tiles in " << full.count() << "ms" << std::endl;
+
+  double skipped_total = 0;
+
+  for (size_t i = 0; i<objects.size(); i++) {
+    const object& obj = *objects[i];
+    const material_edit edit{i, point(obj.colour.z, obj.colour.x, obj.colour.y), 1 - obj.specular, obj.diffuse};
+
+    start = std::chrono::steady_clock::now();
+    const int count = applyEdit(objects, lights, cam, cache, edit);
+    const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    const double skipped = 1 - static_cast<double>(count) / tiles;
+    skipped_total += skipped;
+    std::cout << "Edit object " << i << ": " << count << "/" << tiles << " tiles re-traced, "
+              << skipped*100 << "% skipped, " << elapsed.count() << "ms" << std::endl;
+  }
+
+  if (!objects.empty()) {
+    std::cout << "Mean skipped: " << skipped_total / objects.size() * 100 << "%" << std::endl;
+  }
+
+  output_pipeline out(std::string("output.") + OUTPUT_FORMAT);
+  out.push(cache.image, 0, HEIGHT);
+  out.finish();
+}
+
+// Renders passes over every pixel until stop is requested, one sample each,
+// or INITIAL_RAYS_PER_PIXEL on OpenCL. Only complete passes go into the image,
+// so it is always normalised by the spp it returns. The first pass always
+// finishes; a later one is not started when the last pass says it would end
+// past the deadline, and is abandoned if it does.
+auto deadlineTrace(const scene_t& scene, const camera& cam, gbuffer_t& gbuffer, const render_stop& stop, int& spp) -> array_t {
+  static_assert(DEADLINE_SECONDS == 0 || !(EXEC == opencl && TYPE == distributed),
+                "deadline renders need traceSamples, which has no OpenCL distributed tracer");
+  constexpr int pass = DEVICE_TRACE ? INITIAL_RAYS_PER_PIXEL : 1;
+  auto sum = std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>();
+  auto next = std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>();
+  const auto start = std::chrono::steady_clock::now();
+
+  if constexpr(TYPE == distributed && IRRADIANCE_CACHE && EXEC != opencl) {
+    seedIrradianceCache(scene, cam);
+  }
+
+  // features come from the first pass alone
+  traceSamples(scene, cam, sum, 0, pass, &gbuffer);
+  spp = pass;
+  std::chrono::duration<double> last = std::chrono::steady_clock::now() - start;
+
+  while (!stop.requested(last)) {
+    const auto pass_start = std::chrono::steady_clock::now();
+
+    for (auto& column : *next) {
+      column.fill(point(0,0,0));
+    }
+
+    if (!traceSamples(scene, cam, next, spp, pass, nullptr, &stop)) {
+      break;
+    }
 
-    // collapse only valid when width == height
-    #pragma omp parallel for collapse(2)
     for (int x = 0; x<WIDTH; x++) {
       for (int y = 0; y<HEIGHT; y++) {
-        point pixel = point(0,0,0);
+        (*sum)[x][y] += (*next)[x][y];
+      }
+    }
+
+    spp += pass;
+    last = std::chrono::steady_clock::now() - pass_start;
+  }
+
+  for (int x = 0; x<WIDTH; x++) {
+    for (int y = 0; y<HEIGHT; y++) {
+      (*sum)[x][y] = (*sum)[x][y]/spp;
+      (*gbuffer)[x][y] = (*gbuffer)[x][y]/pass;
+    }
+  }
+
+  const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << "Deadline: " << spp << " spp in " << elapsed.count() << "ms"
+            << (stop.cancel ? ", cancelled" : "") << std::endl;
 
-        // scatter within pixel grid
-        #pragma omp parallel for reduction(pointAdd : pixel)
-        for (int ray_i = 0; ray_i < GRID_SIZE*GRID_SIZE; ray_i++) {
+  return sum;
+}
 
-          const auto [ray_x, ray_y] = get_grid_value(ray_i);
+auto distTrace(const scene_t& scene, const camera& cam, gbuffer_t& gbuffer, output_pipeline* out) -> array_t {
+  auto image = (EXEC == opencl) ? std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>() : uninitialisedImage();
+  constexpr int bands = (HEIGHT + OUTPUT_BAND_ROWS - 1) / OUTPUT_BAND_ROWS;
+
+  if constexpr(IRRADIANCE_CACHE && EXEC != opencl) {
+    seedIrradianceCache(scene, cam);
+  }
 
-          const ray r = rayDir(90.0, (x+ray_x)-0.5, (y+ray_y)-0.5);
-          pixel += rayCast(r, scene, MAX_RAY_DEPTH_PER_PIXEL);
+  if constexpr(EXEC==seq) {
+    for (int band = 0; band<bands; band++) {
+      const int y0 = band*OUTPUT_BAND_ROWS;
+      const int y1 = std::min(y0 + OUTPUT_BAND_ROWS, HEIGHT);
+
+      for (int x = 0; x<WIDTH; x++) {
+        for (int y = y0; y<y1; y++) {
+          point pixel = point(0,0,0);
+          features pixel_features;
+
+          // scatter within pixel grid
+          for (int ray_i = 0; ray_i < GRID_SIZE*GRID_SIZE; ray_i++) {
+            auto s = sampler(x, y, ray_i);
+            const auto [ray_x, ray_y] = (SAMPLER==uniform) ? get_grid_value(ray_i) : s.get2D();
+            features sample_features;
+
+            const ray r = rayDir(cam, 90.0, (x+ray_x)-0.5, (y+ray_y)-0.5);
+            pixel = pixel + rayCast(r, scene, MAX_RAY_DEPTH_PER_PIXEL, s, DENOISE ? &sample_features : nullptr);
+            pixel_features += sample_features;
+          }
+
+          (*image)[x][y] = (pixel/(GRID_SIZE*GRID_SIZE))*255;
+          (*gbuffer)[x][y] = pixel_features/(GRID_SIZE*GRID_SIZE);
         }
+      }
 
-        (*image)[x][y] = (pixel/(GRID_SIZE*GRID_SIZE))*255;
+      if (out) {
+        out->push(image, y0, y1);
       }
     }
 
+  } else if constexpr(EXEC==openmp) {
+
+    renderBands(scene, image, out, [&](const scene_t& node_scene, int x0, int x1, int y0, int y1) {
+      for (int x = x0; x<x1; x++) {
+        for (int y = y0; y<y1; y++) {
+          point pixel = point(0,0,0);
+          features pixel_features;
+
+          // scatter within pixel grid
+          #pragma omp parallel for reduction(pointAdd : pixel) reduction(featureAdd : pixel_features)
+          for (int ray_i = 0; ray_i < GRID_SIZE*GRID_SIZE; ray_i++) {
+            auto s = sampler(x, y, ray_i);
+            const auto [ray_x, ray_y] = (SAMPLER==uniform) ? get_grid_value(ray_i) : s.get2D();
+            features sample_features;
+
+            const ray r = rayDir(cam, 90.0, (x+ray_x)-0.5, (y+ray_y)-0.5);
+            pixel += rayCast(r, node_scene, MAX_RAY_DEPTH_PER_PIXEL, s, DENOISE ? &sample_features : nullptr);
+            pixel_features += sample_features;
+          }
+
+          (*image)[x][y] = (pixel/(GRID_SIZE*GRID_SIZE))*255;
+          (*gbuffer)[x][y] = pixel_features/(GRID_SIZE*GRID_SIZE);
+        }
+      }
+    });
+
   } else if constexpr(EXEC==opencl) {
     // NYI
   }
@@ -372,37 +1005,304 @@ auto distTrace(std::vector<std::shared_ptr<object>> scene) -> array_t {
   return image;
 }
 
-auto checkErr(std::string ctx, cl_int err) -> void {
-  if (err) {
-    std::cerr << ctx << err << std::endl;
-    exit(-1);
+// one centred ray on a coarse pixel grid, so the cache fills evenly instead of
+// in scan order and the full pass mostly interpolates
+auto seedIrradianceCache(const scene_t& scene, const camera& cam) -> void {
+  constexpr int cols = WIDTH/IRRADIANCE_CACHE_SPACING;
+  constexpr int rows = HEIGHT/IRRADIANCE_CACHE_SPACING;
+
+  if constexpr(EXEC==openmp) {
+    omp_set_num_threads(12);
+  }
+
+  #pragma omp parallel for collapse(2) schedule(dynamic) if(EXEC==openmp)
+  for (int col = 0; col<cols; col++) {
+    for (int row = 0; row<rows; row++) {
+      const int x = col*IRRADIANCE_CACHE_SPACING + IRRADIANCE_CACHE_SPACING/2;
+      const int y = row*IRRADIANCE_CACHE_SPACING + IRRADIANCE_CACHE_SPACING/2;
+
+      auto s = sampler(x, y, 0);
+      const ray r = rayDir(cam, 90.0, x, y);
+      rayCast(r, scene, MAX_RAY_DEPTH_PER_PIXEL, s);
+    }
   }
 }
 
-auto checkBuildErr(cl::Program prog, cl_int err) -> void {
-  if (err) {
-    std::cerr << "Could not build program: " << err << std::endl;
+// adds samples [first, first+count) of every pixel to sum, on the 0-255 scale,
+// and their first-hit features to gbuffer if given (CPU only). The OpenCL
+// tracer only works in whole INITIAL_RAYS_PER_PIXEL batches, and only for
+// DEVICE_TRACE; everything else is traced on the CPU.
+// stop, if given, abandons the samples part way; pixels already traced keep
+// theirs, so the caller discards sum when this returns false
+auto traceSamples(const scene_t& scene, const camera& cam, array_t& sum, int first, int count, gbuffer_t* gbuffer,
+                  const render_stop* stop) -> bool {
+  if constexpr(EXEC==opencl && TYPE==distributed) {
+    // NYI, as in distTrace. Returning would pass off an empty sum as traced
+    throw std::runtime_error("Distributed tracing has no OpenCL version, build it with EXEC = seq or openmp");
+
+  } else if constexpr(DEVICE_TRACE) {
+    gbuffer_t batch_gbuffer = std::make_unique<std::array<std::array<features, HEIGHT>, WIDTH>>();
+
+    for (int batch = first; batch < first+count; batch += INITIAL_RAYS_PER_PIXEL) {
+      const auto image = pathCL(pathCLState(scene), scene, cam, batch_gbuffer, batch, stop);
+      if (!image) {
+        return false;
+      }
+
+      for (int x = 0; x<WIDTH; x++) {
+        for (int y = 0; y<HEIGHT; y++) {
+          (*sum)[x][y] += (*image)[x][y]*INITIAL_RAYS_PER_PIXEL;
+          if (gbuffer) {
+            (**gbuffer)[x][y] += (*batch_gbuffer)[x][y]*INITIAL_RAYS_PER_PIXEL;
+          }
+        }
+      }
+    }
+
+  } else {
+    if constexpr(EXEC!=seq) {
+      omp_set_num_threads(12);
+    }
+
+    std::atomic<bool> stopped = false;
+
+    // bidirectional light paths can land on any pixel, so they are kept
+    // apart until every thread is done
+    std::optional<bidirectional_tracer> bdpt;
+    std::optional<splat_film> splats;
+    if constexpr(TYPE==bidirectional) {
+      bdpt.emplace(scene, cam);
+      splats.emplace();
+    }
+
+    #pragma omp parallel for collapse(2) schedule(dynamic) if(EXEC!=seq)
+    for (int x = 0; x<WIDTH; x++) {
+      for (int y = 0; y<HEIGHT; y++) {
+        if (stop && (stopped.load(std::memory_order_relaxed) || stop->requested())) {
+          stopped.store(true, std::memory_order_relaxed);
+          continue;
+        }
+
+        point pixel = point(0,0,0);
+        features pixel_features;
+
+        for (int ray_i = first; ray_i < first+count; ray_i++) {
+          auto s = sampler(x, y, ray_i);
+          const auto [jitter_x, jitter_y] = (TYPE==distributed && SAMPLER==uniform)
+            ? get_grid_value(ray_i % (GRID_SIZE*GRID_SIZE)) : s.get2D();
+          features sample_features;
+
+          if constexpr(TYPE==bidirectional) {
+            pixel = pixel + bdpt->sample(x+jitter_x-0.5, y+jitter_y-0.5, s, *splats, (DENOISE && gbuffer) ? &sample_features : nullptr);
+          } else {
+            const ray r = rayDir(cam, 90.0, x+jitter_x-0.5, y+jitter_y-0.5);
+            pixel = pixel + rayCast(r, scene, MAX_RAY_DEPTH_PER_PIXEL, s, (DENOISE && gbuffer) ? &sample_features : nullptr);
+          }
+          pixel_features += sample_features;
+        }
 
-    std::string build_log = prog.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+        (*sum)[x][y] += pixel*255;
+        if (gbuffer) {
+          (**gbuffer)[x][y] += pixel_features;
+        }
+      }
+    }
 
-    std::cerr << "Build log:" << std::endl;
-    std::cerr << build_log << std::endl;
+    if (splats && !stopped) {
+      for (int x = 0; x<WIDTH; x++) {
+        for (int y = 0; y<HEIGHT; y++) {
+          (*sum)[x][y] += splats->at(x, y)*255;
+        }
+      }
+    }
 
-    exit(-1);
+    return !stopped;
   }
+
+  return true;
 }
 
-auto loadKernel(std::string file) -> std::string {
-  std::ifstream kernel_s(file);
-  std::stringstream buf;
-  buf << kernel_s.rdbuf();
-  std::string kernel_src = buf.str();
+// Everything that changes a converged image of scene: its primitives,
+// materials and lights, the camera, and the settings the tracers read. Keys
+// the convergence benchmark's reference files
+auto referenceKey(const scene_t& scene, const camera& cam) -> std::string {
+  std::stringstream key;
+  key << std::hexfloat;
+
+  const auto material = [&](const object& obj) {
+    key << " " << obj.colour << " " << obj.specular << " " << obj.diffuse
+        << " " << obj.texture << " " << obj.texture_scale << "\n";
+  };
+
+  for (const sphere& obj : scene.spheres()) {
+    key << "sphere " << obj.centre << " " << obj.radius;
+    material(obj);
+  }
+  for (const plane& obj : scene.planes()) {
+    key << "plane " << obj.vertex << " " << obj.normal;
+    material(obj);
+  }
+  for (const sdf& obj : scene.sdfs()) {
+    key << "sdf";
+    for (const sdf_node& node : obj.program) {
+      key << " " << node.op << " " << node.centre << " " << node.size << " " << node.k;
+    }
+    material(obj);
+  }
+  for (const light& l : scene.lights()) {
+    key << "light " << l.shape << " " << l.pos << " " << l.emission << " " << l.radius
+        << " " << l.edge_u << " " << l.edge_v << "\n";
+  }
+
+  key << "camera " << cam.pos << " " << cam.yaw << "\n"
+      << "depth " << MAX_RAY_DEPTH_PER_PIXEL << "\n"
+      << "texture " << FLOOR_TEXTURE << " " << TEXTURE_BOUNCE_SPREAD << "\n"
+      << "environment " << ENVIRONMENT_MAP << " " << ENVIRONMENT_SCALE << "\n"
+      << "sdf " << SDF_MAX_STEPS << " " << SDF_HIT_DISTANCE << "\n";
+
+  // the cache interpolates, so its image converges somewhere else
+  if constexpr(TYPE == distributed) {
+    key << "irradiance " << IRRADIANCE_CACHE << " " << IRRADIANCE_CACHE_ERROR << " " << IRRADIANCE_CACHE_SPACING << "\n";
+  } else if constexpr(TYPE == bidirectional) {
+    key << "bdpt " << BDPT_GLOSSY_EXPONENT << " " << BDPT_LIGHT_RADIANCE << "\n";
+  }
+
+  return key.str();
+}
+
+// Equal-time convergence. Every standard scene gets a high-spp reference,
+// rendered once and cached next to the binary under a hash of referenceKey().
+// Then one run adds samples until it has passed every budget in
+// CONVERGENCE_BUDGETS, and records the error of the running estimate at each
+// one. TYPE and EXEC are compile time, so each build appends its own curve to
+// CONVERGENCE_CSV.
+auto convergenceBenchmark() -> void {
+  static_assert(!CONVERGENCE || !(EXEC == opencl && TYPE == distributed),
+                "a distributed OpenCL build has no tracer to time or to render the reference with");
+
+  struct bench_scene {
+    std::string name;
+    scene_t scene;
+    camera cam;
+  };
+
+  // many lights against the fixed one, and a signed distance object
+  constexpr int bench_lights = 100;
+
+  std::vector<bench_scene> scenes;
+  scenes.push_back(bench_scene{"default", scene_t(createScene(false), createLights(0)), camera{}});
+  scenes.push_back(bench_scene{"lights_" + std::to_string(bench_lights),
+                               scene_t(createScene(false), createLights(bench_lights)), camera{}});
+  scenes.push_back(bench_scene{"sdf", scene_t(createScene(true), createLights(0)), camera{}});
+
+  constexpr bool guided = TYPE == path && PATH_GUIDING && EXEC != opencl;
+  constexpr const char* type_name = (TYPE == path) ? "path" : (TYPE == distributed ? "distributed" : "bidirectional");
+  constexpr const char* method_name = guided ? "path_guided" : type_name;
+  constexpr const char* exec_names[] = {"seq", "openmp", "opencl"};
+  constexpr int pass = DEVICE_TRACE ? INITIAL_RAYS_PER_PIXEL : 1;
+  constexpr int reference_spp = (CONVERGENCE_REFERENCE_SPP + pass - 1) / pass * pass;
+
+  const bool new_csv = !std::ifstream(CONVERGENCE_CSV).good();
+  std::ofstream csv(CONVERGENCE_CSV, std::ofstream::app);
+  if (new_csv) {
+    csv << "scene,type,exec,budget_s,time_s,spp,rmse,relmse,psnr\n";
+  }
+
+  for (const auto& bench : scenes) {
+    // a changed scene or setting hashes to a new file, never a stale one
+    std::stringstream ref_file;
+    ref_file << "reference_" << bench.name << "_" << type_name << "_" << WIDTH << "x" << HEIGHT
+             << "_" << reference_spp << "_" << std::hex << hashString(referenceKey(bench.scene, bench.cam)) << ".bin";
+
+    auto reference = std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>();
+    std::ifstream cached(ref_file.str(), std::ifstream::binary);
+
+    if (cached.read(reinterpret_cast<char*>(reference->data()), sizeof(*reference))) {
+      std::cout << "Reference: " << ref_file.str() << std::endl;
+
+    } else {
+      std::cout << "Rendering reference at " << reference_spp << " spp" << std::endl;
+
+      auto sum = std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>();
+      clearIrradianceCache();
+      if constexpr(TYPE == distributed && IRRADIANCE_CACHE && EXEC != opencl) {
+        seedIrradianceCache(bench.scene, bench.cam);
+      }
+
+      if constexpr(guided) {
+        resetPathGuide(bench.scene);
+      }
+
+      for (int first = 0; first < reference_spp; first += 16*pass) {
+        const int count = std::min(16*pass, reference_spp - first);
+        traceSamples(bench.scene, bench.cam, sum, first, count);
+
+        if constexpr(guided) {
+          trainPathGuide(first + count);
+        }
+      }
+
+      for (int x = 0; x<WIDTH; x++) {
+        for (int y = 0; y<HEIGHT; y++) {
+          (*reference)[x][y] = (*sum)[x][y] / reference_spp;
+        }
+      }
+
+      std::ofstream(ref_file.str(), std::ofstream::binary)
+        .write(reinterpret_cast<const char*>(reference->data()), sizeof(*reference));
+    }
+
+    // the cache would carry the reference's lighting into the timed run
+    clearIrradianceCache();
+
+    auto sum = std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>();
+    auto estimate = std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>();
+    std::chrono::duration<double> traced{0};
+    int spp = 0;
+
+    const auto seed_start = std::chrono::steady_clock::now();
+    if constexpr(TYPE == distributed && IRRADIANCE_CACHE && EXEC != opencl) {
+      seedIrradianceCache(bench.scene, bench.cam);
+    }
+    if constexpr(guided) {
+      resetPathGuide(bench.scene);
+    }
+    traced += std::chrono::steady_clock::now() - seed_start;
+
+    for (double budget : CONVERGENCE_BUDGETS) {
+      // only tracing is timed, not the error evaluation
+      while (spp == 0 || traced.count() < budget) {
+        const auto start = std::chrono::steady_clock::now();
+        traceSamples(bench.scene, bench.cam, sum, spp, pass);
+        spp += pass;
+
+        if constexpr(guided) {
+          trainPathGuide(spp);
+        }
+
+        traced += std::chrono::steady_clock::now() - start;
+      }
+
+      for (int x = 0; x<WIDTH; x++) {
+        for (int y = 0; y<HEIGHT; y++) {
+          (*estimate)[x][y] = (*sum)[x][y] / spp;
+        }
+      }
+
+      const image_error error = imageError(estimate, reference);
+
+      csv << bench.name << "," << method_name << "," << exec_names[EXEC] << ","
+          << budget << "," << traced.count() << "," << spp << ","
+          << error.rmse << "," << error.relmse << "," << error.psnr << "\n";
 
-  return kernel_src;
+      std::cout << bench.name << " " << budget << "s: " << spp << " spp, rmse " << error.rmse
+                << ", relmse " << error.relmse << ", psnr " << error.psnr << "dB" << std::endl;
+    }
+  }
 }
 
-auto saveImage(array_t image) -> void {
-  auto output = EasyBMP::Image(WIDTH, HEIGHT, "output.bmp");
+auto saveImage(array_t image, std::string file) -> void {
+  auto output = EasyBMP::Image(WIDTH, HEIGHT, file);
 
   for (int x = 0; x<WIDTH; x++) {
     for (int y = 0; y<HEIGHT; y++) {
@@ -415,7 +1315,17 @@ auto saveImage(array_t image) -> void {
   output.Write();
 }
 
-auto createScene() -> std::vector<std::shared_ptr<object>> {
+// written to a temporary and renamed over PREVIEW_FILE, so a viewer polling
+// the file never reads a partial image
+auto savePreview(const array_t& image) -> void {
+  const std::string tmp = std::string(PREVIEW_FILE) + ".tmp";
+
+  saveImage(std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>(*image), tmp);
+  std::rename(tmp.c_str(), PREVIEW_FILE);
+}
+
+// the default scene, with_sdf adds the SDF_SCENE object
+auto createScene(bool with_sdf) -> std::vector<std::shared_ptr<object>> {
   auto scene = std::vector<std::shared_ptr<object>>();
 
   scene.push_back(std::make_shared<plane>(
@@ -425,6 +1335,10 @@ auto createScene() -> std::vector<std::shared_ptr<object>> {
     0.0,
     1.0
   ));
+  if (FLOOR_TEXTURE[0] != '\0') {
+    scene.back()->texture = loadTexture(FLOOR_TEXTURE);
+    scene.back()->texture_scale = FLOOR_TEXTURE_SCALE;
+  }
   scene.push_back(std::make_shared<sphere>(
     point(0,12,0),
     5.0,
@@ -483,5 +1397,80 @@ auto createScene() -> std::vector<std::shared_ptr<object>> {
     1.0
   ));
 
+  if (with_sdf) {
+    // a rippled ring melted onto a block on the floor, in postfix order
+    scene.push_back(std::make_shared<sdf>(
+      std::vector<sdf_node>{
+        {sdf_box, point(7,10,-2), point(1,1,1)},
+        {sdf_torus, point(7,10,-1), point(1.8,0.45,0)},
+        {sdf_displace, point(7,10,-1), point(0.08,0,0), 6.0},
+        {sdf_smooth_union, point(), point(), 0.6}
+      },
+      point(1, 0.6, 0.2),
+      0.3,
+      1.0
+    ));
+  }
+
   return scene;
 }
+
+// count small emitters over the default scene, a repeating point, sphere and
+// rect, each sending the same share of LIGHT_STRENGTH so any count lights the
+// scene about as brightly
+auto createLights(int count) -> std::vector<light> {
+  constexpr pos_type LIGHT_STRENGTH = 90.0;
+  constexpr pos_type PI = 3.14159265358979323;
+
+  std::mt19937 generator(count);
+  std::uniform_real_distribution<pos_type> unit(0.0, 1.0);
+
+  auto lights = std::vector<light>();
+
+  for (int i = 0; i<count; i++) {
+    const point pos = point(-20 + 40*unit(generator), 30*unit(generator), 4 + 8*unit(generator));
+    const point tint = point(0.6 + 0.4*unit(generator), 0.6 + 0.4*unit(generator), 0.6 + 0.4*unit(generator));
+    const point strength = tint * (LIGHT_STRENGTH / count);
+
+    switch (i % 3) {
+      case 0:
+        lights.push_back(light{point_light, pos, strength});
+        break;
+      case 1: {
+        const pos_type radius = 0.3;
+        lights.push_back(light{sphere_light, pos, strength / (PI*radius*radius), radius});
+        break;
+      }
+      case 2:
+        // one unit square facing down
+        lights.push_back(light{rect_light, pos, strength, 0, point(1,0,0), point(0,-1,0)});
+        break;
+    }
+  }
+
+  return lights;
+}
+
+// turntable around the red sphere while the small green sphere bounces,
+// frame 0 is the default view
+auto createSequence(size_t objects) -> std::vector<frame_desc> {
+  const point target = point(0,12,0);
+  const pos_type orbit = 12.0;
+
+  auto frames = std::vector<frame_desc>();
+
+  for (int f = 0; f<FRAMES; f++) {
+    const pos_type t = static_cast<pos_type>(f) / FRAMES;
+    const pos_type yaw = toRad(360.0*t);
+
+    frame_desc frame = frame_desc{
+      camera{target + point(orbit*std::sin(yaw), -orbit*std::cos(yaw), 0), yaw},
+      std::vector<point>(objects)
+    };
+    frame.offsets[5] = point(0, 0, 2.0*std::abs(std::sin(toRad(720.0*t))));
+
+    frames.push_back(frame);
+  }
+
+  return frames;
+}
@@ -0,0 +1,35 @@
+#include "metrics.hpp"
+
+#include <cmath>
+#include <limits>
+
+auto imageError(const array_t& image, const array_t& reference) -> image_error {
+  double squared = 0;
+  double relative = 0;
+
+  auto add = [&](double v, double ref) {
+    const double d = v - ref;
+    squared += d*d;
+    relative += d*d / (ref*ref + 0.01);
+  };
+
+  for (int x = 0; x<WIDTH; x++) {
+    for (int y = 0; y<HEIGHT; y++) {
+      const point a = (*image)[x][y] / 255;
+      const point r = (*reference)[x][y] / 255;
+
+      add(a.x, r.x);
+      add(a.y, r.y);
+      add(a.z, r.z);
+    }
+  }
+
+  constexpr double values = 3.0*WIDTH*HEIGHT;
+  const double rmse = std::sqrt(squared / values);
+
+  return image_error{
+    rmse,
+    relative / values,
+    rmse > 0 ? -20.0*std::log10(rmse) : std::numeric_limits<double>::infinity()
+  };
+}
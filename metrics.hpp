@@ -0,0 +1,14 @@
+#pragma once
+
+#include "image.hpp"
+
+// error of an image against a reference, both on the 0-255 scale. rmse and
+// psnr are taken on [0,1] values, relmse divides by reference^2 + 0.01 so
+// dark pixels count as much as bright ones
+struct image_error {
+  double rmse;
+  double relmse;
+  double psnr;
+};
+
+auto imageError(const array_t& image, const array_t& reference) -> image_error;
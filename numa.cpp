@@ -0,0 +1,125 @@
+#include "numa.hpp"
+
+#include <thread>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <sched.h>
+#include <algorithm>
+
+#include "common.hpp"
+#include "scene.hpp"
+
+namespace {
+
+// cpulist format, e.g. "0-11,24-35"
+auto parseCpuList(const std::string& list) -> std::vector<int> {
+  std::vector<int> cpus;
+  std::stringstream ranges(list);
+  std::string range;
+
+  while (std::getline(ranges, range, ',')) {
+    const size_t dash = range.find('-');
+    const int first = std::stoi(range.substr(0, dash));
+    const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash+1));
+
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+
+  return cpus;
+}
+
+auto detectNodes() -> std::vector<numa_node> {
+  std::vector<numa_node> nodes;
+
+  // node ids can have gaps, stop after a run of missing ones
+  for (int id = 0, missing = 0; missing < 8; id++) {
+    std::ifstream file("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+    std::string list;
+
+    if (!std::getline(file, list) || list.empty()) {
+      missing++;
+      continue;
+    }
+
+    missing = 0;
+    nodes.push_back(numa_node{id, parseCpuList(list)});
+  }
+
+  if (nodes.empty()) {
+    numa_node all{0, {}};
+    for (int cpu = 0; cpu < static_cast<int>(std::max(1u, std::thread::hardware_concurrency())); cpu++) {
+      all.cpus.push_back(cpu);
+    }
+    nodes.push_back(all);
+  }
+
+  return nodes;
+}
+
+}
+
+auto numaNodes() -> const std::vector<numa_node>& {
+  static const std::vector<numa_node> nodes = detectNodes();
+  return nodes;
+}
+
+auto threadPlacement(int threads) -> std::vector<thread_place> {
+  const auto& nodes = numaNodes();
+  std::vector<thread_place> places(threads, thread_place{0, -1});
+
+  if constexpr(PINNING == compact) {
+    // fill each node's cpus before using the next
+    int t = 0;
+    while (t < threads) {
+      for (size_t n = 0; n < nodes.size() && t < threads; n++) {
+        for (size_t c = 0; c < nodes[n].cpus.size() && t < threads; c++, t++) {
+          places[t] = thread_place{static_cast<int>(n), nodes[n].cpus[c]};
+        }
+      }
+    }
+
+  } else if constexpr(PINNING == spread) {
+    // even blocks of consecutive threads per node
+    for (int t = 0; t < threads; t++) {
+      const int n = static_cast<int>(static_cast<long>(t) * nodes.size() / threads);
+      const int first = static_cast<int>((static_cast<long>(n) * threads + nodes.size() - 1) / nodes.size());
+      const auto& cpus = nodes[n].cpus;
+      places[t] = thread_place{n, cpus[(t - first) % cpus.size()]};
+    }
+  }
+
+  return places;
+}
+
+// the calling thread's mask before pinThread() first changed it
+thread_local bool pinned = false;
+thread_local cpu_set_t unpinned_set;
+
+auto pinThread(int cpu) -> void {
+  if (cpu < 0) {
+    return;
+  }
+
+  if (!pinned) {
+    pinned = sched_getaffinity(0, sizeof(unpinned_set), &unpinned_set) == 0;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  sched_setaffinity(0, sizeof(set), &set);
+}
+
+auto unpinThread() -> void {
+  if (pinned) {
+    sched_setaffinity(0, sizeof(unpinned_set), &unpinned_set);
+    pinned = false;
+  }
+}
+
+auto replicateScene(const scene_t& scene) -> scene_t {
+  return scene_t(scene);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <vector>
+
+class scene_t;
+
+struct numa_node {
+  int id;
+  std::vector<int> cpus;
+};
+
+// where one render thread runs, node indexes numaNodes() and cpu is -1 when
+// the thread is left to the scheduler
+struct thread_place {
+  int node;
+  int cpu;
+};
+
+// nodes from /sys/devices/system/node, or a single node holding every cpu
+// when that is not available
+auto numaNodes() -> const std::vector<numa_node>&;
+
+// placement of threads render threads under PINNING
+auto threadPlacement(int threads) -> std::vector<thread_place>;
+// pins the calling thread to cpu, keeping the mask it had before the first
+// pin so unpinThread() can put it back. Threads that outlive a render, like
+// OpenMP's pool, must unpin or later work inherits the single cpu
+auto pinThread(int cpu) -> void;
+auto unpinThread() -> void;
+
+// deep copy of a scene, allocated on the node of the calling thread
+auto replicateScene(const scene_t& scene) -> scene_t;
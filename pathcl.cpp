@@ -0,0 +1,729 @@
+#include "pathcl.hpp"
+
+#include "scene.hpp"
+#include "sampler.hpp"
+#include "trace.hpp"
+#include "lights.hpp"
+#include "texture.hpp"
+#include "environment.hpp"
+#include "Structures/objects.hpp"
+#include "Structures/sdf.hpp"
+
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <optional>
+#include <iterator>
+#include <algorithm>
+#include <filesystem>
+
+cl::Device device;
+cl::Context context;
+
+namespace {
+
+// spheres are (centre, radius), planes (unit normal, distance along it)
+auto toCLPrim(const sphere& obj) -> cl_float4 {
+  return cl_float4{{
+    static_cast<cl_float>(obj.centre.x),
+    static_cast<cl_float>(obj.centre.y),
+    static_cast<cl_float>(obj.centre.z),
+    static_cast<cl_float>(obj.radius)
+  }};
+}
+
+auto toCLPrim(const plane& obj) -> cl_float4 {
+  const point n = obj.normal / obj.normal.length();
+  return cl_float4{{
+    static_cast<cl_float>(n.x),
+    static_cast<cl_float>(n.y),
+    static_cast<cl_float>(n.z),
+    static_cast<cl_float>(dot(n, obj.vertex))
+  }};
+}
+
+auto toCLMaterial(const object& obj) -> cl_Material {
+  return cl_Material{
+    colour: obj.colour.toFloat3(),
+    spec: static_cast<cl_float>(obj.specular),
+    diff: static_cast<cl_float>(obj.diffuse),
+    texture: obj.texture,
+    texture_scale: static_cast<cl_float>(obj.texture_scale)
+  };
+}
+
+auto toCLFloat4(point p, pos_type w) -> cl_float4 {
+  return cl_float4{{static_cast<cl_float>(p.x), static_cast<cl_float>(p.y), static_cast<cl_float>(p.z), static_cast<cl_float>(w)}};
+}
+
+// device primitives are spheres first, then signed distance objects, then
+// planes, so the kernels loop over each type without branching on it. A
+// signed distance primitive is the index of its program in nodes: a header of
+// (lower bound, node count), (upper bound, 1/lipschitz), then every node as
+// (centre, op), (size, k)
+auto toCLScene(const scene_t& scene, std::vector<cl_float4>& prims, std::vector<cl_Material>& mats,
+               std::vector<cl_float4>& nodes) -> void {
+  for (const sphere& obj : scene.spheres()) {
+    prims.push_back(toCLPrim(obj));
+    mats.push_back(toCLMaterial(obj));
+  }
+
+  for (const sdf& obj : scene.sdfs()) {
+    prims.push_back(cl_float4{{static_cast<cl_float>(nodes.size()), 0, 0, 0}});
+    mats.push_back(toCLMaterial(obj));
+
+    nodes.push_back(toCLFloat4(obj.lower(), obj.program.size()));
+    nodes.push_back(toCLFloat4(obj.upper(), 1 / obj.lipschitz()));
+    for (const sdf_node& n : obj.program) {
+      nodes.push_back(toCLFloat4(n.centre, n.op));
+      nodes.push_back(toCLFloat4(n.size, n.k));
+    }
+  }
+
+  for (const plane& obj : scene.planes()) {
+    prims.push_back(toCLPrim(obj));
+    mats.push_back(toCLMaterial(obj));
+  }
+}
+
+auto toCLLights(const scene_t& scene, std::vector<cl_Light>& lights, std::vector<cl_LightNode>& nodes) -> void {
+  for (const light& l : scene.lights()) {
+    lights.push_back(cl_Light{
+      {{static_cast<cl_float>(l.pos.x), static_cast<cl_float>(l.pos.y), static_cast<cl_float>(l.pos.z), static_cast<cl_float>(l.radius)}},
+      {{static_cast<cl_float>(l.emission.x), static_cast<cl_float>(l.emission.y), static_cast<cl_float>(l.emission.z), static_cast<cl_float>(l.shape)}},
+      {{static_cast<cl_float>(l.edge_u.x), static_cast<cl_float>(l.edge_u.y), static_cast<cl_float>(l.edge_u.z), 0}},
+      {{static_cast<cl_float>(l.edge_v.x), static_cast<cl_float>(l.edge_v.y), static_cast<cl_float>(l.edge_v.z), 0}}
+    });
+  }
+
+  for (const light_tree::node& n : scene.lightTree().nodes()) {
+    nodes.push_back(cl_LightNode{
+      {static_cast<cl_float>(n.lo.x), static_cast<cl_float>(n.lo.y), static_cast<cl_float>(n.lo.z)},
+      static_cast<cl_float>(n.power),
+      {static_cast<cl_float>(n.hi.x), static_cast<cl_float>(n.hi.y), static_cast<cl_float>(n.hi.z)},
+      n.child
+    });
+  }
+}
+
+// Every opened texture's tiles, read through the texture cache, from the
+// finest level that lets all of them fit in TEXTURE_ATLAS_BYTES. The atlas is
+// one uint per texel, tiles in the order of each texture's tiled file.
+auto toCLTextures(std::vector<cl_TextureInfo>& infos, std::vector<cl_uint>& atlas) -> void {
+  texture_cache& cache = textureCache();
+  constexpr size_t tile_texels = texture_cache::TILE*texture_cache::TILE;
+
+  const auto tilesFrom = [&](int first_level) {
+    size_t tiles = 0;
+    for (size_t t = 0; t<cache.size(); t++) {
+      const texture_info& info = cache.info(t);
+      tiles += info.tiles() - info.level_tile[std::min(first_level, info.levels-1)];
+    }
+    return tiles;
+  };
+
+  int first_level = 0;
+  while (tilesFrom(first_level)*tile_texels*sizeof(cl_uint) > TEXTURE_ATLAS_BYTES && tilesFrom(first_level+1) < tilesFrom(first_level)) {
+    first_level++;
+  }
+
+  for (size_t t = 0; t<cache.size(); t++) {
+    const texture_info& info = cache.info(t);
+    cl_TextureInfo cl_info{info.width, info.height, info.levels, std::min(first_level, info.levels-1), {}};
+
+    for (int level = cl_info.first_level; level<info.levels; level++) {
+      cl_info.level_tile[level] = atlas.size() / tile_texels;
+
+      for (int ty = 0; ty<info.tilesY(level); ty++) {
+        for (int tx = 0; tx<info.tilesX(level); tx++) {
+          const auto texels = cache.tile(t, level, tx, ty);
+          for (size_t i = 0; i<tile_texels; i++) {
+            const uint8_t* c = &(*texels)[i*4];
+            atlas.push_back(c[0] | (c[1] << 8) | (c[2] << 16) | (c[3] << 24));
+          }
+        }
+      }
+    }
+
+    infos.push_back(cl_info);
+  }
+
+  if (first_level > 0) {
+    std::cout << "Texture atlas: levels below " << first_level << " left out to fit" << std::endl;
+  }
+}
+
+// The environment's texels and both levels of alias tables, see
+// environment.hpp. Left empty when no map is loaded
+auto toCLEnvironment(std::vector<cl_float4>& texels, std::vector<cl_AliasEntry>& rows,
+                     std::vector<cl_AliasEntry>& columns) -> void {
+  const environment_map& env = environmentMap();
+  const auto toCL = [](const alias_table::entry& e) { return cl_AliasEntry{e.threshold, e.alias}; };
+
+  for (const point& texel : env.pixels()) {
+    texels.push_back(toCLFloat4(texel, 0));
+  }
+  std::transform(env.rows().entries().begin(), env.rows().entries().end(), std::back_inserter(rows), toCL);
+  std::transform(env.columns().begin(), env.columns().end(), std::back_inserter(columns), toCL);
+}
+
+auto sameFloat3(cl_float3 a, cl_float3 b) -> bool {
+  return a.s[0] == b.s[0] && a.s[1] == b.s[1] && a.s[2] == b.s[2];
+}
+
+auto samePrim(const cl_float4& a, const cl_float4& b) -> bool {
+  return a.s[0] == b.s[0] && a.s[1] == b.s[1] && a.s[2] == b.s[2] && a.s[3] == b.s[3];
+}
+
+auto sameMaterial(const cl_Material& a, const cl_Material& b) -> bool {
+  return a.spec == b.spec && a.diff == b.diff && sameFloat3(a.colour, b.colour)
+      && a.texture == b.texture && a.texture_scale == b.texture_scale;
+}
+
+// writes each run of records that differ from what the device holds, there is
+// no spatial index on the device so this is the whole refit
+template<typename T, typename Same>
+auto uploadChanged(cl::CommandQueue& queue, cl::Buffer& buf, std::vector<T>& held, const std::vector<T>& next, Same same) -> void {
+  size_t i = 0;
+
+  while (i < next.size()) {
+    if (same(held[i], next[i])) {
+      i++;
+      continue;
+    }
+
+    const size_t first = i;
+    while (i < next.size() && !same(held[i], next[i])) {
+      held[i] = next[i];
+      i++;
+    }
+
+    cl_int result = queue.enqueueWriteBuffer(buf, CL_FALSE, first*sizeof(T), (i-first)*sizeof(T), &held[first]);
+    checkErr("Could not enqueue write: ", result);
+  }
+}
+
+// the scene as literals for path.cl, hex floats so the baked values are
+// exactly the ones the buffers would hold
+auto specialisedScene(const path_cl& state) -> std::string {
+  std::stringstream src;
+  src << std::hexfloat;
+  src << "#define SPHERE_COUNT " << state.sphereCount << "\n";
+  src << "#define PRIM_COUNT " << state.prims.size() << "\n";
+
+  src << "#define SCENE_PRIMS {";
+  for (const auto& prim : state.prims) {
+    src << "(float4)(" << prim.s[0] << "f, " << prim.s[1] << "f, " << prim.s[2] << "f, " << prim.s[3] << "f), ";
+  }
+  src << "}\n";
+
+  src << "#define SCENE_MATS {";
+  for (const auto& mat : state.mats) {
+    src << "{(float3)(" << mat.colour.s[0] << "f, " << mat.colour.s[1] << "f, " << mat.colour.s[2] << "f), "
+        << mat.spec << "f, " << mat.diff << "f, " << mat.texture << ", " << mat.texture_scale << "f}, ";
+  }
+  src << "}\n";
+
+  return src.str();
+}
+
+// Builds src, reusing a binary from OPENCL_KERNEL_CACHE when the same source,
+// options and device were built before. Specialised sources carry the scene,
+// so the key is also the scene hash.
+auto buildProgram(const std::string& src, const std::string& options) -> cl::Program {
+  const std::string key = src + options + device.getInfo<CL_DEVICE_NAME>() + device.getInfo<CL_DRIVER_VERSION>();
+  std::stringstream file;
+  file << OPENCL_KERNEL_CACHE << "/" << std::hex << hashString(key) << ".bin";
+
+  std::ifstream cached(file.str(), std::ifstream::binary);
+  if (cached) {
+    std::vector<unsigned char> binary((std::istreambuf_iterator<char>(cached)), std::istreambuf_iterator<char>());
+    cl_int result;
+    cl::Program prog(context, {device}, cl::Program::Binaries{binary}, nullptr, &result);
+
+    if (result == CL_SUCCESS && prog.build({device}, options.c_str()) == CL_SUCCESS) {
+      return prog;
+    }
+  }
+
+  cl::Program prog(context, src);
+  cl_int result = prog.build({device}, options.c_str());
+  checkBuildErr(prog, result);
+
+  const auto binaries = prog.getInfo<CL_PROGRAM_BINARIES>();
+  if (!binaries.empty() && !binaries[0].empty()) {
+    std::filesystem::create_directories(OPENCL_KERNEL_CACHE);
+    std::ofstream(file.str(), std::ofstream::binary)
+      .write(reinterpret_cast<const char*>(binaries[0].data()), binaries[0].size());
+  }
+
+  return prog;
+}
+
+// one work item per element, the runtime picks the work group size. While
+// profiling, waits for the kernel and adds its device time to state.stats
+auto launch(path_cl& state, cl::Kernel& kernel, size_t items) -> void {
+  cl::Event event;
+  cl_int result = state.queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(items), cl::NullRange,
+                                                   nullptr, state.profile ? &event : nullptr);
+  checkErr("Could not enqueue Kernel: ", result);
+
+  if (state.profile) {
+    checkErr("Could not wait for Kernel: ", event.wait());
+
+    stage_stats& stage = state.stats[kernel.getInfo<CL_KERNEL_FUNCTION_NAME>().c_str()];
+    stage.launches++;
+    stage.items += items;
+    stage.ms += (event.getProfilingInfo<CL_PROFILING_COMMAND_END>()
+                 - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-6;
+  }
+}
+
+}
+
+// FNV-1a, keys the program binary cache
+auto hashString(const std::string& text) -> uint64_t {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (unsigned char c : text) {
+    hash = (hash ^ c) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// built on first use, later frames only upload what changed. A scene with
+// other object or light counts, like the convergence benchmark's next one,
+// gets new state
+auto pathCLState(const scene_t& scene) -> path_cl& {
+  static std::optional<path_cl> state;
+
+  if (!state || state->prims.size() != scene.size() || state->sphereCount != static_cast<cl_int>(scene.spheres().size())
+      || state->sdfCount != static_cast<cl_int>(scene.sdfs().size())
+      || state->lightCount != static_cast<cl_int>(scene.lights().size())) {
+    state.reset();
+    state = setupPathCL(scene);
+  }
+
+  return *state;
+}
+
+// (re)builds the wavefront kernels, with the current scene baked in when
+// specialise is set, and binds every argument that never changes
+auto buildPathKernels(path_cl& state, bool specialise) -> void {
+  std::stringstream options;
+  options << "-DSAMPLER=" << SAMPLER
+          << " -DBLUE_NOISE_SIZE=" << BLUE_NOISE_SIZE
+          << " -DIMAGE_WIDTH=" << WIDTH
+          << " -DIMAGE_HEIGHT=" << HEIGHT
+          << " -DDENOISE=" << DENOISE
+          << " -DLIGHT_TREE=" << LIGHT_TREE
+          << " -DENVIRONMENT=" << !environmentMap().empty()
+          << " -DTEXTURE_TILE=" << texture_cache::TILE
+          << " -DTEXTURE_BOUNCE_SPREAD=" << std::hexfloat << static_cast<cl_float>(TEXTURE_BOUNCE_SPREAD) << "f" << std::defaultfloat
+          << " -DSDF_COUNT=" << state.sdfCount
+          << " -DSDF_MAX_STACK=" << sdf::MAX_STACK
+          << " -DSDF_MAX_STEPS=" << SDF_MAX_STEPS
+          << " -DSDF_HIT_DISTANCE=" << std::hexfloat << static_cast<cl_float>(SDF_HIT_DISTANCE) << "f" << std::defaultfloat
+          << " -DMAX_DEPTH=" << MAX_RAY_DEPTH_PER_PIXEL;
+
+  // every batch is the same size unless the last one is short
+  if (state.frameSpp % state.batchSpp == 0) {
+    options << " -DRAYS_PER_PIXEL=" << state.batchSpp;
+  }
+
+  const std::string src = (specialise ? specialisedScene(state) : std::string())
+    + loadKernel("./kernels/sampler.cl") + loadKernel("./kernels/path.cl");
+
+  cl::Program prog = buildProgram(src, options.str());
+  state.specialised = specialise;
+
+  state.generate = cl::Kernel(prog, "generate");
+  state.extend = cl::Kernel(prog, "extend");
+  state.shade = cl::Kernel(prog, "shade");
+  state.connect = cl::Kernel(prog, "connect");
+  state.resolve = cl::Kernel(prog, "resolve");
+
+  // arguments that never change, the rest are set per batch or launch
+  state.generate.setArg(0, state.queueBufs[0]);
+
+  state.extend.setArg(0, state.primBuf);
+  state.extend.setArg(1, state.sphereCount);
+  state.extend.setArg(2, static_cast<cl_int>(state.prims.size()));
+  state.extend.setArg(3, state.pathBuf);
+  state.extend.setArg(5, state.hitBuf);
+  state.extend.setArg(10, state.blueNoiseBuf);
+  state.extend.setArg(12, state.sdfNodeBuf);
+
+  state.shade.setArg(0, state.primBuf);
+  state.shade.setArg(1, state.sphereCount);
+  state.shade.setArg(2, state.matBuf);
+  state.shade.setArg(3, state.pathBuf);
+  state.shade.setArg(5, state.hitBuf);
+  state.shade.setArg(7, state.shadowQueueBuf);
+  state.shade.setArg(8, state.queueLenBuf);
+  state.shade.setArg(9, state.contribBuf);
+  state.shade.setArg(10, state.imageBuf);
+  state.shade.setArg(15, state.blueNoiseBuf);
+  state.shade.setArg(17, state.slotAlbedoBuf);
+  state.shade.setArg(18, state.slotNormalBuf);
+  state.shade.setArg(19, state.slotDepthBuf);
+  state.shade.setArg(20, state.atlasBuf);
+  state.shade.setArg(21, state.textureInfoBuf);
+  state.shade.setArg(22, state.sdfNodeBuf);
+  state.shade.setArg(23, state.envTexelBuf);
+  state.shade.setArg(24, static_cast<cl_int>(environmentMap().width()));
+  state.shade.setArg(25, static_cast<cl_int>(environmentMap().height()));
+
+  state.connect.setArg(0, state.primBuf);
+  state.connect.setArg(1, state.sphereCount);
+  state.connect.setArg(2, static_cast<cl_int>(state.prims.size()));
+  state.connect.setArg(3, state.matBuf);
+  state.connect.setArg(4, state.pathBuf);
+  state.connect.setArg(5, state.shadowQueueBuf);
+  state.connect.setArg(6, state.hitBuf);
+  state.connect.setArg(7, state.contribBuf);
+  state.connect.setArg(12, state.blueNoiseBuf);
+  state.connect.setArg(13, state.lightNodeBuf);
+  state.connect.setArg(14, state.lightBuf);
+  state.connect.setArg(15, state.lightCount);
+  state.connect.setArg(16, state.sdfNodeBuf);
+  state.connect.setArg(17, state.envTexelBuf);
+  state.connect.setArg(18, state.envRowBuf);
+  state.connect.setArg(19, state.envColumnBuf);
+  state.connect.setArg(20, static_cast<cl_int>(environmentMap().width()));
+  state.connect.setArg(21, static_cast<cl_int>(environmentMap().height()));
+  state.connect.setArg(22, static_cast<cl_float>(environmentMap().total()));
+
+  state.resolve.setArg(0, state.contribBuf);
+  state.resolve.setArg(1, state.imageBuf);
+  state.resolve.setArg(2, state.accumBuf);
+  state.resolve.setArg(7, MAX_RAY_DEPTH_PER_PIXEL);
+  state.resolve.setArg(8, state.slotAlbedoBuf);
+  state.resolve.setArg(9, state.slotNormalBuf);
+  state.resolve.setArg(10, state.slotDepthBuf);
+  state.resolve.setArg(11, state.albedoBuf);
+  state.resolve.setArg(12, state.normalBuf);
+  state.resolve.setArg(13, state.depthBuf);
+
+  std::cout << "OpenCL kernels: " << (specialise ? "specialised" : "generic") << std::endl;
+}
+
+// every later pathCL call on the state traces spp samples per pixel
+auto setupPathCL(const scene_t& scene, int spp, bool profile) -> path_cl {
+  path_cl state;
+  state.frameSpp = spp;
+  state.profile = profile;
+  state.queue = cl::CommandQueue(context, device, profile ? CL_QUEUE_PROFILING_ENABLE : 0);
+
+  // setup kernel params
+  const int len = WIDTH*HEIGHT;
+
+  // construct host representations
+  cl_int sceneLen = scene.size();
+  state.sphereCount = scene.spheres().size();
+  state.sdfCount = scene.sdfs().size();
+  toCLScene(scene, state.prims, state.mats, state.sdfNodes);
+
+  // a sequence moves objects every frame, so only single frames bake them in
+  const bool specialise = OPENCL_SPECIALISE && FRAMES == 1 && sceneLen <= OPENCL_SPECIALISE_MAX_PRIMS;
+
+  // accum and the features cover the whole frame, the rest of the budget goes
+  // to one tile's path slots and batch image
+  const size_t featureBytes = 2*sizeof(cl_float3) + sizeof(cl_float);
+  const size_t frameBytes = len*sizeof(cl_float3) + (DENOISE ? len*featureBytes : 0);
+  const size_t slotBytes = sizeof(cl_PathState) + sizeof(cl_PathHit) + sizeof(cl_float4)
+    + 3*sizeof(cl_int) + (DENOISE ? featureBytes : 0);
+
+  const size_t tileBytes = OPENCL_MEMORY_BUDGET > frameBytes ? OPENCL_MEMORY_BUDGET - frameBytes : 0;
+  const size_t rowBytes = WIDTH*(state.frameSpp*slotBytes + sizeof(cl_float3));
+
+  // a pixel's estimate is normalised by its ray count, so keep all of its
+  // samples in one batch and tile rows; only split samples when a single row
+  // does not fit
+  if (tileBytes >= rowBytes) {
+    state.tilePixels = std::min<size_t>(tileBytes / rowBytes, HEIGHT)*WIDTH;
+    state.batchSpp = state.frameSpp;
+  } else {
+    const size_t pixelBytes = tileBytes / WIDTH;
+    state.tilePixels = WIDTH;
+    state.batchSpp = pixelBytes > sizeof(cl_float3)
+      ? std::max<size_t>((pixelBytes - sizeof(cl_float3)) / slotBytes, 1) : 1;
+  }
+
+  std::cout << "OpenCL batches: " << state.tilePixels << " pixels x "
+            << state.batchSpp << " spp" << std::endl;
+
+  const size_t slots = static_cast<size_t>(state.tilePixels)*state.batchSpp;
+
+  // construct device representations
+  state.primBuf = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+    sceneLen*sizeof(cl_float4), state.prims.data());
+
+  state.matBuf = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+    sceneLen*sizeof(cl_Material), state.mats.data());
+
+  // never empty, with no signed distance objects the kernels don't read it
+  std::vector<cl_float4> sdfNodes = state.sdfNodes;
+  sdfNodes.resize(std::max<size_t>(sdfNodes.size(), 1));
+  state.sdfNodeBuf = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+    sdfNodes.size()*sizeof(cl_float4), sdfNodes.data());
+
+  // one path per sample of the batch, queues hold slot indices
+  state.pathBuf = cl::Buffer(context, CL_MEM_READ_WRITE, slots*sizeof(cl_PathState));
+  state.hitBuf = cl::Buffer(context, CL_MEM_READ_WRITE, slots*sizeof(cl_PathHit));
+  state.contribBuf = cl::Buffer(context, CL_MEM_READ_WRITE, slots*sizeof(cl_float4));
+  state.queueBufs[0] = cl::Buffer(context, CL_MEM_READ_WRITE, slots*sizeof(cl_int));
+  state.queueBufs[1] = cl::Buffer(context, CL_MEM_READ_WRITE, slots*sizeof(cl_int));
+  state.shadowQueueBuf = cl::Buffer(context, CL_MEM_READ_WRITE, slots*sizeof(cl_int));
+
+  // [0] next extend queue, [1] shadow queue
+  state.queueLenBuf = cl::Buffer(context, CL_MEM_READ_WRITE, 2*sizeof(cl_int));
+
+  // one batch's estimate across its iterations, cleared before every batch
+  state.imageBuf = cl::Buffer(context, CL_MEM_READ_WRITE, state.tilePixels*sizeof(cl_float3));
+
+  // sample-weighted sum of every batch, cleared at the start of every frame
+  state.accumBuf = cl::Buffer(context, CL_MEM_READ_WRITE, len*sizeof(cl_float3));
+
+  state.blueNoiseBuf = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+    BLUE_NOISE_SIZE*BLUE_NOISE_SIZE*sizeof(cl_float), const_cast<float*>(blueNoiseTile()));
+
+  // buffers can't be empty, with no lights connect() never reads them
+  std::vector<cl_Light> lights;
+  std::vector<cl_LightNode> lightNodes;
+  toCLLights(scene, lights, lightNodes);
+  state.lightCount = lights.size();
+  lights.resize(std::max<size_t>(lights.size(), 1));
+  lightNodes.resize(std::max<size_t>(lightNodes.size(), 1));
+
+  state.lightBuf = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+    lights.size()*sizeof(cl_Light), lights.data());
+  state.lightNodeBuf = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+    lightNodes.size()*sizeof(cl_LightNode), lightNodes.data());
+
+  std::vector<cl_TextureInfo> textureInfos;
+  std::vector<cl_uint> atlas;
+  toCLTextures(textureInfos, atlas);
+  textureInfos.resize(std::max<size_t>(textureInfos.size(), 1));
+  atlas.resize(std::max<size_t>(atlas.size(), 1));
+
+  state.atlasBuf = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+    atlas.size()*sizeof(cl_uint), atlas.data());
+  state.textureInfoBuf = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+    textureInfos.size()*sizeof(cl_TextureInfo), textureInfos.data());
+
+  // never empty either, the kernels only read them when built with an environment
+  std::vector<cl_float4> envTexels;
+  std::vector<cl_AliasEntry> envRows, envColumns;
+  toCLEnvironment(envTexels, envRows, envColumns);
+  envTexels.resize(std::max<size_t>(envTexels.size(), 1));
+  envRows.resize(std::max<size_t>(envRows.size(), 1));
+  envColumns.resize(std::max<size_t>(envColumns.size(), 1));
+
+  state.envTexelBuf = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+    envTexels.size()*sizeof(cl_float4), envTexels.data());
+  state.envRowBuf = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+    envRows.size()*sizeof(cl_AliasEntry), envRows.data());
+  state.envColumnBuf = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+    envColumns.size()*sizeof(cl_AliasEntry), envColumns.data());
+
+  // first-hit features for the denoiser, only written when DENOISE is set
+  const int featuresLen = DENOISE ? len : 1;
+  state.albedoBuf = cl::Buffer(context, CL_MEM_WRITE_ONLY, featuresLen*sizeof(cl_float3));
+  state.normalBuf = cl::Buffer(context, CL_MEM_WRITE_ONLY, featuresLen*sizeof(cl_float3));
+  state.depthBuf = cl::Buffer(context, CL_MEM_WRITE_ONLY, featuresLen*sizeof(cl_float));
+
+  const size_t slotFeaturesLen = DENOISE ? slots : 1;
+  state.slotAlbedoBuf = cl::Buffer(context, CL_MEM_READ_WRITE, slotFeaturesLen*sizeof(cl_float3));
+  state.slotNormalBuf = cl::Buffer(context, CL_MEM_READ_WRITE, slotFeaturesLen*sizeof(cl_float3));
+  state.slotDepthBuf = cl::Buffer(context, CL_MEM_READ_WRITE, slotFeaturesLen*sizeof(cl_float));
+
+  buildPathKernels(state, specialise);
+
+  return state;
+}
+
+// traces state.frameSpp samples of every pixel, first_sample offsets their
+// sample indices, so repeated calls keep adding new samples. Once stop is requested no more batches are started and
+// nothing is returned
+auto pathCL(path_cl& state, const scene_t& scene, const camera& cam, gbuffer_t& gbuffer, int first_sample,
+            const render_stop* stop) -> array_t {
+  auto image = std::make_unique<std::array<std::array<point, HEIGHT>, WIDTH>>();
+  const int len = WIDTH*HEIGHT;
+
+  // the object count is fixed for a sequence, only transforms change
+  std::vector<cl_float4> prims;
+  std::vector<cl_Material> mats;
+  std::vector<cl_float4> sdfNodes;
+  toCLScene(scene, prims, mats, sdfNodes);
+
+  // baked in values no longer match, fall back to the generic kernels
+  if (state.specialised && (!std::equal(prims.begin(), prims.end(), state.prims.begin(), samePrim)
+      || !std::equal(mats.begin(), mats.end(), state.mats.begin(), sameMaterial))) {
+    buildPathKernels(state, false);
+  }
+
+  uploadChanged(state.queue, state.primBuf, state.prims, prims, samePrim);
+  uploadChanged(state.queue, state.matBuf, state.mats, mats, sameMaterial);
+  uploadChanged(state.queue, state.sdfNodeBuf, state.sdfNodes, sdfNodes, samePrim);
+
+  cl_int result = state.queue.enqueueFillBuffer(state.accumBuf, cl_float3{}, 0, len*sizeof(cl_float3));
+  checkErr("Could not enqueue fill: ", result);
+
+  // focal is the forward component of every primary direction, see rayDir
+  cl_Camera cl_cam{};
+  cl_cam.pos = cam.pos.toFloat3();
+  cl_cam.rot.s[0] = std::cos(cam.yaw);
+  cl_cam.rot.s[1] = std::sin(cam.yaw);
+  cl_cam.focal = rayDir(90.0, 0, 0).d.y;
+
+  state.extend.setArg(11, cl_cam);
+  state.shade.setArg(16, cl_cam);
+
+  // execute tracing, every batch runs all iterations before the next starts
+  for (int pixel_offset=0; pixel_offset<len; pixel_offset+=state.tilePixels) {
+    const int tile = std::min(state.tilePixels, len - pixel_offset);
+
+    for (int sample_offset=0; sample_offset<state.frameSpp; sample_offset+=state.batchSpp) {
+      const int batch = std::min(state.batchSpp, state.frameSpp - sample_offset);
+      const int slots = tile*batch;
+
+      if (stop && stop->requested()) {
+        return nullptr;
+      }
+
+      result = state.queue.enqueueFillBuffer(state.imageBuf, cl_float3{}, 0, tile*sizeof(cl_float3));
+      checkErr("Could not enqueue fill: ", result);
+      result = state.queue.enqueueFillBuffer(state.queueLenBuf, cl_int{0}, 0, 2*sizeof(cl_int));
+      checkErr("Could not enqueue fill: ", result);
+
+      state.extend.setArg(6, batch);
+      state.extend.setArg(7, first_sample + sample_offset);
+      state.extend.setArg(8, pixel_offset);
+      state.shade.setArg(11, batch);
+      state.shade.setArg(12, first_sample + sample_offset);
+      state.shade.setArg(13, pixel_offset);
+      state.connect.setArg(8, batch);
+      state.connect.setArg(9, first_sample + sample_offset);
+      state.connect.setArg(10, pixel_offset);
+      state.resolve.setArg(3, batch);
+      state.resolve.setArg(4, first_sample + sample_offset);
+      state.resolve.setArg(5, pixel_offset);
+
+      launch(state, state.generate, slots);
+
+      // live paths to extend this iteration, and shadow paths parked at a hit
+      cl_int live = slots;
+      cl_int shadows = 0;
+      int current = 0;
+
+      for (int i=0; i<MAX_RAY_DEPTH_PER_PIXEL; i++) {
+        if (live > 0) {
+          result = state.queue.enqueueFillBuffer(state.queueLenBuf, cl_int{0}, 0, sizeof(cl_int));
+          checkErr("Could not enqueue fill: ", result);
+
+          state.extend.setArg(4, state.queueBufs[current]);
+          state.extend.setArg(9, i);
+          launch(state, state.extend, live);
+
+          state.shade.setArg(4, state.queueBufs[current]);
+          state.shade.setArg(6, state.queueBufs[1-current]);
+          state.shade.setArg(14, i);
+          launch(state, state.shade, live);
+
+          cl_int queue_len[2];
+          result = state.queue.enqueueReadBuffer(state.queueLenBuf, CL_TRUE, 0, 2*sizeof(cl_int), queue_len);
+          checkErr("Could not enqueue read: ", result);
+
+          live = queue_len[0];
+          shadows = queue_len[1];
+          current = 1-current;
+        }
+
+        if (shadows > 0) {
+          state.connect.setArg(11, i);
+          launch(state, state.connect, shadows);
+        }
+
+        state.resolve.setArg(6, i);
+        launch(state, state.resolve, tile);
+      }
+    }
+  }
+
+  // read and paste image
+  cl_float3* imageOut = new cl_float3[len];
+
+  result = state.queue.enqueueReadBuffer(state.accumBuf, CL_TRUE, 0, len*sizeof(cl_float3), imageOut);
+  checkErr("Could not enqueue read: ", result);
+
+  for (int row=0; row<WIDTH; row++) {
+    for (int col=0; col<HEIGHT; col++) {
+      const int index = row * WIDTH + col;
+      (*image)[row][col].x = imageOut[index].s[0] / state.frameSpp;
+      (*image)[row][col].y = imageOut[index].s[1] / state.frameSpp;
+      (*image)[row][col].z = imageOut[index].s[2] / state.frameSpp;
+    }
+  }
+
+  if constexpr(DENOISE) {
+    cl_float3* albedoOut = new cl_float3[len];
+    cl_float3* normalOut = new cl_float3[len];
+    cl_float* depthOut = new cl_float[len];
+
+    result = state.queue.enqueueReadBuffer(state.albedoBuf, CL_TRUE, 0, len*sizeof(cl_float3), albedoOut);
+    checkErr("Could not enqueue read: ", result);
+    result = state.queue.enqueueReadBuffer(state.normalBuf, CL_TRUE, 0, len*sizeof(cl_float3), normalOut);
+    checkErr("Could not enqueue read: ", result);
+    result = state.queue.enqueueReadBuffer(state.depthBuf, CL_TRUE, 0, len*sizeof(cl_float), depthOut);
+    checkErr("Could not enqueue read: ", result);
+
+    for (int row=0; row<WIDTH; row++) {
+      for (int col=0; col<HEIGHT; col++) {
+        const int index = row * WIDTH + col;
+        (*gbuffer)[row][col] = features{
+          point(albedoOut[index].s[0], albedoOut[index].s[1], albedoOut[index].s[2]),
+          point(normalOut[index].s[0], normalOut[index].s[1], normalOut[index].s[2]),
+          depthOut[index]
+        };
+      }
+    }
+
+    delete [] albedoOut;
+    delete [] normalOut;
+    delete [] depthOut;
+  }
+
+  delete [] imageOut;
+
+  return image;
+}
+
+auto checkErr(std::string ctx, cl_int err) -> void {
+  if (err) {
+    std::cerr << ctx << err << std::endl;
+    exit(-1);
+  }
+}
+
+auto checkBuildErr(cl::Program prog, cl_int err) -> void {
+  if (err) {
+    std::cerr << "Could not build program: " << err << std::endl;
+
+    std::string build_log = prog.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+
+    std::cerr << "Build log:" << std::endl;
+    std::cerr << build_log << std::endl;
+
+    exit(-1);
+  }
+}
+
+auto loadKernel(std::string file) -> std::string {
+  std::ifstream kernel_s(file);
+  std::stringstream buf;
+  buf << kernel_s.rdbuf();
+  std::string kernel_src = buf.str();
+
+  return kernel_src;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#define CL_HPP_TARGET_OPENCL_VERSION 300
+
+#include <map>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <CL/opencl.hpp>
+
+#include "common.hpp"
+#include "image.hpp"
+#include "Structures/ray.hpp"
+#include "Structures/clStructs.hpp"
+
+class scene_t;
+
+// ends a deadline render, cancel can be set from any thread
+struct render_stop {
+  std::chrono::steady_clock::time_point deadline;
+  std::atomic<bool> cancel = false;
+
+  // whether work taking ahead from now would finish too late
+  auto requested(std::chrono::duration<double> ahead = {}) const -> bool {
+    return cancel.load(std::memory_order_relaxed)
+      || std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(ahead) >= deadline;
+  }
+};
+
+// one wavefront stage's launches while profiling, see path_cl::profile
+struct stage_stats {
+  int launches = 0;
+  size_t items = 0;
+  double ms = 0;
+};
+
+// device state for the OpenCL path tracer, built on the first frame and kept
+// for every later one
+struct path_cl {
+  // wavefront stages, see kernels/path.cl
+  cl::Kernel generate, extend, shade, connect, resolve;
+  cl::CommandQueue queue;
+  cl::Buffer primBuf, matBuf, imageBuf, accumBuf, blueNoiseBuf;
+  cl::Buffer albedoBuf, normalBuf, depthBuf;
+  // scene lights and their BVH, and the texture atlas, fixed for the whole run
+  cl::Buffer lightBuf, lightNodeBuf;
+  cl::Buffer atlasBuf, textureInfoBuf;
+  cl_int lightCount;
+  // the environment map and its alias tables, see toCLEnvironment
+  cl::Buffer envTexelBuf, envRowBuf, envColumnBuf;
+  // signed distance programs, see toCLScene
+  cl::Buffer sdfNodeBuf;
+
+  // per path slot state and the queues of live slots
+  cl::Buffer pathBuf, hitBuf, contribBuf, queueBufs[2], shadowQueueBuf, queueLenBuf;
+  cl::Buffer slotAlbedoBuf, slotNormalBuf, slotDepthBuf;
+
+  // every pathCL call traces frameSpp samples per pixel, as tiles of
+  // tilePixels, each in batches of batchSpp samples, sized to fit
+  // OPENCL_MEMORY_BUDGET
+  int frameSpp;
+  int tilePixels;
+  int batchSpp;
+
+  // kernels were built with the scene below baked in, see buildPathKernels
+  cl_int sphereCount;
+  cl_int sdfCount;
+  bool specialised;
+
+  // what the device currently holds, so a frame only uploads what changed
+  std::vector<cl_float4> prims;
+  std::vector<cl_Material> mats;
+  std::vector<cl_float4> sdfNodes;
+
+  // with profile set the queue records timestamps, and every launch waits
+  // for its kernel and adds it to stats under the kernel's name
+  bool profile;
+  std::map<std::string, stage_stats> stats;
+};
+
+// the device every OpenCL object is made for, picked before any tracing
+extern cl::Device device;
+extern cl::Context context;
+
+auto setupPathCL(const scene_t& scene, int spp = INITIAL_RAYS_PER_PIXEL, bool profile = false) -> path_cl;
+auto pathCLState(const scene_t& scene) -> path_cl&;
+auto buildPathKernels(path_cl& state, bool specialise) -> void;
+auto pathCL(path_cl& state, const scene_t& scene, const camera& cam, gbuffer_t& gbuffer, int first_sample = 0,
+            const render_stop* stop = nullptr) -> array_t;
+
+auto loadKernel(std::string file) -> std::string;
+auto checkErr(std::string ctx, cl_int err) -> void;
+auto checkBuildErr(cl::Program prog, cl_int err) -> void;
+auto hashString(const std::string& text) -> uint64_t;
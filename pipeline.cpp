@@ -0,0 +1,75 @@
+#include "pipeline.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+namespace {
+
+auto quantise(pos_type v) -> uint8_t {
+  return static_cast<uint8_t>(std::clamp(v, 0.0, 255.0));
+}
+
+}
+
+output_pipeline::output_pipeline(const std::string& file)
+  : format(encoderFor(file)), bands(OUTPUT_QUEUE_DEPTH), rows(OUTPUT_QUEUE_DEPTH) {
+  tonemapper = std::thread(&output_pipeline::tonemap, this);
+  encoder = std::thread(&output_pipeline::encode, this);
+}
+
+output_pipeline::~output_pipeline() {
+  finish();
+}
+
+auto output_pipeline::push(const array_t& image, int y0, int y1) -> void {
+  band b{y0, y1, std::vector<point>((y1-y0)*WIDTH)};
+
+  for (int x = 0; x<WIDTH; x++) {
+    for (int y = y0; y<y1; y++) {
+      b.pixels[(y-y0)*WIDTH + x] = (*image)[x][y];
+    }
+  }
+
+  bands.push(std::move(b));
+}
+
+auto output_pipeline::finish() -> void {
+  if (!tonemapper.joinable()) {
+    return;
+  }
+
+  // tonemap() closes rows once it has drained bands
+  bands.close();
+  tonemapper.join();
+  encoder.join();
+
+  const auto start = std::chrono::steady_clock::now();
+  bytes = format->finish();
+  const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+  encode_ms += elapsed.count();
+}
+
+auto output_pipeline::tonemap() -> void {
+  while (auto b = bands.pop()) {
+    encoded e{b->y0, b->y1, std::vector<uint8_t>(b->pixels.size()*3)};
+
+    for (size_t i = 0; i<b->pixels.size(); i++) {
+      e.rgb[3*i] = quantise(b->pixels[i].x);
+      e.rgb[3*i + 1] = quantise(b->pixels[i].y);
+      e.rgb[3*i + 2] = quantise(b->pixels[i].z);
+    }
+
+    rows.push(std::move(e));
+  }
+
+  rows.close();
+}
+
+auto output_pipeline::encode() -> void {
+  while (auto e = rows.pop()) {
+    const auto start = std::chrono::steady_clock::now();
+    format->band(e->y0, e->y1, std::move(e->rgb));
+    const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    encode_ms += elapsed.count();
+  }
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <optional>
+#include <condition_variable>
+
+#include "image.hpp"
+#include "encode.hpp"
+
+// fixed capacity FIFO between pipeline stages. push blocks while it is full,
+// pop blocks while it is empty and returns nothing once closed and drained
+template<typename T>
+class bounded_queue {
+public:
+  explicit bounded_queue(size_t capacity) : capacity(capacity) {}
+
+  auto push(T item) -> void {
+    std::unique_lock guard(lock);
+    not_full.wait(guard, [&] { return items.size() < capacity; });
+    items.push_back(std::move(item));
+    not_empty.notify_one();
+  }
+
+  auto pop() -> std::optional<T> {
+    std::unique_lock guard(lock);
+    not_empty.wait(guard, [&] { return !items.empty() || closed; });
+
+    if (items.empty()) {
+      return std::nullopt;
+    }
+
+    T item = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return item;
+  }
+
+  auto close() -> void {
+    std::unique_lock guard(lock);
+    closed = true;
+    not_empty.notify_all();
+  }
+
+private:
+  std::mutex lock;
+  std::condition_variable not_full;
+  std::condition_variable not_empty;
+  std::deque<T> items;
+  size_t capacity;
+  bool closed = false;
+};
+
+// Writes a frame while it is still rendering, in the format of file's
+// extension (see encoderFor). Finished row bands are quantised on one thread
+// and handed to the encoder on another; a BMP writes each band to its place in
+// the file, so once the last band is pushed only that band is left to do.
+// Bands may arrive in any order, the file is complete after finish().
+class output_pipeline {
+public:
+  explicit output_pipeline(const std::string& file);
+  ~output_pipeline();
+
+  // rows [y0, y1) of image are final, they are copied before this returns
+  auto push(const array_t& image, int y0, int y1) -> void;
+  // waits for every pushed band to be written and closes the file
+  auto finish() -> void;
+
+  // after finish(), the file's size and the time spent in the encoder
+  auto fileBytes() const -> size_t { return bytes; }
+  auto encodeMs() const -> double { return encode_ms; }
+
+private:
+  struct band {
+    int y0, y1;
+    std::vector<point> pixels;
+  };
+
+  // 8 bit RGB, top row first
+  struct encoded {
+    int y0, y1;
+    std::vector<uint8_t> rgb;
+  };
+
+  auto tonemap() -> void;
+  auto encode() -> void;
+
+  std::unique_ptr<frame_encoder> format;
+  size_t bytes = 0;
+  double encode_ms = 0;
+
+  bounded_queue<band> bands;
+  bounded_queue<encoded> rows;
+  std::thread tonemapper;
+  std::thread encoder;
+};
@@ -0,0 +1,284 @@
+#include "sampler.hpp"
+
+#include <array>
+#include <vector>
+#include <random>
+#include <cmath>
+
+#include "common.hpp"
+
+// Owen-scrambled Sobol following Burley, "Practical Hash-based Owen
+// Scrambling" (JCGT 2020). Dimensions past the first four are padded by
+// shuffling the sample index per group of four.
+
+namespace {
+
+constexpr int SOBOL_DIMS = 4;
+constexpr int SOBOL_BITS = 32;
+
+// first dimension is van der Corput, the rest use Joe-Kuo primitive polynomials
+constexpr auto sobolDirections() -> std::array<std::array<uint32_t, SOBOL_BITS>, SOBOL_DIMS> {
+  constexpr int degree[SOBOL_DIMS] = {0, 1, 2, 3};
+  constexpr uint32_t coeffs[SOBOL_DIMS] = {0, 0, 1, 1};
+  constexpr uint32_t initial[SOBOL_DIMS][3] = {{}, {1}, {1, 3}, {1, 3, 1}};
+
+  std::array<std::array<uint32_t, SOBOL_BITS>, SOBOL_DIMS> v{};
+
+  for (int i = 0; i < SOBOL_BITS; i++) {
+    v[0][i] = 1u << (31-i);
+  }
+
+  for (int d = 1; d < SOBOL_DIMS; d++) {
+    const int s = degree[d];
+
+    for (int i = 0; i < SOBOL_BITS; i++) {
+      if (i < s) {
+        v[d][i] = initial[d][i] << (31-i);
+        continue;
+      }
+
+      v[d][i] = v[d][i-s] ^ (v[d][i-s] >> s);
+      for (int k = 1; k < s; k++) {
+        if ((coeffs[d] >> (s-1-k)) & 1) {
+          v[d][i] ^= v[d][i-k];
+        }
+      }
+    }
+  }
+
+  return v;
+}
+
+constexpr auto directions = sobolDirections();
+
+auto sobolBits(uint32_t index, uint32_t dim) -> uint32_t {
+  uint32_t x = 0;
+  for (int bit = 0; index; index >>= 1, bit++) {
+    if (index & 1) {
+      x ^= directions[dim][bit];
+    }
+  }
+
+  return x;
+}
+
+auto hash(uint32_t x) -> uint32_t {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+auto hashCombine(uint32_t seed, uint32_t v) -> uint32_t {
+  return seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+auto reverseBits(uint32_t x) -> uint32_t {
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+auto laineKarras(uint32_t x, uint32_t seed) -> uint32_t {
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return x;
+}
+
+auto owenScramble(uint32_t x, uint32_t seed) -> uint32_t {
+  return reverseBits(laineKarras(reverseBits(x), seed));
+}
+
+// void-and-cluster (Ulichney 1993) with a toroidal gaussian energy filter
+auto buildBlueNoise() -> std::vector<float> {
+  constexpr int S = BLUE_NOISE_SIZE;
+  constexpr int n = S*S;
+  constexpr double sigma = 1.5;
+
+  std::vector<double> kernel(n);
+  for (int dy = 0; dy < S; dy++) {
+    for (int dx = 0; dx < S; dx++) {
+      const int wx = std::min(dx, S-dx);
+      const int wy = std::min(dy, S-dy);
+      kernel[dy*S + dx] = std::exp(-(wx*wx + wy*wy) / (2*sigma*sigma));
+    }
+  }
+
+  std::vector<bool> pattern(n, false);
+  std::vector<double> energy(n, 0.0);
+
+  auto splat = [&](int p, bool set) {
+    pattern[p] = set;
+    const double sign = set ? 1.0 : -1.0;
+    const int px = p%S;
+    const int py = p/S;
+
+    for (int i = 0; i < n; i++) {
+      const int dx = (i%S - px + S) % S;
+      const int dy = (i/S - py + S) % S;
+      energy[i] += sign*kernel[dy*S + dx];
+    }
+  };
+
+  auto tightestCluster = [&]() {
+    int best = -1;
+    for (int i = 0; i < n; i++) {
+      if (pattern[i] && (best == -1 || energy[i] > energy[best])) {
+        best = i;
+      }
+    }
+    return best;
+  };
+
+  auto largestVoid = [&]() {
+    int best = -1;
+    for (int i = 0; i < n; i++) {
+      if (!pattern[i] && (best == -1 || energy[i] < energy[best])) {
+        best = i;
+      }
+    }
+    return best;
+  };
+
+  // initial binary pattern, relaxed until the tightest cluster is the largest void
+  std::mt19937 generator(S);
+  std::uniform_int_distribution<int> pick(0, n-1);
+
+  const int ones = n/10;
+  for (int placed = 0; placed < ones;) {
+    const int p = pick(generator);
+    if (!pattern[p]) {
+      splat(p, true);
+      placed++;
+    }
+  }
+
+  while (true) {
+    const int cluster = tightestCluster();
+    splat(cluster, false);
+
+    const int gap = largestVoid();
+    splat(gap, true);
+
+    if (gap == cluster) {
+      break;
+    }
+  }
+
+  const auto initial_pattern = pattern;
+  const auto initial_energy = energy;
+  std::vector<int> rank(n);
+
+  // rank the initial points by removing clusters
+  for (int r = ones-1; r >= 0; r--) {
+    const int cluster = tightestCluster();
+    splat(cluster, false);
+    rank[cluster] = r;
+  }
+
+  // rank the rest by filling voids; past half full this is the same as
+  // removing clusters of the inverted pattern
+  pattern = initial_pattern;
+  energy = initial_energy;
+
+  for (int r = ones; r < n; r++) {
+    const int gap = largestVoid();
+    splat(gap, true);
+    rank[gap] = r;
+  }
+
+  std::vector<float> tile(n);
+  for (int i = 0; i < n; i++) {
+    tile[i] = (rank[i] + 0.5f) / n;
+  }
+
+  return tile;
+}
+
+}
+
+auto sobolSample(uint32_t index, uint32_t dim, uint32_t seed) -> double {
+  const uint32_t group_seed = hashCombine(seed, hash(dim / SOBOL_DIMS));
+  const uint32_t shuffled = owenScramble(index, group_seed);
+  const uint32_t x = owenScramble(sobolBits(shuffled, dim % SOBOL_DIMS),
+                                  hashCombine(group_seed, dim % SOBOL_DIMS));
+
+  return x * 0x1p-32;
+}
+
+auto blueNoiseTile() -> const float* {
+  static const std::vector<float> tile = buildBlueNoise();
+  return tile.data();
+}
+
+auto blueNoise(int x, int y, uint32_t dim) -> double {
+  // decorrelate dimensions by offsetting into the tile along an R2 sequence
+  const int ox = static_cast<int>(dim * 0.7548776662466927 * BLUE_NOISE_SIZE);
+  const int oy = static_cast<int>(dim * 0.5698402909980532 * BLUE_NOISE_SIZE);
+
+  const int tx = (x + ox) % BLUE_NOISE_SIZE;
+  const int ty = (y + oy) % BLUE_NOISE_SIZE;
+
+  return blueNoiseTile()[ty*BLUE_NOISE_SIZE + tx];
+}
+
+sampler::sampler(int x, int y, uint32_t index)
+  : x(x), y(y), index(index) {
+  // blue noise shares one sequence between pixels and rotates it per pixel,
+  // everything else scrambles per pixel
+  if constexpr(SAMPLER == blue_noise) {
+    seed = 0;
+  } else {
+    seed = hashCombine(hash(x), y);
+  }
+}
+
+sampler::sampler(int x, int y, uint32_t index, uint32_t seed)
+  : x(x), y(y), index(index), seed(seed) {}
+
+auto sampler::get1D() -> double {
+  const uint32_t d = dim++;
+
+  if constexpr(SAMPLER == sobol) {
+    return sobolSample(index, d, seed);
+
+  } else if constexpr(SAMPLER == blue_noise) {
+    // nested sequences (x < 0) are not rotated
+    const double v = sobolSample(index, d, seed);
+    if (x < 0) {
+      return v;
+    }
+
+    const double shifted = v + blueNoise(x, y, d);
+    return shifted - std::floor(shifted);
+
+  } else {
+    return random_double();
+  }
+}
+
+auto sampler::get2D() -> std::tuple<double, double> {
+  const double u = get1D();
+  const double v = get1D();
+  return std::make_tuple(u, v);
+}
+
+auto sampler::nestedSeed() -> uint32_t {
+  const uint32_t d = dim++;
+  return hashCombine(hashCombine(hashCombine(hashCombine(seed, x), y), index), hash(d));
+}
+
+auto sampler::nested(uint32_t seed, uint32_t index) const -> sampler {
+  if constexpr(SAMPLER == blue_noise) {
+    return sampler(-1, -1, index, seed);
+  }
+
+  return sampler(x, y, index, seed);
+}
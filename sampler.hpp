@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <tuple>
+
+// Stream of [0,1) sample values for one pixel sample, handed out one
+// dimension at a time. Which sequence backs it is chosen by SAMPLER.
+class sampler {
+public:
+  sampler(int x, int y, uint32_t index);
+
+  auto get1D() -> double;
+  auto get2D() -> std::tuple<double, double>;
+
+  // inner estimators (light grid, secondary rays) draw from their own
+  // sequence: take one seed from this stream, then one child per inner sample
+  auto nestedSeed() -> uint32_t;
+  auto nested(uint32_t seed, uint32_t index) const -> sampler;
+
+private:
+  sampler(int x, int y, uint32_t index, uint32_t seed);
+
+  int x;
+  int y;
+  uint32_t index;
+  uint32_t seed;
+  uint32_t dim = 0;
+};
+
+// Owen-scrambled Sobol, padded past 4 dimensions by shuffling the index
+auto sobolSample(uint32_t index, uint32_t dim, uint32_t seed) -> double;
+
+// 64x64 void-and-cluster tile, built on first use
+constexpr int BLUE_NOISE_SIZE = 64;
+auto blueNoise(int x, int y, uint32_t dim) -> double;
+auto blueNoiseTile() -> const float*;
@@ -0,0 +1,55 @@
+#include "scene.hpp"
+
+#include <stdexcept>
+
+namespace {
+
+auto get(const std::shared_ptr<object>& obj) -> const object* {
+  return obj.get();
+}
+
+auto get(const object* obj) -> const object* {
+  return obj;
+}
+
+}
+
+scene_t::scene_t(const std::vector<std::shared_ptr<object>>& objects, std::vector<light> lights)
+  : emitters(std::move(lights)) {
+  build(objects);
+}
+
+scene_t::scene_t(const scene_t& other) : emitters(other.emitters) {
+  build(other.handles);
+}
+
+// the arrays are sized up front, so the handles stay valid
+template<typename Objects>
+auto scene_t::build(const Objects& objects) -> void {
+  size_t sphere_count = 0;
+  size_t plane_count = 0;
+  size_t sdf_count = 0;
+
+  for (const auto& obj : objects) {
+    sphere_count += dynamic_cast<const sphere*>(get(obj)) != nullptr;
+    plane_count += dynamic_cast<const plane*>(get(obj)) != nullptr;
+    sdf_count += dynamic_cast<const sdf*>(get(obj)) != nullptr;
+  }
+
+  sphere_arena.reserve(sphere_count);
+  plane_arena.reserve(plane_count);
+  sdf_arena.reserve(sdf_count);
+  handles.reserve(objects.size());
+
+  for (const auto& obj : objects) {
+    if (auto s = dynamic_cast<const sphere*>(get(obj))) {
+      handles.push_back(&sphere_arena.emplace_back(*s));
+    } else if (auto p = dynamic_cast<const plane*>(get(obj))) {
+      handles.push_back(&plane_arena.emplace_back(*p));
+    } else if (auto f = dynamic_cast<const sdf*>(get(obj))) {
+      handles.push_back(&sdf_arena.emplace_back(*f));
+    } else {
+      throw std::runtime_error("scene_t: unknown object type");
+    }
+  }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+
+#include "Structures/objects.hpp"
+#include "Structures/sdf.hpp"
+#include "lights.hpp"
+
+// Immutable scene the tracers read. Primitives are copied by value into one
+// array per type when it is built, and the objects are plain pointers into
+// those arrays in the original order, so tracing touches no reference counts
+// and allocates nothing. Build a new one when the objects change. Lights are
+// not objects, rays never hit them; with none the old fixed light is used.
+class scene_t {
+public:
+  explicit scene_t(const std::vector<std::shared_ptr<object>>& objects, std::vector<light> lights = {});
+  // copies point into their own arrays, see replicateScene()
+  scene_t(const scene_t& other);
+  scene_t(scene_t&&) = default;
+  scene_t& operator=(const scene_t&) = delete;
+  scene_t& operator=(scene_t&&) = default;
+
+  auto begin() const { return handles.begin(); }
+  auto end() const { return handles.end(); }
+  auto size() const -> size_t { return handles.size(); }
+  auto operator[](size_t i) const -> const object& { return *handles[i]; }
+
+  // each type in original order
+  auto spheres() const -> const std::vector<sphere>& { return sphere_arena; }
+  auto planes() const -> const std::vector<plane>& { return plane_arena; }
+  auto sdfs() const -> const std::vector<sdf>& { return sdf_arena; }
+
+  auto lights() const -> const std::vector<light>& { return emitters.lights(); }
+  auto lightTree() const -> const light_tree& { return emitters; }
+
+private:
+  template<typename Objects>
+  auto build(const Objects& objects) -> void;
+
+  std::vector<sphere> sphere_arena;
+  std::vector<plane> plane_arena;
+  std::vector<sdf> sdf_arena;
+  std::vector<const object*> handles;
+  light_tree emitters;
+};
@@ -0,0 +1,153 @@
+// Checks the signed distance marcher's vectorised paths against the plain
+// ones: occludedPacket() against occluded() one ray at a time, over a few
+// programs and random shadow rays, and wave() against std::sin. Any ray the
+// two marchers disagree on, or a sine further off than MAX_WAVE_ERROR, fails
+// the check.
+//
+//   make sdfcheck && ./sdfcheck
+
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "common.hpp"
+#include "Structures/ray.hpp"
+#include "Structures/sdf.hpp"
+
+namespace {
+
+constexpr int RAYS = 1 << 16;
+constexpr int WAVES = 1 << 20;
+constexpr pos_type MAX_WAVE_ERROR = 2e-9;
+
+auto randomPoint(std::mt19937& gen, point lo, point hi) -> point {
+  std::uniform_real_distribution<pos_type> d(0, 1);
+  const pos_type x = d(gen);
+  const pos_type y = d(gen);
+  return lo + (hi - lo) * point(x, y, d(gen));
+}
+
+struct named_sdf {
+  std::string name;
+  sdf shape;
+};
+
+auto programs() -> std::vector<named_sdf> {
+  std::vector<named_sdf> shapes;
+
+  // the SDF_SCENE shape, see createScene
+  shapes.push_back(named_sdf{"scene", sdf(std::vector<sdf_node>{
+      {sdf_box, point(7,10,-2), point(1,1,1)},
+      {sdf_torus, point(7,10,-1), point(1.8,0.45,0)},
+      {sdf_displace, point(7,10,-1), point(0.08,0,0), 6.0},
+      {sdf_smooth_union, point(), point(), 0.6}
+    }, point(1,1,1), 0.3, 1.0)});
+
+  // every other op, with a displacement strong enough to need small steps
+  shapes.push_back(named_sdf{"spheres", sdf(std::vector<sdf_node>{
+      {sdf_sphere, point(0,0,0), point(1.5,0,0)},
+      {sdf_displace, point(0,0,0), point(0.2,0,0), 9.0},
+      {sdf_sphere, point(2,0,0.5), point(0.7,0,0)},
+      {sdf_union},
+      {sdf_box, point(-1,1,0), point(0.4,2,0.4)},
+      {sdf_union}
+    }, point(1,1,1), 0.3, 1.0)});
+
+  return shapes;
+}
+
+// shadow rays from around the shape's bounds towards points in them, tmax
+// either short of the target or well past it. A quarter start out blocked,
+// which occludedPacket() must leave alone
+auto checkPacket(const named_sdf& test, std::mt19937& gen) -> int {
+  const sdf& shape = test.shape;
+  const point margin = (shape.upper() - shape.lower()) * 0.5;
+  const point lo = shape.lower() - margin;
+  const point hi = shape.upper() + margin;
+
+  std::uniform_real_distribution<pos_type> unit(0, 1);
+  std::vector<ray> rays(RAYS);
+  std::vector<pos_type> tmax(RAYS);
+  std::vector<char> blocked_before(RAYS);
+
+  for (int i = 0; i<RAYS; i++) {
+    const point from = randomPoint(gen, lo, hi);
+    const point to = randomPoint(gen, shape.lower(), shape.upper());
+    rays[i] = ray(from, (to - from).norm());
+    tmax[i] = (to - from).length() * 2 * unit(gen);
+    blocked_before[i] = unit(gen) < 0.25;
+  }
+
+  int mismatches = 0;
+  int occluded = 0;
+
+  // odd bundle sizes too, so packets end part way through the lanes
+  for (int first = 0, bundle = 1; first<RAYS; first += bundle, bundle = bundle % 67 + 1) {
+    const int count = std::min(bundle, RAYS - first);
+    bool blocked[67];
+    for (int i = 0; i<count; i++) {
+      blocked[i] = blocked_before[first + i];
+    }
+
+    shape.occludedPacket(&rays[first], &tmax[first], count, blocked);
+
+    for (int i = 0; i<count; i++) {
+      const bool expected = blocked_before[first + i] || shape.occluded(rays[first + i], tmax[first + i]);
+      occluded += expected;
+
+      if (blocked[i] != expected) {
+        if (mismatches < 8) {
+          std::cerr << test.name << ": ray " << first + i << " from " << rays[first + i].e << " along "
+                    << rays[first + i].d << ", tmax " << tmax[first + i] << ": packet says " << blocked[i]
+                    << ", one ray " << expected << std::endl;
+        }
+        mismatches++;
+      }
+    }
+  }
+
+  std::cout << test.name << ": " << RAYS << " rays, " << occluded << " occluded, " << mismatches
+            << " packet mismatches" << std::endl;
+  return mismatches;
+}
+
+// over the arguments displacement sees and far beyond them
+auto checkWave(std::mt19937& gen) -> int {
+  std::uniform_real_distribution<pos_type> near(-20, 20);
+  std::uniform_real_distribution<pos_type> far(-1e4, 1e4);
+
+  pos_type worst = 0;
+  pos_type worst_x = 0;
+  int failures = 0;
+
+  for (int i = 0; i<WAVES; i++) {
+    const pos_type x = (i % 2) ? near(gen) : far(gen);
+    const pos_type error = std::abs(wave(x) - std::sin(x));
+
+    if (error > worst) {
+      worst = error;
+      worst_x = x;
+    }
+    failures += error > MAX_WAVE_ERROR;
+  }
+
+  std::cout << "wave: " << WAVES << " arguments, worst error " << worst << " at " << worst_x << ", "
+            << failures << " over " << MAX_WAVE_ERROR << std::endl;
+  return failures;
+}
+
+}
+
+auto main() -> int {
+  std::mt19937 gen(1);
+  int failures = 0;
+
+  for (const named_sdf& test : programs()) {
+    failures += checkPacket(test, gen);
+  }
+  failures += checkWave(gen);
+
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,327 @@
+#include "texture.hpp"
+
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr char MAGIC[4] = {'R', 'T', 'T', 'X'};
+constexpr int HEADER_BYTES = 16;
+
+auto getU32(const std::vector<char>& data, size_t at) -> uint32_t {
+  uint32_t v = 0;
+  for (int i = 0; i < 4; i++) {
+    v |= static_cast<uint32_t>(static_cast<uint8_t>(data[at+i])) << (8*i);
+  }
+  return v;
+}
+
+auto putU32(std::ofstream& out, uint32_t v) -> void {
+  for (int i = 0; i < 4; i++) {
+    out.put(static_cast<char>((v >> (8*i)) & 0xff));
+  }
+}
+
+// FNV-1a, names the tiled file
+auto hashString(const std::string& text) -> uint64_t {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (unsigned char c : text) {
+    hash = (hash ^ c) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+struct rgba_image {
+  int width;
+  int height;
+  std::vector<uint8_t> texels;
+};
+
+// uncompressed 24 or 32 bit BMP, returned top row first
+auto readBMP(const std::string& file) -> rgba_image {
+  std::ifstream in(file, std::ifstream::binary);
+  const std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+  if (data.size() < 54 || data[0] != 'B' || data[1] != 'M') {
+    throw std::runtime_error("Can't read texture " + file);
+  }
+
+  const uint32_t offset = getU32(data, 10);
+  const int width = static_cast<int32_t>(getU32(data, 18));
+  const int height = static_cast<int32_t>(getU32(data, 22));
+  const int bpp = static_cast<uint8_t>(data[28]) | (static_cast<uint8_t>(data[29]) << 8);
+  const uint32_t compression = getU32(data, 30);
+
+  if ((bpp != 24 && bpp != 32) || (compression != 0 && compression != 3) || width <= 0 || height == 0) {
+    throw std::runtime_error("Unsupported texture format in " + file);
+  }
+
+  const int rows = std::abs(height);
+  const size_t row_bytes = (static_cast<size_t>(width)*bpp/8 + 3) & ~size_t(3);
+  if (offset + row_bytes*rows > data.size()) {
+    throw std::runtime_error("Truncated texture " + file);
+  }
+
+  rgba_image image{width, rows, std::vector<uint8_t>(static_cast<size_t>(width)*rows*4)};
+
+  for (int y = 0; y < rows; y++) {
+    // positive heights are stored bottom to top
+    const size_t row = offset + row_bytes*(height > 0 ? rows-1-y : y);
+
+    for (int x = 0; x < width; x++) {
+      const size_t at = row + static_cast<size_t>(x)*bpp/8;
+      uint8_t* texel = &image.texels[(static_cast<size_t>(y)*width + x)*4];
+      texel[0] = data[at+2];
+      texel[1] = data[at+1];
+      texel[2] = data[at];
+      texel[3] = 255;
+    }
+  }
+
+  return image;
+}
+
+// 2x2 box filter, odd edges repeat their last texel
+auto halve(const rgba_image& image) -> rgba_image {
+  const int width = std::max(image.width/2, 1);
+  const int height = std::max(image.height/2, 1);
+  rgba_image next{width, height, std::vector<uint8_t>(static_cast<size_t>(width)*height*4)};
+
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      for (int c = 0; c < 4; c++) {
+        int sum = 0;
+        for (int dy = 0; dy < 2; dy++) {
+          for (int dx = 0; dx < 2; dx++) {
+            const int sx = std::min(2*x+dx, image.width-1);
+            const int sy = std::min(2*y+dy, image.height-1);
+            sum += image.texels[(static_cast<size_t>(sy)*image.width + sx)*4 + c];
+          }
+        }
+        next.texels[(static_cast<size_t>(y)*width + x)*4 + c] = static_cast<uint8_t>((sum + 2) / 4);
+      }
+    }
+  }
+
+  return next;
+}
+
+auto describe(int width, int height) -> texture_info {
+  texture_info info{width, height, 1, {0}};
+
+  while ((width >> (info.levels-1)) > 1 || (height >> (info.levels-1)) > 1) {
+    info.levels++;
+  }
+
+  for (int level = 0; level < info.levels; level++) {
+    info.level_tile.push_back(info.level_tile.back() + info.tilesX(level)*info.tilesY(level));
+  }
+
+  return info;
+}
+
+// every level of file as TILE x TILE RGBA8 tiles, level by level and row by
+// row, after a small header
+auto writeTiled(const std::string& file, const std::string& tiled) -> void {
+  constexpr int TILE = texture_cache::TILE;
+  rgba_image level_image = readBMP(file);
+  const texture_info info = describe(level_image.width, level_image.height);
+
+  const std::string tmp = tiled + ".tmp";
+  std::ofstream out(tmp, std::ofstream::binary);
+  out.write(MAGIC, 4);
+  putU32(out, info.width);
+  putU32(out, info.height);
+  putU32(out, info.levels);
+
+  std::vector<uint8_t> tile(texture_cache::TILE_BYTES);
+
+  for (int level = 0; level < info.levels; level++) {
+    if (level > 0) {
+      level_image = halve(level_image);
+    }
+
+    for (int ty = 0; ty < info.tilesY(level); ty++) {
+      for (int tx = 0; tx < info.tilesX(level); tx++) {
+        // tiles past the edge repeat the last row and column
+        for (int y = 0; y < TILE; y++) {
+          for (int x = 0; x < TILE; x++) {
+            const int sx = std::min(tx*TILE + x, level_image.width-1);
+            const int sy = std::min(ty*TILE + y, level_image.height-1);
+            std::copy_n(&level_image.texels[(static_cast<size_t>(sy)*level_image.width + sx)*4], 4, &tile[(y*TILE + x)*4]);
+          }
+        }
+        out.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+      }
+    }
+  }
+
+  out.close();
+  if (!out) {
+    throw std::runtime_error("Can't write " + tmp);
+  }
+  std::filesystem::rename(tmp, tiled);
+}
+
+auto wrap(pos_type v) -> pos_type {
+  return v - std::floor(v);
+}
+
+}
+
+auto texture_info::tilesX(int level) const -> int {
+  return (levelWidth(level) + texture_cache::TILE - 1) / texture_cache::TILE;
+}
+
+auto texture_info::tilesY(int level) const -> int {
+  return (levelHeight(level) + texture_cache::TILE - 1) / texture_cache::TILE;
+}
+
+texture_cache::texture_cache(size_t capacity, std::string directory)
+  : directory(std::move(directory)), shard_tiles(std::max<size_t>(capacity / TILE_BYTES / SHARDS, 1)) {}
+
+texture_cache::~texture_cache() {
+  for (const source& src : sources) {
+    ::close(src.fd);
+  }
+}
+
+auto texture_cache::open(const std::string& file) -> int {
+  if (const auto found = opened.find(file); found != opened.end()) {
+    return found->second;
+  }
+
+  // a changed source gets a new tiled file
+  std::stringstream key;
+  key << std::filesystem::absolute(file).string() << ":" << std::filesystem::file_size(file) << ":"
+      << std::filesystem::last_write_time(file).time_since_epoch().count();
+
+  std::stringstream tiled;
+  tiled << directory << "/" << std::hex << hashString(key.str()) << ".tiles";
+
+  if (!std::filesystem::exists(tiled.str())) {
+    std::filesystem::create_directories(directory);
+    writeTiled(file, tiled.str());
+  }
+
+  const int fd = ::open(tiled.str().c_str(), O_RDONLY);
+  char header[HEADER_BYTES];
+  if (fd < 0 || ::pread(fd, header, HEADER_BYTES, 0) != HEADER_BYTES || !std::equal(MAGIC, MAGIC+4, header)) {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    throw std::runtime_error("Can't open tiled texture " + tiled.str());
+  }
+
+  const std::vector<char> fields(header, header + HEADER_BYTES);
+  sources.push_back(source{describe(getU32(fields, 4), getU32(fields, 8)), fd});
+  opened[file] = sources.size()-1;
+
+  return sources.size()-1;
+}
+
+auto texture_cache::info(int texture) const -> const texture_info& {
+  return sources[texture].info;
+}
+
+auto texture_cache::read(const source& src, int level, int tx, int ty) const -> std::vector<uint8_t> {
+  const size_t index = src.info.level_tile[level] + ty*src.info.tilesX(level) + tx;
+  std::vector<uint8_t> texels(TILE_BYTES);
+
+  if (::pread(src.fd, texels.data(), TILE_BYTES, HEADER_BYTES + index*TILE_BYTES) != TILE_BYTES) {
+    throw std::runtime_error("Short read from a tiled texture");
+  }
+
+  return texels;
+}
+
+auto texture_cache::tile(int texture, int level, int tx, int ty) -> std::shared_ptr<const std::vector<uint8_t>> {
+  const source& src = sources[texture];
+  const uint64_t key = (static_cast<uint64_t>(texture) << 40) | (static_cast<uint64_t>(src.info.level_tile[level] + ty*src.info.tilesX(level) + tx));
+  shard& sh = shards[((key * 0x9e3779b97f4a7c15ull) >> 60) % SHARDS];
+
+  {
+    std::scoped_lock guard(sh.lock);
+    const auto found = sh.index.find(key);
+    if (found != sh.index.end()) {
+      sh.lru.splice(sh.lru.begin(), sh.lru, found->second);
+      hit_count.fetch_add(1, std::memory_order_relaxed);
+      return found->second->texels;
+    }
+  }
+
+  // read without the lock, two threads missing the same tile both read it
+  miss_count.fetch_add(1, std::memory_order_relaxed);
+  auto texels = std::make_shared<const std::vector<uint8_t>>(read(src, level, tx, ty));
+
+  std::scoped_lock guard(sh.lock);
+  if (sh.index.find(key) == sh.index.end()) {
+    sh.lru.push_front(entry{key, texels});
+    sh.index[key] = sh.lru.begin();
+
+    // evicted tiles stay alive while a sampler still holds them
+    while (sh.lru.size() > shard_tiles) {
+      sh.index.erase(sh.lru.back().key);
+      sh.lru.pop_back();
+    }
+  }
+
+  return texels;
+}
+
+auto texture_cache::resident() const -> size_t {
+  size_t tiles = 0;
+  for (const shard& sh : shards) {
+    std::scoped_lock guard(sh.lock);
+    tiles += sh.lru.size();
+  }
+  return tiles*TILE_BYTES;
+}
+
+auto texture_cache::texel(int texture, int level, int x, int y) -> point {
+  const auto texels = tile(texture, level, x / TILE, y / TILE);
+  const uint8_t* t = &(*texels)[((y % TILE)*TILE + (x % TILE))*4];
+  return point(t[0], t[1], t[2]) / 255.0;
+}
+
+auto texture_cache::bilinear(int texture, int level, pos_type u, pos_type v) -> point {
+  const texture_info& tex = sources[texture].info;
+  const int w = tex.levelWidth(level);
+  const int h = tex.levelHeight(level);
+
+  // texel centres sit at half integers
+  const pos_type x = wrap(u)*w - 0.5;
+  const pos_type y = wrap(v)*h - 0.5;
+  const int x0 = static_cast<int>(std::floor(x));
+  const int y0 = static_cast<int>(std::floor(y));
+  const pos_type fx = x - x0;
+  const pos_type fy = y - y0;
+
+  const int xa = (x0 + w) % w, xb = (x0 + 1) % w;
+  const int ya = (y0 + h) % h, yb = (y0 + 1) % h;
+
+  return texel(texture, level, xa, ya)*((1-fx)*(1-fy)) + texel(texture, level, xb, ya)*(fx*(1-fy))
+       + texel(texture, level, xa, yb)*((1-fx)*fy) + texel(texture, level, xb, yb)*(fx*fy);
+}
+
+auto texture_cache::sample(int texture, pos_type u, pos_type v, pos_type footprint) -> point {
+  const texture_info& tex = sources[texture].info;
+  const pos_type level = std::clamp(std::log2(std::max(footprint*std::max(tex.width, tex.height), 1e-9)),
+                                    0.0, static_cast<pos_type>(tex.levels-1));
+
+  const int fine = static_cast<int>(level);
+  const pos_type blend = level - fine;
+  const point colour = bilinear(texture, fine, u, v);
+
+  if (blend == 0 || fine+1 >= tex.levels) {
+    return colour;
+  }
+
+  return colour*(1-blend) + bilinear(texture, fine+1, u, v)*blend;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+
+#include "Structures/point.hpp"
+
+// one texture as laid out in its tiled file
+struct texture_info {
+  int width;
+  int height;
+  int levels;
+  // first tile of every level, counted from the first tile in the file
+  std::vector<int> level_tile;
+
+  auto levelWidth(int level) const -> int { return std::max(width >> level, 1); }
+  auto levelHeight(int level) const -> int { return std::max(height >> level, 1); }
+  auto tilesX(int level) const -> int;
+  auto tilesY(int level) const -> int;
+  auto tiles() const -> int { return level_tile.back(); }
+};
+
+// Image textures for materials. open() turns a 24/32 bit BMP into a tiled
+// file of every mip level, once, under a directory keyed by the source's
+// name, size and time; after that only tiles that are sampled are read, with
+// pread so threads never share a file position. Tiles live in a bounded LRU
+// cache split over shards, each behind its own lock, so lookups only contend
+// on the same shard and memory stays under the capacity whatever the
+// texture sizes.
+class texture_cache {
+public:
+  static constexpr int TILE = 32;
+  static constexpr int TILE_BYTES = TILE*TILE*4;
+
+  texture_cache(size_t capacity, std::string directory);
+  ~texture_cache();
+  texture_cache(const texture_cache&) = delete;
+  texture_cache& operator=(const texture_cache&) = delete;
+
+  // index of the texture for file, opening it at most once. Not safe while
+  // other threads sample
+  auto open(const std::string& file) -> int;
+  auto info(int texture) const -> const texture_info&;
+  auto size() const -> size_t { return sources.size(); }
+
+  // trilinear colour in [0,1] at (u, v), wrapping. footprint is the size the
+  // sample covers in uv units and picks the mip levels
+  auto sample(int texture, pos_type u, pos_type v, pos_type footprint) -> point;
+
+  // one tile's RGBA8 texels, row by row, cached like every other read
+  auto tile(int texture, int level, int tx, int ty) -> std::shared_ptr<const std::vector<uint8_t>>;
+
+  auto hits() const -> uint64_t { return hit_count.load(std::memory_order_relaxed); }
+  auto misses() const -> uint64_t { return miss_count.load(std::memory_order_relaxed); }
+  auto resident() const -> size_t;
+  auto capacity() const -> size_t { return shard_tiles*SHARDS*TILE_BYTES; }
+
+private:
+  static constexpr int SHARDS = 16;
+
+  struct entry {
+    uint64_t key;
+    std::shared_ptr<const std::vector<uint8_t>> texels;
+  };
+
+  // most recently used at the front
+  struct shard {
+    mutable std::mutex lock;
+    std::list<entry> lru;
+    std::unordered_map<uint64_t, std::list<entry>::iterator> index;
+  };
+
+  struct source {
+    texture_info info;
+    int fd;
+  };
+
+  auto texel(int texture, int level, int x, int y) -> point;
+  auto bilinear(int texture, int level, pos_type u, pos_type v) -> point;
+  auto read(const source& src, int level, int tx, int ty) const -> std::vector<uint8_t>;
+
+  std::string directory;
+  size_t shard_tiles;
+  std::array<shard, SHARDS> shards;
+  std::vector<source> sources;
+  std::unordered_map<std::string, int> opened;
+
+  std::atomic<uint64_t> hit_count = 0;
+  std::atomic<uint64_t> miss_count = 0;
+};
@@ -2,115 +2,460 @@
 
 #include "common.hpp"
 #include "Structures/objects.hpp"
+#include "scene.hpp"
 #include "Structures/ray.hpp"
+#include "sampler.hpp"
+#include "image.hpp"
+#include "irradiance.hpp"
+#include "guiding.hpp"
+#include "lights.hpp"
+#include "texture.hpp"
+#include "environment.hpp"
+
+#include <cmath>
+#include <array>
+#include <algorithm>
+
+// shared by every thread, see irradiance.hpp for the locking
+irradiance_cache irradiance(IRRADIANCE_CACHE_ERROR, 0.5, 5.0);
+
+auto irradianceCacheSize() -> size_t {
+  return irradiance.size();
+}
 
-auto lightRay(point startpos, const std::vector<std::shared_ptr<object>> scene, int bounces) -> point {
-  point colour = point(0,0,0);
+auto clearIrradianceCache() -> void {
+  irradiance.clear();
+}
+
+// tiles are loaded on first use by whichever thread samples them
+texture_cache textures(TEXTURE_CACHE_BYTES, TEXTURE_CACHE_DIR);
+
+auto loadTexture(const std::string& file) -> int {
+  return textures.open(file);
+}
+
+auto textureCache() -> texture_cache& {
+  return textures;
+}
+
+// empty unless ENVIRONMENT_MAP is loaded, read-only while tracing
+environment_map environment;
+
+auto loadEnvironment(const std::string& file) -> void {
+  environment = environment_map(file, ENVIRONMENT_SCALE);
+}
+
+auto environmentMap() -> const environment_map& {
+  return environment;
+}
+
+// objects shaded by this thread go here, see recordTouched
+thread_local uint64_t* touched = nullptr;
+
+auto recordTouched(uint64_t* mask) -> void {
+  touched = mask;
+}
+
+// Base colour at a hit. The mip level comes from the width of the ray's cone
+// there: primary directions are one unit per pixel, so a primary hit at depth
+// t covers t units; later rays spread by TEXTURE_BOUNCE_SPREAD. Oblique hits
+// stretch the footprint, by the geometric mean of its two axes.
+auto surfaceColour(const object& obj, const hit& h, const ray& r, bool primary) -> point {
+  if (obj.texture < 0) {
+    return obj.colour;
+  }
+
+  const pos_type len = r.d.length();
+  const pos_type width = primary ? h.depth : h.depth*len*TEXTURE_BOUNCE_SPREAD;
+  const pos_type cos = std::max(std::abs(dot(r.d, h.normal)) / len, 0.01);
+
+  return textures.sample(obj.texture, h.u, h.v, width / std::sqrt(cos) / h.uv_size);
+}
+
+// trained between passes, read-only while they run
+path_guide guide(GUIDING_SPLIT_SAMPLES, GUIDING_MAX_LEAVES);
+int guide_refined_at = 0;
+
+auto resetPathGuide(const scene_t& scene) -> void {
+  point lo = point(NO_HIT, NO_HIT, NO_HIT);
+  point hi = point(-NO_HIT, -NO_HIT, -NO_HIT);
+
+  const auto grow = [&](point p, pos_type r) {
+    lo = point(std::min(lo.x, p.x-r), std::min(lo.y, p.y-r), std::min(lo.z, p.z-r));
+    hi = point(std::max(hi.x, p.x+r), std::max(hi.y, p.y+r), std::max(hi.z, p.z+r));
+  };
+
+  for (const sphere& obj : scene.spheres()) {
+    grow(obj.centre, obj.radius);
+  }
+  for (const plane& obj : scene.planes()) {
+    grow(obj.vertex, 0);
+  }
+  for (const sdf& obj : scene.sdfs()) {
+    grow(obj.lower(), 0);
+    grow(obj.upper(), 0);
+  }
+
+  // planes are unbounded, hits past the margin share the outer leaves
+  const point margin = (hi - lo)*0.25;
+  guide.reset(lo - margin, hi + margin);
+  guide_refined_at = 0;
+}
+
+auto trainPathGuide(int spp) -> void {
+  if (spp >= std::max(1, 2*guide_refined_at)) {
+    guide.refine();
+    guide_refined_at = spp;
+  }
+}
+
+auto pathGuideLeaves() -> size_t {
+  return guide.leaves();
+}
+
+// uniform direction on the unit sphere
+auto randomDir(sampler& s) -> point {
+  const auto [u, v] = s.get2D();
+  const pos_type z = 1 - 2*u;
+  const pos_type r = std::sqrt(std::max(0.0, 1 - z*z));
+  const pos_type phi = 2 * 3.14159265358979323 * v;
+
+  return point(r*std::cos(phi), r*std::sin(phi), z);
+}
+
+// One light sample from x: picks an emitter from the scene's light tree and a
+// point on it, value is what it sends to x over the probability of both
+auto sceneLight(point x, const scene_t& scene, pos_type u, pos_type v) -> light_sample {
+  const auto [index, prob] = scene.lightTree().pick(x, u);
+  light_sample ls = sampleLight(scene.lights()[index], x, u, v);
+  ls.value = ls.value / prob;
+  return ls;
+}
+
+// visible, if given, receives how many of the light samples were unoccluded.
+// Every sample's ray is built first and then tested object by object, so
+// objects that can march several rays at once get them together
+auto lightRay(point startpos, const scene_t& scene, int bounces, sampler& s, int* visible = nullptr) -> point {
+  // path tracing takes one sample
+  constexpr int MAX_SAMPLES = TYPE==distributed ? GRID_SIZE*GRID_SIZE : 1;
+  std::array<ray, MAX_SAMPLES> rays;
+  std::array<pos_type, MAX_SAMPLES> dists;
+  std::array<point, MAX_SAMPLES> values;
+  std::array<bool, MAX_SAMPLES> blocked{};
+  int count = 0;
+
+  uint32_t light_seed = 0;
+  uint32_t environment_seed = 0;
+  const bool scene_lights = !scene.lights().empty();
+  // with an environment, each sample goes to it or to the lights below
+  // with even odds, and counts double
+  const bool sky_light = !environment.empty();
+  const pos_type share = sky_light ? 2 : 1;
 
   if constexpr(TYPE==distributed) {
     bounces = GRID_SIZE*GRID_SIZE;
+    light_seed = s.nestedSeed();
+    if (sky_light) {
+      environment_seed = s.nestedSeed();
+    }
   }
 
   for (int i=0; i<(bounces); i++) {
     point endpos;
+    // the fixed light sends the same to every point it can see
+    point light_value = point(0.9, 0.9, 0.9);
 
-    if constexpr(TYPE==distributed) {
-      int grid_section = i;
-      double increments = 15.0 / GRID_SIZE;
-      int x = grid_section%GRID_SIZE;
-      int y = grid_section/GRID_SIZE;
+    if (sky_light) {
+      // the environment draws from its own numbers, so the lights' stay as
+      // they would be without it
+      pos_type pick, u, v;
+      if constexpr(TYPE==distributed) {
+        auto environment_sampler = s.nested(environment_seed, i);
+        pick = environment_sampler.get1D();
+        std::tie(u, v) = environment_sampler.get2D();
+      } else {
+        pick = s.get1D();
+        if (pick < 0.5) {
+          // the lights below draw the same pair otherwise
+          std::tie(u, v) = s.get2D();
+        }
+      }
 
-      // centred around x=0.0 y=7.5
-      endpos = point((x*increments),(y*increments)+7.5, 40);
-    } else {
+      if (pick < 0.5) {
+        point dir;
+        const point value = environment.sample(u, v, dir);
 
-      endpos = point(random_double(-7.5,7.5), random_double(0.0,15.0), 40);
+        if (value.x <= 0 && value.y <= 0 && value.z <= 0) {
+          continue;
+        }
+
+        rays[count] = ray(startpos, dir);
+        dists[count] = NO_HIT;
+        values[count] = value * share;
+        count++;
+        continue;
+      }
     }
 
-    auto light_ray = ray(
+    if (scene_lights) {
+      // pick and place from the same pair, see light_tree::pick
+      pos_type u, v;
+      if constexpr(TYPE==distributed) {
+        auto light_sampler = s.nested(light_seed, i);
+        std::tie(u, v) = light_sampler.get2D();
+      } else {
+        std::tie(u, v) = s.get2D();
+      }
+
+      const light_sample ls = sceneLight(startpos, scene, u, v);
+      endpos = ls.pos;
+      light_value = ls.value;
+
+      if (light_value.x <= 0 && light_value.y <= 0 && light_value.z <= 0) {
+        continue;
+      }
+
+    } else if constexpr(TYPE==distributed) {
+      if constexpr(SAMPLER==uniform) {
+        int grid_section = i;
+        double increments = 15.0 / GRID_SIZE;
+        int x = grid_section%GRID_SIZE;
+        int y = grid_section/GRID_SIZE;
+
+        // centred around x=0.0 y=7.5
+        endpos = point((x*increments),(y*increments)+7.5, 40);
+      } else {
+        auto light_sampler = s.nested(light_seed, i);
+        const auto [u, v] = light_sampler.get2D();
+
+        endpos = point(u*15.0, (v*15.0)+7.5, 40);
+      }
+    } else {
+      const auto [u, v] = s.get2D();
+      endpos = point((u*15.0)-7.5, v*15.0, 40);
+    }
+
+    const point to_light = endpos-startpos;
+    const pos_type light_dist = to_light.length();
+
+    rays[count] = ray(
       startpos,
-      (endpos-startpos).norm()
+      to_light/light_dist
     );
+    dists[count] = light_dist;
+    values[count] = light_value * share;
+    count++;
+  }
 
-    bool hitlight = true;
-    for (auto& obj : scene) {
-      auto objhit = obj->intersect(light_ray);
+  for (const object* obj : scene) {
+    obj->occludedPacket(rays.data(), dists.data(), count, blocked.data());
 
-      if (objhit.intersect) {
-        hitlight = false;
-        break;
-      }
+    if (std::all_of(blocked.begin(), blocked.begin() + count, [](bool b) { return b; })) {
+      break;
     }
+  }
+
+  point colour = point(0,0,0);
+  int visible_count = 0;
 
-    if (hitlight) {
-      colour = colour + point(0.9, 0.9, 0.9); //point(0.8,0.1,0.8);
+  for (int i = 0; i<count; i++) {
+    if (!blocked[i]) {
+      colour = colour + values[i];
+      visible_count++;
     }
   }
 
+  if (visible) {
+    *visible = visible_count;
+  }
+
   return colour/bounces;
 }
 
+// One bounce off a fully diffuse surface, from the guide or from the surface's
+// own lobe. n + randomDir() is cosine distributed with length 2*cos, so
+// guided directions get that length too and weighting by cos/pi over the
+// mixture density gives the same expected value as plain sampling.
+auto guidedBounce(ray r, point normal, const scene_t& scene, int bounces, sampler& s) -> point {
+  const int leaf = guide.leaf(r.e);
+
+  if (s.get1D() >= GUIDING_BSDF_FRACTION) {
+    const auto [u, v] = s.get2D();
+    const point dir = guide.sample(leaf, u, v);
+    // below the surface, where the lobe has no density
+    if (dot(dir, normal) <= 0) {
+      return point(0,0,0);
+    }
+    r.d = dir * (2*dot(dir, normal));
+  }
+
+  const pos_type len = r.d.length();
+  const pos_type cos = len > 0 ? dot(r.d, normal) / len : 0;
+  if (cos <= 0) {
+    return point(0,0,0);
+  }
+
+  const point dir = r.d / len;
+  const pos_type lobe_pdf = cos / 3.14159265358979323;
+  const pos_type pdf = GUIDING_BSDF_FRACTION*lobe_pdf + (1-GUIDING_BSDF_FRACTION)*guide.pdf(leaf, dir);
+
+  const point incoming = rayCast(r, scene, bounces-1, s);
+  const pos_type weight = lobe_pdf / pdf;
+
+  guide.record(leaf, dir, (incoming.x + incoming.y + incoming.z) / 3 * weight);
+
+  return incoming * weight;
+}
+
+auto firstHit(const ray& r, const scene_t& scene, features& surface) -> int {
+  int nearest = -1;
+  pos_type depth = NO_HIT;
+
+  for (size_t i = 0; i<scene.size(); i++) {
+    const pos_type t = scene[i].distance(r);
+    if (t < depth) {
+      depth = t;
+      nearest = i;
+    }
+  }
+
+  // as rayCast, hits this close are ignored
+  if (nearest < 0 || depth < 0.001) {
+    surface = features{point(0.1,0.1,0.2), point(0,0,0), 0};
+    return -1;
+  }
+
+  const hit h = scene[nearest].surface(r, depth);
+  surface = features{surfaceColour(scene[nearest], h, r, true), h.normal, depth};
+
+  return nearest;
+}
+
 // returns colour
-auto rayCast(ray r, const std::vector<std::shared_ptr<object>> scene, int bounces) -> point {
-  auto nearest = std::weak_ptr<object>();
-  hit nearesthit;
-  pos_type depth = 0;
+auto rayCast(ray r, const scene_t& scene, int bounces, sampler& s, features* first_hit) -> point {
+  const object* nearest_ptr = nullptr;
+  // position in scene, the same in every copy of it, see irradiance_record
+  int nearest_index = -1;
+  pos_type depth = NO_HIT;
   point colour = point(0.1,0.1,0.2);
 
-  //Loop through every object
-  for (auto& obj : scene) {
-    auto objhit = obj->intersect(r);
-    //Check if ray intersected
-    if (objhit.intersect) {
-      //Check if this new intersection is the closest to to the eye
-      //If this is the first iteration, nearest==false and this should run regardless
-      std::shared_ptr<object> nearest_ptr = nearest.lock();
-      if (!nearest_ptr || objhit.depth < depth) {
-        //New nearest
-        depth = objhit.depth;
-        nearest = obj;
-        nearesthit = objhit;
-      }
+  //Loop through every object, only keeping the distance
+  for (size_t i = 0; i<scene.size(); i++) {
+    const pos_type t = scene[i].distance(r);
+    //Check if this new intersection is the closest to to the eye
+    if (t < depth) {
+      depth = t;
+      nearest_ptr = &scene[i];
+      nearest_index = i;
     }
   }
 
-  std::shared_ptr<object> nearest_ptr = nearest.lock();
-  if (nearest_ptr && nearesthit.depth >= 0.001) {
+  // rays that leave the scene see the environment when there is one
+  if (!(nearest_ptr && depth >= 0.001) && !environment.empty()) {
+    colour = environment.radiance(r.d);
+  }
+
+  if (first_hit) {
+    *first_hit = features{colour, point(0,0,0), 0};
+  }
+
+  if (nearest_ptr && depth >= 0.001) {
+    //Surface data for the closest hit only
+    const hit nearesthit = nearest_ptr->surface(r, depth);
+
     //Object base colour
-    colour = nearest_ptr->colour;
+    colour = surfaceColour(*nearest_ptr, nearesthit, r, bounces == MAX_RAY_DEPTH_PER_PIXEL);
+
+    if (touched) {
+      *touched |= objectBit(nearest_index);
+    }
+
+    if (first_hit) {
+      *first_hit = features{colour, nearesthit.normal, depth};
+    }
 
     // lighting ray dir
     auto startpos = nearesthit.pos + nearesthit.normal*0.01;
     point light_colour;
 
-    auto random_dir = [](){
-      auto p = point(random_double(-1,1), random_double(-1,1), random_double(-1,1));
-      return p.norm();
-    };
-
     if (bounces>0) {
       // reflection
       point reflection_colour = point(0,0,0);
 
       const pos_type fuzz = 0.8;
-      const auto reflection = ((r.d - 2*dot(r.d, nearesthit.normal)) * nearesthit.normal)+(random_dir()*fuzz);
-      const auto diffuse = nearesthit.normal + random_dir();
+      const auto reflection = ((r.d - 2*dot(r.d, nearesthit.normal)) * nearesthit.normal)+(randomDir(s)*fuzz);
+      const auto diffuse = nearesthit.normal + randomDir(s);
 
       if constexpr(TYPE==distributed) {
-        auto light_colour = lightRay(startpos, scene, bounces+1);
-        bounces = GRID_SIZE*GRID_SIZE;
+        // direct light does not depend on the view, so any surface can reuse
+        // it; only fully diffuse surfaces gather view independent indirect light
+        const bool cacheable = IRRADIANCE_CACHE && nearest_ptr->diffuse == 1.0;
 
-        for (int bounce = 0; bounce < bounces; bounce++) {
-          const auto [ray_x, ray_y] = get_grid_value(bounce);
+        irradiance_sample cached;
+        if constexpr(IRRADIANCE_CACHE) {
+          cached = irradiance.lookup(nearesthit.pos, nearesthit.normal, nearest_index);
+        }
 
-          auto nr = ray(
-            (nearesthit.pos + point(ray_x, ray_y, 0)) - point(0.5,0.5,0),
-            (reflection * (1-nearest_ptr->diffuse)) + (diffuse * nearest_ptr->diffuse)
-          );
-          reflection_colour += rayCast(nr, scene, 0);
+        point light_colour = cached.light;
+        int visible = 0;
+        if (!cached.found_light) {
+          light_colour = lightRay(startpos, scene, bounces+1, s, &visible);
+        }
+        const bool light_uniform = cached.found_light || visible == 0 || visible == GRID_SIZE*GRID_SIZE;
+
+        const bool gather_indirect = !(cacheable && cached.found_indirect);
+
+        if (!gather_indirect) {
+          reflection_colour = cached.indirect;
+
+        } else {
+          bounces = GRID_SIZE*GRID_SIZE;
+          const uint32_t grid_seed = s.nestedSeed();
+          pos_type inv_dist_sum = 0;
+
+          for (int bounce = 0; bounce < bounces; bounce++) {
+            auto grid_sampler = s.nested(grid_seed, bounce);
+            const auto [ray_x, ray_y] = (SAMPLER==uniform) ? get_grid_value(bounce) : grid_sampler.get2D();
+
+            // a cache record needs the whole hemisphere, not one direction
+            const point dir = cacheable
+              ? nearesthit.normal + randomDir(grid_sampler)
+              : (reflection * (1-nearest_ptr->diffuse)) + (diffuse * nearest_ptr->diffuse);
+
+            auto nr = ray(
+              (nearesthit.pos + point(ray_x, ray_y, 0)) - point(0.5,0.5,0),
+              dir
+            );
+
+            features secondary_hit;
+            reflection_colour += rayCast(nr, scene, 0, grid_sampler, IRRADIANCE_CACHE ? &secondary_hit : nullptr);
+
+            if (secondary_hit.depth > 0) {
+              inv_dist_sum += 1.0 / (secondary_hit.depth * dir.length());
+            }
+          }
+
+          reflection_colour = reflection_colour / bounces;
+
+          // new records where nothing was in reach, or where indirect light
+          // was gathered that the cache can't provide yet
+          if (IRRADIANCE_CACHE && (!cached.covered || (cacheable && !cached.found_indirect))) {
+            // harmonic mean distance to the surroundings
+            const pos_type radius = inv_dist_sum > 0 ? bounces / inv_dist_sum : NO_HIT;
+
+            irradiance.insert(irradiance_record{
+              .pos = nearesthit.pos,
+              .normal = nearesthit.normal,
+              .radius = radius,
+              .obj = nearest_index,
+              .light = light_colour,
+              .light_uniform = light_uniform,
+              .indirect = reflection_colour,
+              .has_indirect = cacheable
+            });
+          }
         }
 
-        reflection_colour = reflection_colour / bounces;
         reflection_colour = colour*(1.0-nearest_ptr->specular)
                             + reflection_colour*nearest_ptr->specular;
 
@@ -120,9 +465,9 @@ auto rayCast(ray r, const std::vector<std::shared_ptr<object>> scene, int bounce
         // if first intersection
         if (bounces == MAX_RAY_DEPTH_PER_PIXEL) {
           // choose reflection or shadow ray
-          const bool shadow = static_cast<bool>(static_cast<int>(random_double(0,2)));
+          const bool shadow = s.get1D() >= 0.5;
           if (shadow) {
-            light_colour = lightRay(startpos, scene, 1);
+            light_colour = lightRay(startpos, scene, 1, s);
 
             colour = (colour + light_colour) / 2;
             return colour;
@@ -135,7 +480,13 @@ auto rayCast(ray r, const std::vector<std::shared_ptr<object>> scene, int bounce
           (reflection * (1-nearest_ptr->diffuse)) + (diffuse * nearest_ptr->diffuse)
         );
 
-        reflection_colour += rayCast(nr, scene, bounces-1);
+        // only fully diffuse surfaces have a known density (cosine) to mix
+        // the guide with
+        if (PATH_GUIDING && nearest_ptr->diffuse == 1.0) {
+          reflection_colour += guidedBounce(nr, nearesthit.normal, scene, bounces, s);
+        } else {
+          reflection_colour += rayCast(nr, scene, bounces-1, s);
+        }
 
         colour = colour*(1.0-nearest_ptr->specular) + reflection_colour*nearest_ptr->specular;
       } else {
@@ -143,32 +494,35 @@ auto rayCast(ray r, const std::vector<std::shared_ptr<object>> scene, int bounce
 
         // bounces again correspondes to grids
         point reflection_colour;
+        const uint32_t bounce_seed = s.nestedSeed();
 
         if constexpr(EXEC == openmp) {
 
           #pragma omp parallel for reduction(pointAdd : reflection_colour)
           for (int bounce = 0; bounce < bounces; bounce++) {
-            const auto [ray_x, ray_y] = get_grid_value(static_cast<int>(random_double(0, (GRID_SIZE*GRID_SIZE)-1)));
+            auto bounce_sampler = s.nested(bounce_seed, bounce);
+            const auto [ray_x, ray_y] = get_grid_value(static_cast<int>(bounce_sampler.get1D() * ((GRID_SIZE*GRID_SIZE)-1)));
 
             auto nr = ray(
               (nearesthit.pos + point(ray_x, ray_y, 0)) - point(0.5,0.5,0),
-              nearesthit.normal + random_dir()
+              nearesthit.normal + randomDir(bounce_sampler)
             );
 
-            reflection_colour += rayCast(nr, scene, bounces-1);
+            reflection_colour += rayCast(nr, scene, bounces-1, bounce_sampler);
           }
 
         } else {
 
           for (int bounce = 0; bounce < bounces; bounce++) {
-            const auto [ray_x, ray_y] = get_grid_value(static_cast<int>(random_double(0, (GRID_SIZE*GRID_SIZE)-1)));
+            auto bounce_sampler = s.nested(bounce_seed, bounce);
+            const auto [ray_x, ray_y] = get_grid_value(static_cast<int>(bounce_sampler.get1D() * ((GRID_SIZE*GRID_SIZE)-1)));
 
             auto nr = ray(
               (nearesthit.pos + point(ray_x, ray_y, 0)) - point(0.5,0.5,0),
-              nearesthit.normal + random_dir()
+              nearesthit.normal + randomDir(bounce_sampler)
             );
 
-            reflection_colour += rayCast(nr, scene, bounces-1);
+            reflection_colour += rayCast(nr, scene, bounces-1, bounce_sampler);
           }
         }
 
@@ -2,9 +2,51 @@
 
 #include <vector>
 #include <memory>
+#include <string>
+#include <cstdint>
 
 class ray;
 class point;
 class object;
+class scene_t;
+class sampler;
+class texture_cache;
+class environment_map;
+struct features;
+struct hit;
 
-auto rayCast(ray r, const std::vector<std::shared_ptr<object>> scene, int bounces) -> point;
+// first_hit, if given, receives the albedo, normal and depth of the primary hit
+auto rayCast(ray r, const scene_t& scene, int bounces, sampler& s, features* first_hit = nullptr) -> point;
+
+// base colour of obj at h, textures filtered over r's footprint there
+auto surfaceColour(const object& obj, const hit& h, const ray& r, bool primary) -> point;
+
+// index in scene of the nearest object along r, or -1 for none, with its
+// albedo, normal and depth in surface. Nothing is shaded
+auto firstHit(const ray& r, const scene_t& scene, features& surface) -> int;
+
+// bit for scene object i in a touched mask, every 64th object shares one
+constexpr auto objectBit(size_t i) -> uint64_t { return uint64_t(1) << (i % 64); }
+// while set, every object rayCast shades on this thread adds its bit to
+// *mask. Shadow rays don't count, they only depend on where things are
+auto recordTouched(uint64_t* mask) -> void;
+
+// records held by the distributed tracing irradiance cache
+auto irradianceCacheSize() -> size_t;
+auto clearIrradianceCache() -> void;
+
+// path guiding for path tracing, see guiding.hpp. Reset per scene, then call
+// trainPathGuide() after every pass with the samples per pixel traced so far;
+// the guide is refined each time that count doubles.
+auto resetPathGuide(const scene_t& scene) -> void;
+auto trainPathGuide(int spp) -> void;
+auto pathGuideLeaves() -> size_t;
+
+// textures for object::texture, see texture.hpp. Open them before tracing
+auto loadTexture(const std::string& file) -> int;
+auto textureCache() -> texture_cache&;
+
+// the environment map, see environment.hpp. Empty until loaded, which is
+// before tracing
+auto loadEnvironment(const std::string& file) -> void;
+auto environmentMap() -> const environment_map&;